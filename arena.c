@@ -0,0 +1,226 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file arena.c
+ *  This file contains the arena allocator and string interning functions
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "arena.h"
+
+//#define DEBUG_ARENA
+#define ERROR_ARENA
+
+#ifdef DEBUG_ARENA
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_ARENA
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Initial number of interned strings index buckets */
+#define INITIAL_STRING_SIZE     64
+
+/* FNV-1a hash parameters */
+#define FNV_OFFSET_BASIS        2166136261u
+#define FNV_PRIME               16777619u
+
+/* Initialize an arena */
+void init_arena(arena_t *arena)
+{
+    arena->chunks = NULL;
+    arena->current = NULL;
+    memset(arena->free_lists, 0, sizeof (arena->free_lists));
+    arena->strings = NULL;
+    arena->string_count = 0;
+    arena->string_size = 0;
+}
+
+/* Reset an arena, all its allocations are released at once but its chunks
+ * are kept for reuse
+ */
+void reset_arena(arena_t *arena)
+{
+    arena_chunk_t *chunk;
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = chunk->next) {
+        chunk->used = 0;
+    }
+    arena->current = arena->chunks;
+    memset(arena->free_lists, 0, sizeof (arena->free_lists));
+    if (arena->strings != NULL) {
+        memset(arena->strings, 0, arena->string_size * sizeof (char *));
+    }
+    arena->string_count = 0;
+}
+
+/* Free an arena and all its chunks */
+void free_arena(arena_t *arena)
+{
+    arena_chunk_t *chunk, *next;
+
+    for (chunk = arena->chunks; chunk != NULL; chunk = next) {
+        next = chunk->next;
+        free(chunk);
+    }
+    free(arena->strings);
+    init_arena(arena);
+}
+
+/* Allocate memory from an arena */
+void *arena_alloc(arena_t *arena, size_t size)
+{
+    arena_chunk_t *chunk, **link;
+    size_t chunk_size;
+    void *pointer;
+
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+
+    /* Reuse a freed allocation of the same size class first */
+    if (size > 0 && size <= ARENA_MAX_FREE_SIZE &&
+        (pointer = arena->free_lists[size / ARENA_ALIGNMENT - 1]) != NULL) {
+        arena->free_lists[size / ARENA_ALIGNMENT - 1] = *(void **) pointer;
+        return pointer;
+    }
+
+    /* Look for room in the current chunk or in the next reusable ones */
+    for (chunk = arena->current; chunk != NULL; chunk = chunk->next) {
+        if (chunk->size - chunk->used >= size) {
+            arena->current = chunk;
+            pointer = &chunk->data[chunk->used];
+            chunk->used += size;
+            return pointer;
+        }
+    }
+
+    /* Append a new chunk, large enough for oversized allocations */
+    chunk_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+    chunk = (arena_chunk_t *) malloc(sizeof (arena_chunk_t) + chunk_size);
+    if (chunk == NULL) {
+        FK_ERROR("Cannot allocate arena chunk\n");
+        return NULL;
+    }
+    FK_DEBUG("New arena chunk of %zu bytes\n", chunk_size);
+    chunk->next = NULL;
+    chunk->size = chunk_size;
+    chunk->used = size;
+    for (link = &arena->chunks; *link != NULL; link = &(*link)->next);
+    *link = chunk;
+    arena->current = chunk;
+    return chunk->data;
+}
+
+/* Free an allocation of the given size into the free list of its size
+ * class. A larger one is only released when the arena is reset
+ */
+void arena_free(arena_t *arena, void *pointer, size_t size)
+{
+    size = (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+    if (pointer == NULL || size == 0 || size > ARENA_MAX_FREE_SIZE) {
+        return;
+    }
+    *(void **) pointer = arena->free_lists[size / ARENA_ALIGNMENT - 1];
+    arena->free_lists[size / ARENA_ALIGNMENT - 1] = pointer;
+}
+
+/* Hash a string */
+static uint32_t hash_string(const char *string)
+{
+    uint32_t hash = FNV_OFFSET_BASIS;
+
+    while (*string) {
+        hash = (hash ^ (uint8_t) *string++) * FNV_PRIME;
+    }
+    return hash;
+}
+
+/* Find the interned strings index bucket holding a string, or the empty
+ * bucket where it would be inserted, using linear probing
+ */
+static unsigned int find_string(const arena_t *arena, const char *string)
+{
+    unsigned int bucket, mask = arena->string_size - 1;
+
+    for (bucket = hash_string(string) & mask; arena->strings[bucket] != NULL &&
+        strcmp(arena->strings[bucket], string) != 0;
+        bucket = (bucket + 1) & mask);
+    return bucket;
+}
+
+/* Grow the interned strings index */
+static bool grow_strings(arena_t *arena)
+{
+    const char **strings = arena->strings;
+    unsigned int i, size = arena->string_size;
+
+    arena->string_size = size ? 2 * size : INITIAL_STRING_SIZE;
+    arena->strings = (const char **) calloc(arena->string_size,
+        sizeof (char *));
+    if (arena->strings == NULL) {
+        FK_ERROR("Cannot allocate interned strings index\n");
+        arena->strings = strings;
+        arena->string_size = size;
+        return false;
+    }
+    for (i = 0; i < size; i++) {
+        if (strings[i] != NULL) {
+            arena->strings[find_string(arena, strings[i])] = strings[i];
+        }
+    }
+    free(strings);
+    return true;
+}
+
+/* Intern a string in an arena, identical strings share the same storage */
+const char *arena_intern(arena_t *arena, const char *string)
+{
+    unsigned int bucket;
+    size_t length;
+    char *copy;
+
+    /* The interned strings index is kept at most half full */
+    if (2 * (arena->string_count + 1) > arena->string_size &&
+        grow_strings(arena) == false) {
+        return NULL;
+    }
+    bucket = find_string(arena, string);
+    if (arena->strings[bucket] != NULL) {
+        return arena->strings[bucket];
+    }
+    length = strlen(string) + 1;
+    copy = (char *) arena_alloc(arena, length);
+    if (copy == NULL) {
+        return NULL;
+    }
+    memcpy(copy, string, length);
+    arena->strings[bucket] = copy;
+    arena->string_count++;
+    return copy;
+}
@@ -0,0 +1,76 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file arena.h
+ *  This file contains the arena allocator and string interning functions
+ *
+ *  An arena is a chain of chunks in which allocations are carved out
+ *  sequentially. The whole arena is reset in one step, and its chunks are
+ *  kept for reuse, so that a steady-state workload does not call malloc()
+ *  anymore. Small allocations may also be freed individually into free lists
+ *  per size class, from which the next allocations of the same size are
+ *  taken first, so that replacing them over and over does not grow the arena.
+ */
+
+#ifndef _ARENA_H_
+#define _ARENA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Default arena chunk size */
+#define ARENA_CHUNK_SIZE    4096
+
+/* Allocation alignment, and largest allocation size recycled in the free
+ * lists, each aligned size being a size class
+ */
+#define ARENA_ALIGNMENT     sizeof (void *)
+#define ARENA_MAX_FREE_SIZE 512
+#define ARENA_FREE_CLASSES  (ARENA_MAX_FREE_SIZE / ARENA_ALIGNMENT)
+
+/* Arena chunk */
+typedef struct arena_chunk_t {
+    struct arena_chunk_t *next;
+    size_t size;
+    size_t used;
+    char data[];
+} arena_chunk_t;
+
+/* Arena, with its free lists and interned strings open-addressing index */
+typedef struct {
+    arena_chunk_t *chunks;
+    arena_chunk_t *current;
+    void *free_lists[ARENA_FREE_CLASSES];
+    const char **strings;
+    unsigned int string_count;
+    unsigned int string_size;
+} arena_t;
+
+void init_arena(arena_t *arena);
+void reset_arena(arena_t *arena);
+void free_arena(arena_t *arena);
+void *arena_alloc(arena_t *arena, size_t size);
+void arena_free(arena_t *arena, void *pointer, size_t size);
+const char *arena_intern(arena_t *arena, const char *string);
+
+#endif // _ARENA_H_
@@ -0,0 +1,1031 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file command_executor.c
+ *  This file contains the asynchronous Shell command executor functions
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include "command_executor.h"
+#include "timer_queue.h"
+
+//#define DEBUG_COMMAND_EXECUTOR
+#define ERROR_COMMAND_EXECUTOR
+
+#ifdef DEBUG_COMMAND_EXECUTOR
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_COMMAND_EXECUTOR
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Program search path when PATH is not set */
+#define DEFAULT_COMMAND_PATH    "/usr/local/bin:/usr/bin:/bin"
+
+/* Command server Shell script: the handlers file is sourced, then each
+ * command line received on the standard input is evaluated with the
+ * standard input redirected, and its exit status sent back on descriptor 3
+ */
+#define COMMAND_SERVER_SCRIPT   ". \"$1\" || exit; " \
+    "while read -r fkgpiod_command; do " \
+    "eval \"$fkgpiod_command\" </dev/null 3>&-; echo $? >&3; done"
+
+/* Shell script running a command server handler with execution attributes
+ * in a new Shell: the handlers file is sourced, then the command evaluated
+ */
+#define COMMAND_HANDLER_SCRIPT  ". \"$1\" || exit; eval \"$2\""
+
+/* Characters requiring a Shell to interpret the command */
+#define SHELL_SYNTAX_CHARACTERS "|&;<>()$`\\\"'*?[]#~={}!\n"
+
+extern char **environ;
+
+/* Running command, with its command channel if any, and its timeout timer
+ * if any, first sending SIGTERM then SIGKILL to its process group
+ */
+typedef struct {
+    pid_t pid;
+    uint64_t start_us;
+    int channel;
+    int timer;
+    bool terminated;
+} running_command_t;
+
+/* Command channel: the running and queued executions of a command with an
+ * execution policy, free when none
+ */
+typedef struct {
+    char command[MAX_COMMAND_LENGTH + 1];
+    command_options_t options;
+    unsigned int max_running;
+    unsigned int max_queued;
+    unsigned int running;
+    unsigned int queued;
+} command_channel_t;
+
+/* Command execution statistics */
+typedef struct {
+    unsigned int started;
+    unsigned int queued;
+    unsigned int coalesced;
+    unsigned int dropped;
+    unsigned int failed;
+    unsigned int timed_out;
+} command_stats_t;
+
+/* Control group, with its open process list file */
+typedef struct {
+    char path[MAX_CGROUP_PATH_LENGTH + 1];
+    int fd;
+} command_cgroup_t;
+
+/* Program resolved against the PATH directories */
+typedef struct {
+    char name[MAX_PROGRAM_NAME_LENGTH + 1];
+    char path[MAX_PROGRAM_PATH_LENGTH + 1];
+    dev_t dev;
+    ino_t ino;
+    time_t mtime;
+} resolved_program_t;
+
+#undef X
+#define X(a, b) b,
+static const char *policy_names[] = {COMMAND_POLICIES};
+
+/* Running commands */
+static running_command_t running_commands[MAX_NUM_COMMANDS];
+
+/* Command channels and statistics */
+static command_channel_t channels[MAX_NUM_COMMAND_CHANNELS];
+static command_stats_t stats;
+
+/* Control groups */
+static command_cgroup_t cgroups[MAX_NUM_COMMAND_CGROUPS];
+static unsigned int cgroup_count;
+
+/* Resolved programs cache, and next one to replace */
+static resolved_program_t resolved_programs[MAX_NUM_RESOLVED_PROGRAMS];
+static unsigned int next_resolved_program;
+
+/* SIGCHLD signalfd */
+static int fd_sigchld = -1;
+
+/* Command server process, socket, handlers file and handlers, pending commands with their
+ * command channels in order, and partially received exit status line
+ */
+static pid_t server_pid;
+static int fd_server = -1;
+static char server_file[MAX_SERVER_FILE_LENGTH + 1];
+static char server_handlers[MAX_NUM_SERVER_HANDLERS][MAX_PROGRAM_NAME_LENGTH + 1];
+static unsigned int server_handler_count;
+static unsigned int server_pending;
+static unsigned int server_first;
+static int server_channels[MAX_SERVER_PENDING];
+static char server_buffer[16];
+static size_t server_bytes;
+
+/* Shutdown command process, in its own reserved slot */
+static pid_t shutdown_pid;
+
+static void finish_command(int index);
+
+/* Initialize the command executor, returns the SIGCHLD signalfd to listen to
+ * or -1 upon error
+ */
+int init_command_executor(void)
+{
+    sigset_t ss;
+
+    /* The SIGCHLD signals are only received through the signalfd */
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGCHLD);
+    if (sigprocmask(SIG_BLOCK, &ss, NULL) < 0) {
+        FK_ERROR("Cannot block SIGCHLD: %s\n", strerror(errno));
+        return -1;
+    }
+    fd_sigchld = signalfd(-1, &ss, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (fd_sigchld < 0) {
+        FK_ERROR("Cannot create SIGCHLD signalfd: %s\n", strerror(errno));
+        return -1;
+    }
+    memset(running_commands, 0, sizeof (running_commands));
+    return fd_sigchld;
+}
+
+/* Deinitialize the command executor, the running commands are left running */
+void deinit_command_executor(void)
+{
+    stop_command_server();
+    if (fd_sigchld >= 0) {
+        close(fd_sigchld);
+        fd_sigchld = -1;
+    }
+    for (; cgroup_count; cgroup_count--) {
+        close(cgroups[cgroup_count - 1].fd);
+    }
+}
+
+/* Split a command without Shell syntax into its arguments in place, returns
+ * the number of arguments or -1 if the Shell is required
+ */
+static int split_command(char *buffer, char **argv)
+{
+    char *token, *next_token;
+    int argc = 0;
+
+    if (strpbrk(buffer, SHELL_SYNTAX_CHARACTERS) != NULL) {
+        return -1;
+    }
+    for (token = strtok_r(buffer, " \t", &next_token); token != NULL;
+        token = strtok_r(NULL, " \t", &next_token)) {
+        if (argc == MAX_COMMAND_ARGS) {
+            return -1;
+        }
+        argv[argc++] = token;
+    }
+    argv[argc] = NULL;
+    return argc > 0 ? argc : -1;
+}
+
+/* Parse a command into an argument vector stored in an arena, followed by
+ * its split arguments in a single allocation, returns NULL if the command
+ * requires the Shell or is too long, or upon allocation error
+ */
+char *const *parse_command(arena_t *arena, const char *command)
+{
+    char buffer[MAX_COMMAND_LENGTH + 1], *argv[MAX_COMMAND_ARGS + 1];
+    char **new_argv, *new_buffer;
+    size_t length = strlen(command) + 1;
+    int argc, i;
+
+    if (length > sizeof (buffer)) {
+        return NULL;
+    }
+    memcpy(buffer, command, length);
+    if ((argc = split_command(buffer, argv)) < 0) {
+        return NULL;
+    }
+    new_argv = (char **) arena_alloc(arena, (argc + 1) * sizeof (char *) +
+        length);
+    if (new_argv == NULL) {
+        return NULL;
+    }
+    new_buffer = (char *) &new_argv[argc + 1];
+    memcpy(new_buffer, buffer, length);
+    for (i = 0; i < argc; i++) {
+        new_argv[i] = new_buffer + (argv[i] - buffer);
+    }
+    new_argv[argc] = NULL;
+    return new_argv;
+}
+
+/* Release an argument vector parsed from a command into an arena */
+void release_command(arena_t *arena, const char *command, char *const *argv)
+{
+    unsigned int argc;
+
+    if (argv == NULL) {
+        return;
+    }
+    for (argc = 0; argv[argc] != NULL; argc++);
+    arena_free(arena, (void *) argv, (argc + 1) * sizeof (char *) +
+        strlen(command) + 1);
+}
+
+/* Search a program in the PATH directories */
+static bool search_program(const char *name, char *path, struct stat *st)
+{
+    const char *directory, *end;
+    int length;
+
+    directory = getenv("PATH");
+    if (directory == NULL) {
+        directory = DEFAULT_COMMAND_PATH;
+    }
+    for (;; directory = end + 1) {
+        end = strchr(directory, ':');
+        if (end == NULL) {
+            end = directory + strlen(directory);
+        }
+
+        /* An empty directory, even the last one, is the current directory */
+        if (end == directory) {
+            length = snprintf(path, MAX_PROGRAM_PATH_LENGTH + 1, "./%s",
+                name);
+        } else {
+            length = snprintf(path, MAX_PROGRAM_PATH_LENGTH + 1, "%.*s/%s",
+                (int) (end - directory), directory, name);
+        }
+        if (length <= MAX_PROGRAM_PATH_LENGTH && stat(path, st) == 0 &&
+            S_ISREG(st->st_mode) && access(path, X_OK) == 0) {
+            return true;
+        }
+        if (*end == '\0') {
+            return false;
+        }
+    }
+}
+
+/* Resolve a program name against the PATH directories, returns its path or
+ * NULL if it is not found. The resolved paths are cached, and a cached path
+ * is only searched again if its inode or modification time changed
+ */
+static const char *resolve_program(const char *name)
+{
+    resolved_program_t *program;
+    struct stat st;
+
+    if (strchr(name, '/') != NULL) {
+        return name;
+    }
+    if (strlen(name) > MAX_PROGRAM_NAME_LENGTH) {
+        return NULL;
+    }
+    for (program = resolved_programs;
+        program < &resolved_programs[MAX_NUM_RESOLVED_PROGRAMS]; program++) {
+        if (strcmp(program->name, name) != 0) {
+            continue;
+        }
+        if (stat(program->path, &st) == 0 && st.st_dev == program->dev &&
+            st.st_ino == program->ino &&
+            st.st_mtime == program->mtime) {
+            return program->path;
+        }
+        break;
+    }
+    if (program == &resolved_programs[MAX_NUM_RESOLVED_PROGRAMS]) {
+
+        /* Replace the cached programs in turn */
+        program = &resolved_programs[next_resolved_program];
+        next_resolved_program = (next_resolved_program + 1) %
+            MAX_NUM_RESOLVED_PROGRAMS;
+    }
+    if (search_program(name, program->path, &st) == false) {
+        program->name[0] = '\0';
+        return NULL;
+    }
+    FK_DEBUG("Resolved program \"%s\" to \"%s\"\n", name, program->path);
+    strcpy(program->name, name);
+    program->dev = st.st_dev;
+    program->ino = st.st_ino;
+    program->mtime = st.st_mtime;
+    return program->path;
+}
+
+/* Set the execution attributes of a forked command in the child before it
+ * executes its program: its priority, CPU affinity mask and control group
+ */
+static bool set_command_attributes(const command_options_t *options,
+    int priority)
+{
+    unsigned long cpu_mask = options->cpu_mask;
+    char buffer[16];
+    int length;
+
+    if (options->nice && setpriority(PRIO_PROCESS, 0, priority) < 0) {
+        FK_ERROR("Cannot set pid %d priority: %s\n", (int) getpid(),
+            strerror(errno));
+        return false;
+    }
+
+    /* The raw system call takes a plain CPU mask */
+    if (cpu_mask && syscall(SYS_sched_setaffinity, 0, sizeof (cpu_mask),
+        &cpu_mask) < 0) {
+        FK_ERROR("Cannot set pid %d CPU affinity: %s\n", (int) getpid(),
+            strerror(errno));
+        return false;
+    }
+    if (options->cgroup) {
+        length = snprintf(buffer, sizeof (buffer), "%d\n", (int) getpid());
+        if (write(cgroups[options->cgroup - 1].fd, buffer, length) < 0) {
+            FK_ERROR("Cannot move pid %d to control group \"%s\": %s\n",
+                (int) getpid(), cgroups[options->cgroup - 1].path,
+                strerror(errno));
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Fork a program with the default signal dispositions and mask, and its
+ * execution attributes set in the child before exec, so that they apply from
+ * its very start. The child exits with status 126 if they cannot be set, or
+ * 127 if the program cannot be executed
+ */
+static int fork_command(pid_t *pid, const char *path, char *const argv[],
+    const command_options_t *options)
+{
+    sigset_t ss;
+    int priority = 0;
+
+    /* The nice increment is relative to the daemon */
+    if (options->nice) {
+        errno = 0;
+        priority = getpriority(PRIO_PROCESS, 0);
+        if (errno != 0) {
+            return errno;
+        }
+        priority += options->nice;
+    }
+    if ((*pid = fork()) < 0) {
+        return errno;
+    } else if (*pid > 0) {
+
+        /* Also set in the parent, so that the timeout cannot miss it */
+        if (options->timeout_ms) {
+            setpgid(*pid, *pid);
+        }
+        return 0;
+    }
+    signal(SIGCHLD, SIG_DFL);
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    sigemptyset(&ss);
+    sigprocmask(SIG_SETMASK, &ss, NULL);
+    if (options->timeout_ms) {
+        setpgid(0, 0);
+    }
+    if (set_command_attributes(options, priority) == false) {
+        _exit(126);
+    }
+    execve(path, argv, environ);
+    FK_ERROR("Cannot execute \"%s\": %s\n", path, strerror(errno));
+    _exit(127);
+}
+
+/* Spawn a program with the default signal mask and dispositions, and the
+ * given file actions if any. With execution options, a command with a timeout
+ * runs in its own process group, and a command with a nice increment, CPU
+ * affinity mask or control group is forked to set them before exec
+ */
+static int spawn_command(pid_t *pid, const char *path, char *const argv[],
+    const posix_spawn_file_actions_t *actions,
+    const command_options_t *options)
+{
+    posix_spawnattr_t attr;
+    sigset_t ss;
+    int result;
+    bool process_group = options != NULL && options->timeout_ms;
+
+    if (options != NULL && (options->nice || options->cpu_mask ||
+        options->cgroup)) {
+        return fork_command(pid, path, argv, options);
+    }
+    posix_spawnattr_init(&attr);
+    sigemptyset(&ss);
+    posix_spawnattr_setsigmask(&attr, &ss);
+    sigemptyset(&ss);
+    sigaddset(&ss, SIGCHLD);
+    sigaddset(&ss, SIGHUP);
+    sigaddset(&ss, SIGTERM);
+    sigaddset(&ss, SIGINT);
+    posix_spawnattr_setsigdefault(&attr, &ss);
+    posix_spawnattr_setpgroup(&attr, 0);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+        POSIX_SPAWN_SETSIGDEF | (process_group ? POSIX_SPAWN_SETPGROUP : 0));
+    result = posix_spawn(pid, path, actions, &attr, argv, environ);
+    posix_spawnattr_destroy(&attr);
+    return result;
+}
+
+/* Terminate a timed out command: its process group is sent SIGTERM first,
+ * then SIGKILL if it did not terminate after a delay. The timer is cancelled
+ * when the command is reaped, so that its pid cannot have been reused
+ */
+static void command_timeout_timer(void *data)
+{
+    running_command_t *running_command = (running_command_t *) data;
+
+    if (running_command->terminated == false) {
+        FK_ERROR("Command pid %d timed out\n", (int) running_command->pid);
+        stats.timed_out++;
+        kill(-running_command->pid, SIGTERM);
+        running_command->terminated = true;
+        running_command->timer = add_timer(COMMAND_KILL_DELAY_US, 0,
+            command_timeout_timer, running_command);
+    } else {
+        FK_ERROR("Kill command pid %d\n", (int) running_command->pid);
+        kill(-running_command->pid, SIGKILL);
+        running_command->timer = NO_TIMER;
+    }
+}
+
+/* Check if a program is a handler of the command server */
+static bool is_server_handler(const char *name)
+{
+    unsigned int i;
+
+    if (fd_server < 0) {
+        return false;
+    }
+    for (i = 0; i < server_handler_count; i++) {
+        if (strcmp(server_handlers[i], name) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Send a command to the command server. The socket is written without
+ * SIGPIPE, and a server found lost is stopped, so that its handlers are
+ * spawned instead
+ */
+static bool send_server_command(const char *command, int channel)
+{
+    char buffer[MAX_COMMAND_LENGTH + 2];
+    int length;
+
+    if (server_pending == MAX_SERVER_PENDING) {
+        FK_ERROR("Too many server commands in progress\n");
+        return false;
+    }
+    length = snprintf(buffer, sizeof (buffer), "%s\n", command);
+    if (length >= (int) sizeof (buffer)) {
+        FK_ERROR("Server command \"%s\" too long\n", command);
+        return false;
+    }
+    if (send(fd_server, buffer, length, MSG_NOSIGNAL) != length) {
+        FK_ERROR("Cannot send server command \"%s\": %s\n", command,
+            strerror(errno));
+        if (errno == EPIPE || errno == ECONNRESET) {
+            FK_ERROR("Command server lost\n");
+            stop_command_server();
+        }
+        return false;
+    }
+    FK_DEBUG("Server command \"%s\" sent\n", command);
+    server_channels[(server_first + server_pending++) % MAX_SERVER_PENDING] =
+        channel;
+    return true;
+}
+
+/* Start the command server: a Shell sourcing a handlers file once, then
+ * running the given handlers, usually Shell functions, sent by the daemon
+ * over a socketpair without spawning any process per command
+ */
+bool start_command_server(const char *file, char *const *handlers,
+    unsigned int handler_count)
+{
+    posix_spawn_file_actions_t actions;
+    char *argv[] = {COMMAND_SHELL, "-c", COMMAND_SERVER_SCRIPT,
+        "fkgpiod-server", (char *) file, NULL};
+    int sv[2], result;
+    unsigned int i;
+
+    stop_command_server();
+    if (handler_count > MAX_NUM_SERVER_HANDLERS) {
+        FK_ERROR("More than %d server handlers\n", MAX_NUM_SERVER_HANDLERS);
+        return false;
+    }
+    if (strlen(file) > MAX_SERVER_FILE_LENGTH) {
+        FK_ERROR("Server handlers file name \"%s\" too long\n", file);
+        return false;
+    }
+
+    /* The server would exit at once if it could not source the file */
+    if (access(file, R_OK) < 0) {
+        FK_ERROR("Cannot read server handlers file \"%s\": %s\n", file,
+            strerror(errno));
+        return false;
+    }
+    for (i = 0; i < handler_count; i++) {
+        if (strlen(handlers[i]) > MAX_PROGRAM_NAME_LENGTH) {
+            FK_ERROR("Server handler name \"%s\" too long\n", handlers[i]);
+            return false;
+        }
+    }
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0) {
+        FK_ERROR("Cannot create server socketpair: %s\n", strerror(errno));
+        return false;
+    }
+
+    /* The server end is its standard input and status descriptor */
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], STDIN_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, sv[1], 3);
+    result = spawn_command(&server_pid, COMMAND_SHELL, argv, &actions, NULL);
+    posix_spawn_file_actions_destroy(&actions);
+    close(sv[1]);
+    if (result != 0) {
+        FK_ERROR("Cannot start command server: %s\n", strerror(result));
+        close(sv[0]);
+        server_pid = 0;
+        return false;
+    }
+    fcntl(sv[0], F_SETFL, O_NONBLOCK);
+    fd_server = sv[0];
+    strcpy(server_file, file);
+    for (i = 0; i < handler_count; i++) {
+        strcpy(server_handlers[i], handlers[i]);
+    }
+    server_handler_count = handler_count;
+    server_pending = 0;
+    server_first = 0;
+    server_bytes = 0;
+    FK_DEBUG("Command server \"%s\" running as pid %d\n", file,
+        (int) server_pid);
+    return true;
+}
+
+/* Stop the command server, it terminates upon end of file. Its pending
+ * commands are considered terminated, and the queued executions of their
+ * command channels are dropped
+ */
+void stop_command_server(void)
+{
+    command_channel_t *channel;
+    int index;
+
+    if (fd_server >= 0) {
+        FK_DEBUG("Stop command server\n");
+        close(fd_server);
+        fd_server = -1;
+    }
+    for (; server_pending; server_pending--) {
+        index = server_channels[server_first];
+        server_first = (server_first + 1) % MAX_SERVER_PENDING;
+        if (index >= 0) {
+            channel = &channels[index];
+            channel->running--;
+            stats.dropped += channel->queued;
+            channel->queued = 0;
+        }
+    }
+    server_handler_count = 0;
+}
+
+/* Get the command server socket to listen to, or -1 if not running */
+int get_command_server_fd(void)
+{
+    return fd_server;
+}
+
+/* Read the exit status of the commands run by the command server, called
+ * when its socket is readable
+ */
+void read_command_server(void)
+{
+    ssize_t read_bytes;
+    char *end;
+    int index;
+
+    while ((read_bytes = read(fd_server, &server_buffer[server_bytes],
+        sizeof (server_buffer) - 1 - server_bytes)) > 0) {
+        server_bytes += read_bytes;
+        server_buffer[server_bytes] = '\0';
+        while ((end = strchr(server_buffer, '\n')) != NULL) {
+            *end = '\0';
+            FK_DEBUG("Server command exited with status %s\n",
+                server_buffer);
+            if (server_pending) {
+                server_pending--;
+                index = server_channels[server_first];
+                server_first = (server_first + 1) % MAX_SERVER_PENDING;
+                finish_command(index);
+            }
+            server_bytes -= end + 1 - server_buffer;
+            memmove(server_buffer, end + 1, server_bytes + 1);
+        }
+        if (server_bytes == sizeof (server_buffer) - 1) {
+            server_bytes = 0;
+        }
+
+        /* A queued command may have found the server lost */
+        if (fd_server < 0) {
+            return;
+        }
+    }
+    if (read_bytes == 0 || (read_bytes < 0 && errno != EAGAIN)) {
+
+        /* The server exited, its handlers are spawned again */
+        FK_ERROR("Command server lost\n");
+        stop_command_server();
+    }
+}
+
+/* Spawn a command either from its argument vector, or from its string if
+ * NULL: a command without Shell syntax is executed directly, otherwise or if
+ * it is not found as a program, it is executed by the Shell
+ */
+static int launch_command(pid_t *pid, const char *command, char *const *argv,
+    const command_options_t *options)
+{
+    char *shell_argv[] = {COMMAND_SHELL, "-c", (char *) command, NULL};
+    const char *path;
+    int result = ENOENT;
+
+    if (argv != NULL && (path = resolve_program(argv[0])) != NULL) {
+        result = spawn_command(pid, path, argv, NULL, options);
+    }
+    if (result == ENOENT) {
+
+        /* Shell syntax, Shell builtin or function */
+        result = spawn_command(pid, COMMAND_SHELL, shell_argv, NULL, options);
+    }
+    return result;
+}
+
+/* Start a command without waiting for its termination, either from its
+ * argument vector parsed beforehand, or from its string if NULL, with the
+ * given execution options if any. The handlers of the command server are
+ * sent to it instead, unless they have execution attributes, which the
+ * command server cannot apply: they are then run by a new Shell sourcing the
+ * handlers file
+ */
+static bool start_command(const char *command, char *const *argv,
+    int channel, const command_options_t *options)
+{
+    running_command_t *running_command;
+    char buffer[MAX_COMMAND_LENGTH + 1], *split_argv[MAX_COMMAND_ARGS + 1];
+    char *handler_argv[] = {COMMAND_SHELL, "-c", COMMAND_HANDLER_SCRIPT,
+        "fkgpiod-handler", server_file, (char *) command, NULL};
+    int result;
+    bool handler = false;
+    pid_t pid;
+
+    if (argv == NULL && strlen(command) <= MAX_COMMAND_LENGTH) {
+
+        /* Split the command into its arguments */
+        strcpy(buffer, command);
+        if (split_command(buffer, split_argv) > 0) {
+            argv = split_argv;
+        }
+    }
+    if (argv != NULL && is_server_handler(argv[0])) {
+        handler = options != NULL && (options->nice || options->cpu_mask ||
+            options->cgroup || options->timeout_ms);
+        if (handler == false) {
+            if (send_server_command(command, channel)) {
+                stats.started++;
+                return true;
+            }
+            if (fd_server >= 0) {
+                stats.failed++;
+                return false;
+            }
+
+            /* The command server was lost, the handler is spawned instead */
+        }
+    }
+    for (running_command = running_commands;
+        running_command < &running_commands[MAX_NUM_COMMANDS] &&
+        running_command->pid != 0; running_command++);
+    if (running_command == &running_commands[MAX_NUM_COMMANDS]) {
+        FK_ERROR("Too many commands in progress\n");
+        stats.failed++;
+        return false;
+    }
+    if (handler) {
+        result = spawn_command(&pid, COMMAND_SHELL, handler_argv, NULL,
+            options);
+    } else {
+        result = launch_command(&pid, command, argv, options);
+    }
+    if (result != 0) {
+        FK_ERROR("Cannot execute command \"%s\": %s\n", command,
+            strerror(result));
+        stats.failed++;
+        return false;
+    }
+    FK_DEBUG("Command \"%s\" running as pid %d\n", command, (int) pid);
+    running_command->pid = pid;
+    running_command->start_us = get_time_us();
+    running_command->channel = channel;
+    running_command->timer = NO_TIMER;
+    running_command->terminated = false;
+    if (options != NULL && options->timeout_ms) {
+        running_command->timer = add_timer(options->timeout_ms * 1000ULL, 0,
+            command_timeout_timer, running_command);
+    }
+    stats.started++;
+    return true;
+}
+
+/* Get the command channel of a command with an execution policy, returns -1
+ * if none is available
+ */
+static int get_command_channel(const char *command,
+    const command_options_t *options)
+{
+    command_channel_t *channel, *free_channel = NULL;
+    unsigned int limit = options->limit ? options->limit : 1;
+
+    for (channel = channels; channel < &channels[MAX_NUM_COMMAND_CHANNELS];
+        channel++) {
+        if (channel->running == 0 && channel->queued == 0) {
+            if (free_channel == NULL) {
+                free_channel = channel;
+            }
+        } else if (strcmp(channel->command, command) == 0) {
+            break;
+        }
+    }
+    if (channel == &channels[MAX_NUM_COMMAND_CHANNELS]) {
+        if (free_channel == NULL) {
+            FK_ERROR("Too many command channels in progress\n");
+            return -1;
+        }
+        if (strlen(command) > MAX_COMMAND_LENGTH) {
+            FK_ERROR("Command \"%s\" too long\n", command);
+            return -1;
+        }
+        channel = free_channel;
+        strcpy(channel->command, command);
+    }
+
+    /* The last execution options of a command apply */
+    channel->options = *options;
+    channel->max_running = options->policy == POLICY_PARALLEL ? limit : 1;
+    channel->max_queued = options->policy == POLICY_QUEUE ? limit :
+        options->policy == POLICY_COALESCE ? 1 : 0;
+    return channel - channels;
+}
+
+/* Terminate an execution of a command channel, and start its next queued
+ * executions if any. If one cannot be started, the remaining ones are
+ * dropped, as nothing would start them anymore
+ */
+static void finish_command(int index)
+{
+    command_channel_t *channel;
+
+    if (index < 0) {
+        return;
+    }
+    channel = &channels[index];
+    channel->running--;
+    while (channel->queued && channel->running < channel->max_running) {
+        channel->queued--;
+        FK_DEBUG("Start queued command \"%s\"\n", channel->command);
+        if (start_command(channel->command, NULL, index,
+            &channel->options) == false) {
+            stats.dropped += channel->queued;
+            channel->queued = 0;
+            break;
+        }
+        channel->running++;
+    }
+}
+
+/* Execute a command according to its execution options if any */
+bool execute_command(const char *command, char *const *argv,
+    const command_options_t *options)
+{
+    command_channel_t *channel;
+    int index;
+
+    if (options == NULL || options->policy == POLICY_DEFAULT) {
+        return start_command(command, argv, -1, options);
+    }
+    if ((index = get_command_channel(command, options)) < 0) {
+        stats.failed++;
+        return false;
+    }
+    channel = &channels[index];
+    if (channel->running < channel->max_running) {
+        if (start_command(command, argv, index, options) == false) {
+            return false;
+        }
+        channel->running++;
+    } else if (channel->queued < channel->max_queued) {
+        FK_DEBUG("Queue command \"%s\"\n", command);
+        channel->queued++;
+        stats.queued++;
+    } else if (channel->options.policy == POLICY_COALESCE) {
+        FK_DEBUG("Coalesce command \"%s\"\n", command);
+        stats.coalesced++;
+    } else {
+        FK_DEBUG("Drop command \"%s\"\n", command);
+        stats.dropped++;
+    }
+    return true;
+}
+
+/* Execute a shutdown command in its own reserved slot, directly without the
+ * command server, the execution policies nor the running commands limit
+ */
+bool execute_shutdown_command(const char *command, char *const *argv)
+{
+    int result;
+
+    if (shutdown_pid != 0) {
+        FK_ERROR("Shutdown command already running as pid %d\n",
+            (int) shutdown_pid);
+        return false;
+    }
+    result = launch_command(&shutdown_pid, command, argv, NULL);
+    if (result != 0) {
+        FK_ERROR("Cannot execute shutdown command \"%s\": %s\n", command,
+            strerror(result));
+        shutdown_pid = 0;
+        return false;
+    }
+    FK_DEBUG("Shutdown command \"%s\" running as pid %d\n", command,
+        (int) shutdown_pid);
+    return true;
+}
+
+/* Dump the command execution statistics */
+void dump_command_stats(void)
+{
+    printf("commands started %u queued %u coalesced %u dropped %u failed %u "
+        "timed_out %u\n", stats.started, stats.queued, stats.coalesced,
+        stats.dropped, stats.failed, stats.timed_out);
+}
+
+/* Register a control group from its directory path, returns its number or -1
+ * upon error. Its process list file is opened once and kept open
+ */
+int register_command_cgroup(const char *path)
+{
+    command_cgroup_t *cgroup;
+    char name[MAX_CGROUP_PATH_LENGTH + 16];
+    unsigned int i;
+
+    for (i = 0; i < cgroup_count; i++) {
+        if (strcmp(cgroups[i].path, path) == 0) {
+            return i + 1;
+        }
+    }
+    if (cgroup_count == MAX_NUM_COMMAND_CGROUPS) {
+        FK_ERROR("More than %d control groups\n", MAX_NUM_COMMAND_CGROUPS);
+        return -1;
+    }
+    if (strlen(path) > MAX_CGROUP_PATH_LENGTH) {
+        FK_ERROR("Control group path \"%s\" too long\n", path);
+        return -1;
+    }
+    cgroup = &cgroups[cgroup_count];
+    snprintf(name, sizeof (name), "%s/cgroup.procs", path);
+    cgroup->fd = open(name, O_WRONLY | O_CLOEXEC);
+    if (cgroup->fd < 0) {
+        FK_ERROR("Cannot open \"%s\": %s\n", name, strerror(errno));
+        return -1;
+    }
+    strcpy(cgroup->path, path);
+    return ++cgroup_count;
+}
+
+/* Get a control group path from its number */
+const char *command_cgroup_path(unsigned int cgroup)
+{
+    if (cgroup >= 1 && cgroup <= cgroup_count) {
+        return cgroups[cgroup - 1].path;
+    }
+    return "?";
+}
+
+/* Check if two command execution options are the same */
+bool equal_command_options(const command_options_t *options,
+    const command_options_t *other)
+{
+    return options->policy == other->policy &&
+        options->limit == other->limit && options->nice == other->nice &&
+        options->cpu_mask == other->cpu_mask &&
+        options->cgroup == other->cgroup &&
+        options->timeout_ms == other->timeout_ms;
+}
+
+/* Get a command execution policy name */
+const char *command_policy_name(command_policy_t policy)
+{
+    if (policy <= POLICY_PARALLEL) {
+        return policy_names[policy];
+    }
+    return "?";
+}
+
+/* Lookup a command execution policy from its name, returns -1 if unknown */
+int lookup_command_policy(const char *name)
+{
+    int policy;
+
+    for (policy = POLICY_DROP; policy <= POLICY_PARALLEL; policy++) {
+        if (strcasecmp(name, policy_names[policy]) == 0) {
+            return policy;
+        }
+    }
+    return -1;
+}
+
+/* Reap the terminated commands, called when the SIGCHLD signalfd is readable
+ */
+void reap_commands(void)
+{
+    struct signalfd_siginfo info;
+    running_command_t *running_command;
+    int status;
+    pid_t pid;
+
+    /* Drain the signalfd, several terminations may share a signal */
+    while (read(fd_sigchld, &info, sizeof (info)) == sizeof (info));
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+        if (pid == server_pid) {
+            FK_DEBUG("Command server pid %d exited\n", (int) pid);
+            server_pid = 0;
+            continue;
+        }
+        if (pid == shutdown_pid) {
+            FK_DEBUG("Shutdown command pid %d exited\n", (int) pid);
+            shutdown_pid = 0;
+            continue;
+        }
+        for (running_command = running_commands;
+            running_command < &running_commands[MAX_NUM_COMMANDS];
+            running_command++) {
+            if (running_command->pid != pid) {
+                continue;
+            }
+            FK_DEBUG("Command pid %d exited with status %d after %llu us\n",
+                (int) pid, WIFEXITED(status) ? WEXITSTATUS(status) : -1,
+                (unsigned long long) (get_time_us() -
+                running_command->start_us));
+            running_command->pid = 0;
+            cancel_timer(running_command->timer);
+            finish_command(running_command->channel);
+            break;
+        }
+    }
+}
@@ -0,0 +1,142 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file command_executor.h
+ *  This file contains the asynchronous Shell command executor functions
+ *
+ *  The mapped commands are spawned with posix_spawn() without waiting for
+ *  them, so that a long running command does not stall the button events,
+ *  or forked when their execution attributes must be set before exec.
+ *  A command is executed directly unless it contains Shell syntax, and the
+ *  terminated commands are reaped by the main loop through a SIGCHLD
+ *  signalfd. The commands of the mappings are parsed once into argument
+ *  vectors, and their programs are resolved against PATH once and cached.
+ *  Optionally, a command server Shell runs the handlers of a preloaded file,
+ *  such as Shell functions, without any process startup per command.
+ */
+
+#ifndef _COMMAND_EXECUTOR_H_
+#define _COMMAND_EXECUTOR_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "arena.h"
+
+/* Maximum number of simultaneously running commands */
+#define MAX_NUM_COMMANDS        16
+
+/* Maximum length and number of arguments of a directly executed command */
+#define MAX_COMMAND_LENGTH      256
+#define MAX_COMMAND_ARGS        16
+
+/* Number of cached resolved programs, maximum program name and path lengths
+ */
+#define MAX_NUM_RESOLVED_PROGRAMS   16
+#define MAX_PROGRAM_NAME_LENGTH     31
+#define MAX_PROGRAM_PATH_LENGTH     127
+
+/* Maximum number of commands with an execution policy running or queued at
+ * once, and maximum execution policy limit
+ */
+#define MAX_NUM_COMMAND_CHANNELS    16
+#define MAX_COMMAND_LIMIT           16
+
+/* Maximum number of control groups, and control group path length */
+#define MAX_NUM_COMMAND_CGROUPS     8
+#define MAX_CGROUP_PATH_LENGTH      127
+
+/* Command nice increment range, highest CPU of the affinity mask and
+ * maximum timeout in ms
+ */
+#define MIN_COMMAND_NICE            (-20)
+#define MAX_COMMAND_NICE            19
+#define MAX_COMMAND_CPU             7
+#define MAX_COMMAND_TIMEOUT_MS      3600000
+
+/* Delay in us before killing a timed out command that did not terminate */
+#define COMMAND_KILL_DELAY_US       (1000 * 1000)
+
+/* Maximum number of command server handlers and pending commands, and
+ * maximum handlers file name length
+ */
+#define MAX_NUM_SERVER_HANDLERS     16
+#define MAX_SERVER_PENDING          16
+#define MAX_SERVER_FILE_LENGTH      127
+
+/* Shell used for the commands containing Shell syntax */
+#define COMMAND_SHELL           "/bin/sh"
+
+/* Definition of the different command execution policies, applied to the
+ * executions of a command while it is running:
+ * - DROP: the new executions are dropped
+ * - COALESCE: the new executions are coalesced into a single one run next
+ * - QUEUE: up to limit new executions are queued and run one after the other
+ * - PARALLEL: up to limit executions run in parallel, the others are dropped
+ */
+#define COMMAND_POLICIES \
+    X(POLICY_DEFAULT, "") \
+    X(POLICY_DROP, "DROP") \
+    X(POLICY_COALESCE, "COALESCE") \
+    X(POLICY_QUEUE, "QUEUE") \
+    X(POLICY_PARALLEL, "PARALLEL")
+
+/* Enumeration of the different command execution policies */
+#undef X
+#define X(a, b) a,
+typedef enum {COMMAND_POLICIES} command_policy_t;
+
+/* Command execution options: the execution policy, and for the spawned
+ * commands the nice increment, CPU affinity mask (0 for all CPUs), control
+ * group (0 for none, otherwise its number) and timeout in ms (0 for none)
+ */
+typedef struct {
+    command_policy_t policy;
+    uint8_t limit;
+    int8_t nice;
+    uint8_t cpu_mask;
+    uint8_t cgroup;
+    uint32_t timeout_ms;
+} command_options_t;
+
+int init_command_executor(void);
+void deinit_command_executor(void);
+char *const *parse_command(arena_t *arena, const char *command);
+void release_command(arena_t *arena, const char *command, char *const *argv);
+bool execute_command(const char *command, char *const *argv,
+    const command_options_t *options);
+bool execute_shutdown_command(const char *command, char *const *argv);
+void reap_commands(void);
+bool start_command_server(const char *file, char *const *handlers,
+    unsigned int handler_count);
+void stop_command_server(void);
+int get_command_server_fd(void);
+void read_command_server(void);
+void dump_command_stats(void);
+int register_command_cgroup(const char *path);
+const char *command_cgroup_path(unsigned int cgroup);
+bool equal_command_options(const command_options_t *options,
+    const command_options_t *other);
+const char *command_policy_name(command_policy_t policy);
+int lookup_command_policy(const char *name);
+
+#endif // _COMMAND_EXECUTOR_H_
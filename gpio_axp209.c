@@ -27,12 +27,14 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <syslog.h>
 #include <unistd.h>
 #include <linux/input.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include "gpio_axp209.h"
+#include "i2c_regmap.h"
 #include "smbus.h"
 
 //#define DEBUG_AXP209
@@ -50,44 +52,76 @@
     #define FK_ERROR(...)
 #endif
 
-/* AXP209 I2C PMIC pseudo-file descriptor */
-static int fd_axp209;
+/* AXP209 PMIC chip register shadow cache */
+#undef X
+#define X(name, address, width, access, cache, reset) \
+    REGMAP_CACHE_FIELD(name, width, cache)
+typedef struct {
+    AXP209_REGISTERS
+} axp209_cache_t;
+
+/* AXP209 I2C PMIC pseudo-file descriptor, -1 when closed */
+static int fd_axp209 = -1;
+
+/* AXP209 PMIC chip register shadow cache */
+static axp209_cache_t axp209_cache;
 
 /* The I2C bus pseudo-file name */
 static const char i2c0_sysfs_filename[] = "/dev/i2c-0";
 
+/* AXP209 PMIC chip register accessors, axp209_read_<name>() and
+ * axp209_write_<name>()
+ */
+#undef X
+#define X(name, address, width, access, cache, reset) \
+    REGMAP_ACCESSORS(axp209, fd_axp209, axp209_cache, name, address, width, \
+        access, cache)
+AXP209_REGISTERS
+
+/* AXP209 PMIC chip initialization sequence:
+ * - set PEK Long press delay to 2.5s,
+ * - set N_OE Shutdown delay to 3s,
+ * - enable only chosen interrupts (PEK short and long presses)
+ */
+#define AXP209_INIT_SEQUENCE \
+    X(REG_PEK_PARAMS,          0x9F) \
+    X(REG_32H,                 0x47) \
+    X(INTERRUPT_BANK_3_ENABLE, 0x03)
+
+#undef X
+#define X(name, value)  REGMAP_BATCH_ENTRY(AXP209, name, value)
+static const regmap_batch_t axp209_init_sequence[] = {
+    AXP209_INIT_SEQUENCE
+};
+
+#define AXP209_INIT_SEQUENCE_LENGTH \
+    (sizeof (axp209_init_sequence) / sizeof (axp209_init_sequence[0]))
+
 /* Initialize the AXP209 PMIC chip */
 bool axp209_init(void)
 {
     /* Open the I2C bus pseudo-file */
-    if ((fd_axp209 = open(i2c0_sysfs_filename,O_RDWR)) < 0) {
+    if ((fd_axp209 = i2c_open(i2c0_sysfs_filename,O_RDWR)) < 0) {
         FK_ERROR("Failed to open the I2C bus %s", i2c0_sysfs_filename);
         return false;
     }
 
     /* Acquire the bus access for the AXP209 PMIC chip */
-    if (ioctl(fd_axp209, I2C_SLAVE, AXP209_I2C_ADDR) < 0) {
+    if (i2c_ioctl(fd_axp209, I2C_SLAVE, AXP209_I2C_ADDR) < 0) {
         FK_DEBUG("Failed to acquire bus access and/or talk to slave, trying to force it\n");
-        if (ioctl(fd_axp209, I2C_SLAVE_FORCE, AXP209_I2C_ADDR) < 0) {
+        if (i2c_ioctl(fd_axp209, I2C_SLAVE_FORCE, AXP209_I2C_ADDR) < 0) {
             FK_ERROR("Failed to acquire FORCED bus access and/or talk to slave.\n");
+            close(fd_axp209);
+            fd_axp209 = -1;
             return false;
         }
     }
 
-    /* Set PEK Long press delay to 2.5s */
-    if (i2c_smbus_write_byte_data(fd_axp209, AXP209_REG_PEK_PARAMS, 0x9F) < 0) {
-        FK_ERROR("Cannot set AXP209 PEK Long press delay to 2.5s\n");
-    }
-
-    /* Set N_OE Shutdown delay to 3s*/
-    if (i2c_smbus_write_byte_data(fd_axp209, AXP209_REG_32H, 0x47) < 0) {
-        FK_ERROR("Cannot set AXP209 N_OE Shutdown delay to 3s\n");
-    }
-
-    /* Enable only chosen interrupts (PEK short and long presses)*/
-    if (i2c_smbus_write_byte_data(fd_axp209, AXP209_INTERRUPT_BANK_3_ENABLE,
-        0x03) < 0) {
-        FK_ERROR("Cannot intiialize interrupt bank 3 for AXP209\n");
+    /* Configure the PMIC chip, a failure here is not fatal */
+    memset(&axp209_cache, 0, sizeof (axp209_cache));
+    if (regmap_write_batch(fd_axp209, AXP209_I2C_ADDR, axp209_init_sequence,
+        AXP209_INIT_SEQUENCE_LENGTH) == false) {
+        FK_ERROR("Cannot initialize AXP209\n");
     }
     return true;
 }
@@ -96,8 +130,13 @@ bool axp209_init(void)
 bool axp209_deinit(void)
 {
 
-    /* Close the I2C bus pseudo-file */
-    close(fd_axp209);
+    /* Close the I2C bus pseudo-file, unless a failed initialization already
+     * closed it
+     */
+    if (fd_axp209 >= 0) {
+        close(fd_axp209);
+        fd_axp209 = -1;
+    }
     return true;
 }
 
@@ -106,13 +145,13 @@ int axp209_read_interrupt_bank_3(void)
 {
   int value, result;
 
-    value = i2c_smbus_read_byte_data(fd_axp209, AXP209_INTERRUPT_BANK_3_STATUS);
+    value = axp209_read_INTERRUPT_BANK_3_STATUS();
     if (value  < 0) {
         return value;
     }
 
     /* Clear the interrupts */
-    result = i2c_smbus_write_byte_data(fd_axp209, AXP209_INTERRUPT_BANK_3_STATUS, 0xFF);
+    result = axp209_write_INTERRUPT_BANK_3_STATUS(0xFF);
     if (result < 0) {
         return result;
     }
@@ -29,23 +29,34 @@
 #define _GPIO_AXP209_H_
 
 #include <stdbool.h>
+#include "i2c_regmap.h"
 
 /* Chip physical address */
 #define AXP209_I2C_ADDR                         0x34
 
-/* Chip register adresses */
-#define AXP209_REG_32H                          0x32
-#define AXP209_REG_PEK_PARAMS                   0x36
-#define AXP209_INTERRUPT_BANK_1_ENABLE          0x40
-#define AXP209_INTERRUPT_BANK_1_STATUS          0x48
-#define AXP209_INTERRUPT_BANK_2_ENABLE          0x41
-#define AXP209_INTERRUPT_BANK_2_STATUS          0x49
-#define AXP209_INTERRUPT_BANK_3_ENABLE          0x42
-#define AXP209_INTERRUPT_BANK_3_STATUS          0x4A
-#define AXP209_INTERRUPT_BANK_4_ENABLE          0x43
-#define AXP209_INTERRUPT_BANK_4_STATUS          0x4B
-#define AXP209_INTERRUPT_BANK_5_ENABLE          0x44
-#define AXP209_INTERRUPT_BANK_5_STATUS          0x4C
+/* AXP209 I2C PMIC interrupt pin */
+#define GPIO_PIN_AXP209_INTERRUPT               ((('B' - '@') << 4) + 5) // PB5
+
+/* Chip register map (see i2c_regmap.h) */
+#define AXP209_REGISTERS \
+    X(REG_32H,                 0x32, 8, RW, CACHED,   0x46) \
+    X(REG_PEK_PARAMS,          0x36, 8, RW, CACHED,   0x5D) \
+    X(INTERRUPT_BANK_1_ENABLE, 0x40, 8, RW, CACHED,   0xD8) \
+    X(INTERRUPT_BANK_2_ENABLE, 0x41, 8, RW, CACHED,   0xFF) \
+    X(INTERRUPT_BANK_3_ENABLE, 0x42, 8, RW, CACHED,   0x3B) \
+    X(INTERRUPT_BANK_4_ENABLE, 0x43, 8, RW, CACHED,   0xC3) \
+    X(INTERRUPT_BANK_5_ENABLE, 0x44, 8, RW, CACHED,   0x00) \
+    X(INTERRUPT_BANK_1_STATUS, 0x48, 8, RW, VOLATILE, 0x00) \
+    X(INTERRUPT_BANK_2_STATUS, 0x49, 8, RW, VOLATILE, 0x00) \
+    X(INTERRUPT_BANK_3_STATUS, 0x4A, 8, RW, VOLATILE, 0x00) \
+    X(INTERRUPT_BANK_4_STATUS, 0x4B, 8, RW, VOLATILE, 0x00) \
+    X(INTERRUPT_BANK_5_STATUS, 0x4C, 8, RW, VOLATILE, 0x00)
+
+/* Chip register addresses, AXP209_<name>, and widths, AXP209_<name>_WIDTH */
+#undef X
+#define X(name, address, width, access, cache, reset) \
+    REGMAP_ENUM(AXP209, name, address, width, access)
+enum {AXP209_REGISTERS};
 
 /* Masks */
 #define AXP209_INTERRUPT_PEK_SHORT_PRESS        0x02
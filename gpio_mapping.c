@@ -36,16 +36,24 @@
 #include <sys/time.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include "command_executor.h"
 #include "gpio_utils.h"
 #include "gpio_axp209.h"
 #include "gpio_mapping.h"
 #include "gpio_pcal6416a.h"
+#include "key_repeat.h"
 #include "mapping_list.h"
+#include "mapping_table.h"
+#include "mouse_motion.h"
+#include "native_action.h"
 #include "parse_config.h"
+#include "shutdown.h"
+#include "timer_queue.h"
 #include "uinput.h"
 
 //#define DEBUG_GPIO
 //#define DEBUG_PERIODIC_CHECK
+#define NOTICE_GPIO
 #define ERROR_GPIO
 
 #ifdef DEBUG_GPIO
@@ -60,6 +68,12 @@
     #define FK_PERIODIC(...)
 #endif
 
+#ifdef NOTICE_GPIO
+    #define FK_NOTICE(...) syslog(LOG_NOTICE, __VA_ARGS__);
+#else
+    #define FK_NOTICE(...)
+#endif
+
 #ifdef ERROR_GPIO
     #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
 #else
@@ -68,6 +82,15 @@
 
 #define FIFO_FILE               "/tmp/fkgpiod.fifo"
 
+/* The sysfs GPIO pseudo-files signal interrupts as exceptional conditions,
+ * whereas the simulated ones are eventfds signaling read availability
+ */
+#ifdef SIMULATION
+#define interrupt_fds           read_fds
+#else
+#define interrupt_fds           except_fds
+#endif
+
 /* These defines force to perform a GPIO sanity check after a timeout.
  * If not declared, there will be no timeout and no periodical sanity check of
  * GPIO expander values
@@ -75,14 +98,39 @@
 //#define TIMEOUT_SEC_SANITY_CHECK_GPIO_EXP     1
 #define TIMEOUT_MICROSEC_SANITY_CHECK_GPIO_EXP  (30 * 1000)
 
-/* Short Power Enable Key (PEK) duration in microseconds */
-#define SHORT_PEK_PRESS_DURATION_US             (200 * 1000)
+#ifdef TIMEOUT_MICROSEC_SANITY_CHECK_GPIO_EXP
+#define SANITY_CHECK_PERIOD_US  TIMEOUT_MICROSEC_SANITY_CHECK_GPIO_EXP
+#elif TIMEOUT_SEC_SANITY_CHECK_GPIO_EXP
+#define SANITY_CHECK_PERIOD_US  (TIMEOUT_SEC_SANITY_CHECK_GPIO_EXP * 1000000)
+#endif
+
+/* I2C retry backoff: the delay before retrying a failed I2C access starts at
+ * the base delay and doubles at each consecutive failure up to the maximum
+ * delay
+ */
+#define I2C_RETRY_BASE_US                       (1 * 1000)
+#define I2C_RETRY_MAX_US                        (128 * 1000)
 
-/* PCAL6416A I2C GPIO expander interrupt pin */
-#define GPIO_PIN_I2C_EXPANDER_INTERRUPT         ((('B' - '@') << 4) + 3) // PB3
+/* I2C retry budget: number of consecutive failed retries before the chip is
+ * reinitialized
+ */
+#define I2C_RETRY_BUDGET                        4
+
+/* Delay before compiling the mapping table after a mapping list change */
+#define MAPPING_TABLE_COMPILE_DELAY_US          (100 * 1000)
 
-/* AXP209 I2C PMIC interrupt pin */
-#define GPIO_PIN_AXP209_INTERRUPT               ((('B' - '@') << 4) + 5) // PB5
+/* Press variant gesture durations: a long press is held at least the long
+ * press duration, and a double tap is pressed again within the double tap
+ * delay after the first release
+ */
+#define LONG_PRESS_DURATION_US                  (500 * 1000)
+#define DOUBLE_TAP_DELAY_US                     (300 * 1000)
+
+/* Maximum number of simultaneously tracked press variant gestures */
+#define MAX_NUM_GESTURES                        16
+
+/* Short Power Enable Key (PEK) duration in microseconds */
+#define SHORT_PEK_PRESS_DURATION_US             (200 * 1000)
 
 /* Pseudo-bitmask for the short PEK key press */
 #define SHORT_PEK_PRESS_GPIO_MASK               (1 << 5)
@@ -90,8 +138,83 @@
 /* Pseudo-bitmask for the NOE signal */
 #define NOE_GPIO_MASK                           (1 << 10)
 
-/* Shell command for shutdown upon receiving either long PEK or NOE signal */
-#define SHELL_COMMAND_SHUTDOWN                  "powerdown schedule 0.1"
+/* Definition of the different I2C chip recovery states */
+#define I2C_STATES \
+    X(I2C_OK, "OK") \
+    X(I2C_RETRY, "RETRY") \
+    X(I2C_REINIT, "REINIT")
+
+/* Enumeration of the different I2C chip recovery states */
+#undef X
+#define X(a, b) a,
+typedef enum {I2C_STATES} i2c_state_t;
+
+#undef X
+#define X(a, b) b,
+static const char *i2c_state_names[] = {I2C_STATES};
+
+/* Definition of the different press variant gesture states */
+#define GESTURE_STATES \
+    X(GESTURE_IDLE, "IDLE") \
+    X(GESTURE_PRESSED, "PRESSED") \
+    X(GESTURE_LONG_HELD, "LONG_HELD") \
+    X(GESTURE_DOUBLE_WAIT, "DOUBLE_WAIT") \
+    X(GESTURE_DOUBLE_HELD, "DOUBLE_HELD")
+
+/* Enumeration of the different press variant gesture states */
+#undef X
+#define X(a, b) a,
+typedef enum {GESTURE_STATES} gesture_state_t;
+
+/* Press variant gesture context of a button combination, the variant mappings
+ * are looked up by GPIO mask upon recognition, as the mapping list may change
+ * in between
+ */
+typedef struct {
+    uint32_t gpio_mask;
+    gesture_state_t state;
+    uint64_t press_us;
+    int timer;
+    int keys[MAX_MAPPING_KEYS];
+    unsigned int key_count;
+    mapping_list_t *list;
+} gesture_t;
+
+/* I2C chip recovery context */
+typedef struct {
+    const char *name;
+    bool (*init)(void);
+    bool (*deinit)(void);
+    i2c_state_t state;
+    unsigned int failures;
+    int timer;
+    bool retry;
+
+    /* Recovery statistics */
+    unsigned int errors;
+    unsigned int retries;
+    unsigned int reinits;
+    unsigned int failed_reinits;
+    unsigned int recoveries;
+} i2c_chip_t;
+
+/* PCAL6416A/PCAL9539A I2C GPIO expander chip recovery context */
+static i2c_chip_t chip_pcal6416a = {
+    "PCAL6416A", pcal6416a_init, pcal6416a_deinit, I2C_OK, 0, NO_TIMER, false,
+    0, 0, 0, 0, 0
+};
+
+/* AXP209 I2C PMIC recovery context */
+static i2c_chip_t chip_axp209 = {
+    "AXP209", axp209_init, axp209_deinit, I2C_OK, 0, NO_TIMER, false,
+    0, 0, 0, 0, 0
+};
+
+#ifdef SANITY_CHECK_PERIOD_US
+
+/* Next GPIO sanity check deadline */
+static uint64_t sanity_check_deadline_us;
+#endif
 
 /* PCAL6416A/PCAL9539A I2C GPIO expander chip pseudo-file descriptor */
 static int fd_pcal6416a;
@@ -102,6 +225,9 @@ static int fd_axp209;
 /* FIFO pseudo-file descriptor */
 static int fd_fifo;
 
+/* Command executor SIGCHLD signalfd descriptor */
+static int fd_command;
+
 /* Mask of monitored GPIOs */
 static uint32_t monitored_gpio_mask;
 
@@ -114,41 +240,363 @@ static size_t total_bytes = 0;
 /* FIFO buffer */
 char fifo_buffer[256];
 
-/* Search for the GPIO mask into the mapping and apply the required actions */
-static void apply_mapping(mapping_list_t *list, uint32_t gpio_mask)
+/* Mapping context of the base mapping list or of a modifier layer: the
+ * mapping list, its compiled GPIO state to active mappings table, its
+ * deferred compilation timer and the GPIOs it maps
+ */
+typedef struct {
+    mapping_list_t *list;
+    mapping_table_t table;
+    int compile_timer;
+    uint32_t mapped_mask;
+    unsigned int mapped_generation;
+    uint32_t layer_gpio_mask;
+    bool toggled;
+} mapping_context_t;
+
+/* Mapping contexts, the base one first and then one per layer */
+#define BASE_CONTEXT            0
+static mapping_context_t contexts[MAX_NUM_LAYERS + 1];
+
+/* Maximum number of resident profiles */
+#define MAX_NUM_PROFILES        8
+
+/* No active profile */
+#define NO_PROFILE              -1
+
+/* Resident profile: a preloaded mapping list with its mapping contexts, which
+ * hold its compiled mapping tables. The mapping list and mapping contexts of
+ * the active profile are the live ones, its slot is then left empty
+ */
+typedef struct {
+    char name[MAX_PROFILE_NAME_LENGTH + 1];
+    mapping_list_t list;
+    mapping_context_t contexts[MAX_NUM_LAYERS + 1];
+} profile_t;
+
+/* Resident profiles and active profile index */
+static profile_t profiles[MAX_NUM_PROFILES];
+static unsigned int profile_count;
+static int active_profile = NO_PROFILE;
+
+/* Mapping context of the active layer, if any, and last layer GPIO mask */
+static mapping_context_t *layer_context;
+static uint32_t layer_gpio_mask;
+
+/* Chord recognition: GPIOs held back, window timer and last GPIO mask */
+static uint32_t chord_held_mask;
+static int chord_timer = NO_TIMER;
+static uint32_t chord_gpio_mask;
+
+/* Press variant gestures in progress */
+static gesture_t gestures[MAX_NUM_GESTURES];
+static unsigned int active_gestures;
+
+/* Find the gesture context of a button combination in a mapping list, or
+ * allocate a new one
+ */
+static gesture_t *find_gesture(mapping_list_t *list, uint32_t gpio_mask,
+    bool allocate)
+{
+    gesture_t *gesture, *free_gesture = NULL;
+
+    for (gesture = gestures; gesture < &gestures[MAX_NUM_GESTURES];
+        gesture++) {
+        if (gesture->state == GESTURE_IDLE) {
+            if (free_gesture == NULL) {
+                free_gesture = gesture;
+            }
+        } else if (gesture->gpio_mask == gpio_mask && gesture->list == list) {
+            return gesture;
+        }
+    }
+    if (allocate == false) {
+        return NULL;
+    }
+    if (free_gesture == NULL) {
+        FK_ERROR("Too many gestures in progress\n");
+        return NULL;
+    }
+    free_gesture->gpio_mask = gpio_mask;
+    free_gesture->list = list;
+    free_gesture->timer = NO_TIMER;
+    free_gesture->key_count = 0;
+    return free_gesture;
+}
+
+/* Execute the Shell command of a command mapping or of a key mapping with a
+ * command
+ */
+static void execute_mapping_command(const mapping_list_t *list,
+    const mapping_t *mapping)
+{
+    const char *command = mapping_command(list, mapping);
+
+    if (command != NULL) {
+        FK_DEBUG("\t--> Execute Shell command \"%s\"\n", command);
+        execute_command(command, mapping_argv(list, mapping),
+            mapping_options(list, mapping));
+    }
+}
+
+/* Change a gesture state, keeping track of the gestures in progress */
+static void set_gesture_state(gesture_t *gesture, gesture_state_t state)
+{
+    if (gesture->state == GESTURE_IDLE && state != GESTURE_IDLE) {
+        active_gestures++;
+    } else if (gesture->state != GESTURE_IDLE && state == GESTURE_IDLE) {
+        active_gestures--;
+    }
+    gesture->state = state;
+}
+
+/* Trigger a recognized press variant: a key is either pressed and released
+ * at once, or held until the button combination is released
+ */
+static void trigger_gesture(gesture_t *gesture, mapping_variant_t variant,
+    bool hold)
+{
+    mapping_t *mapping;
+    const int *keys;
+
+    mapping = find_mapping(gesture->list, gesture->gpio_mask, variant);
+    if (mapping == NULL) {
+        return;
+    }
+    FK_DEBUG("Gesture %s on gpio_mask 0x%04X\n", variant_name(variant),
+        gesture->gpio_mask);
+    if (mapping->type == MAPPING_KEY) {
+        FK_DEBUG("\t--> Key press %d\n", mapping->keycode);
+        keys = mapping_keys(gesture->list, mapping);
+        if (hold) {
+            press_keys(keys, mapping->key_count, mapping->repeat,
+                mapping->rate_hz);
+            memcpy(gesture->keys, keys, mapping->key_count * sizeof (int));
+            gesture->key_count = mapping->key_count;
+        } else {
+            sendKeys(keys, mapping->key_count, 1);
+            sendKeys(keys, mapping->key_count, 0);
+        }
+    } else if (mapping->type == MAPPING_ACTION) {
+        run_native_action(mapping->keycode, mapping->step);
+    }
+    execute_mapping_command(gesture->list, mapping);
+}
+
+/* Long press timer callback */
+static void long_press_timer(void *data)
+{
+    gesture_t *gesture = (gesture_t *) data;
+
+    gesture->timer = NO_TIMER;
+    if (gesture->state == GESTURE_PRESSED) {
+        set_gesture_state(gesture, GESTURE_LONG_HELD);
+        trigger_gesture(gesture, VARIANT_LONG, true);
+    }
+}
+
+/* Double tap timer callback, no second press came: this was a short press */
+static void double_tap_timer(void *data)
+{
+    gesture_t *gesture = (gesture_t *) data;
+
+    gesture->timer = NO_TIMER;
+    if (gesture->state == GESTURE_DOUBLE_WAIT) {
+        set_gesture_state(gesture, GESTURE_IDLE);
+        trigger_gesture(gesture, VARIANT_SHORT, false);
+    }
+}
+
+/* Handle the press of a button combination mapped with press variants */
+static void press_gesture(mapping_list_t *list, uint32_t gpio_mask)
+{
+    gesture_t *gesture;
+
+    gesture = find_gesture(list, gpio_mask, true);
+    if (gesture == NULL) {
+        return;
+    }
+    switch (gesture->state) {
+    case GESTURE_IDLE:
+        set_gesture_state(gesture, GESTURE_PRESSED);
+        gesture->press_us = get_time_us();
+        if (find_mapping(list, gpio_mask, VARIANT_LONG) != NULL) {
+            gesture->timer = add_timer(LONG_PRESS_DURATION_US, 0,
+                long_press_timer, gesture);
+        }
+        break;
+
+    case GESTURE_DOUBLE_WAIT:
+        cancel_timer(gesture->timer);
+        gesture->timer = NO_TIMER;
+        set_gesture_state(gesture, GESTURE_DOUBLE_HELD);
+        trigger_gesture(gesture, VARIANT_DOUBLE, false);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Handle the release of a button combination mapped with press variants. A
+ * gesture is aborted without triggering anything when its buttons are taken
+ * over by a mapping with more simultaneous buttons
+ */
+static void release_gesture(mapping_list_t *list, uint32_t gpio_mask,
+    bool aborted)
+{
+    gesture_t *gesture;
+
+    gesture = find_gesture(list, gpio_mask, false);
+    if (gesture == NULL) {
+        return;
+    }
+    switch (gesture->state) {
+    case GESTURE_PRESSED:
+        cancel_timer(gesture->timer);
+        gesture->timer = NO_TIMER;
+        if (aborted) {
+            FK_DEBUG("Gesture aborted on gpio_mask 0x%04X\n", gpio_mask);
+            set_gesture_state(gesture, GESTURE_IDLE);
+            break;
+        }
+
+        /* The press duration is checked in case the long press timer did not
+         * expire yet
+         */
+        if (get_time_us() - gesture->press_us >= LONG_PRESS_DURATION_US &&
+            find_mapping(gesture->list, gpio_mask, VARIANT_LONG) != NULL) {
+            set_gesture_state(gesture, GESTURE_IDLE);
+            trigger_gesture(gesture, VARIANT_LONG, false);
+        } else if (find_mapping(gesture->list, gpio_mask, VARIANT_DOUBLE) !=
+            NULL) {
+            set_gesture_state(gesture, GESTURE_DOUBLE_WAIT);
+            gesture->timer = add_timer(DOUBLE_TAP_DELAY_US, 0,
+                double_tap_timer, gesture);
+            if (gesture->timer == NO_TIMER) {
+                set_gesture_state(gesture, GESTURE_IDLE);
+                trigger_gesture(gesture, VARIANT_SHORT, false);
+            }
+        } else {
+            set_gesture_state(gesture, GESTURE_IDLE);
+            trigger_gesture(gesture, VARIANT_SHORT, false);
+        }
+        break;
+
+    case GESTURE_LONG_HELD:
+        if (gesture->key_count) {
+            FK_DEBUG("\t--> Key release %d\n", gesture->keys[0]);
+            release_keys(gesture->keys, gesture->key_count);
+            gesture->key_count = 0;
+        }
+        set_gesture_state(gesture, GESTURE_IDLE);
+        break;
+
+    case GESTURE_DOUBLE_HELD:
+        set_gesture_state(gesture, GESTURE_IDLE);
+        break;
+
+    default:
+        break;
+    }
+}
+
+/* Release the pressed gestures whose button combination is no longer fully
+ * pressed, in case their mapping was removed in the meantime
+ */
+static void release_stale_gestures(uint32_t gpio_mask)
+{
+    gesture_t *gesture;
+
+    if (active_gestures == 0) {
+        return;
+    }
+    for (gesture = gestures; gesture < &gestures[MAX_NUM_GESTURES];
+        gesture++) {
+        if (gesture->state != GESTURE_IDLE &&
+            gesture->state != GESTURE_DOUBLE_WAIT &&
+            (gesture->gpio_mask & ~gpio_mask) != 0) {
+            release_gesture(gesture->list, gesture->gpio_mask, false);
+        }
+    }
+}
+
+/* Activate a mapping */
+static void activate_mapping(mapping_list_t *list, mapping_t *mapping)
+{
+    mapping->activated = true;
+    if (mapping->variant != VARIANT_NONE) {
+
+        /* The press variant is recognized later on */
+        press_gesture(list, mapping->gpio_mask);
+    } else if (mapping->type == MAPPING_KEY) {
+
+        /* Send the key down events, repeat the last key while held and
+         * execute the command if any
+         */
+        FK_DEBUG("\t--> Key press %d\n", mapping->keycode);
+        press_keys(mapping_keys(list, mapping), mapping->key_count,
+            mapping->repeat, mapping->rate_hz);
+        execute_mapping_command(list, mapping);
+    } else if (mapping->type == MAPPING_COMMAND) {
+
+        /* Execute the corresponding Shell command */
+        execute_mapping_command(list, mapping);
+    } else if (mapping->type == MAPPING_ACTION) {
+
+        /* Run the native action */
+        run_native_action(mapping->keycode, mapping->step);
+    } else if (mapping->type == MAPPING_MOUSE) {
+
+        /* Move the pointer while held */
+        FK_DEBUG("\t--> Mouse motion %d\n", mapping->step);
+        start_mouse_motion(mapping->keycode, mapping->step);
+    }
+}
+
+/* Deactivate a mapping, a gesture is aborted if its buttons are still pressed
+ */
+static void deactivate_mapping(mapping_list_t *list, mapping_t *mapping)
+{
+    mapping->activated = false;
+    if (mapping->variant != VARIANT_NONE) {
+        release_gesture(list, mapping->gpio_mask,
+            (mapping->gpio_mask & ~chord_gpio_mask) == 0);
+    } else if (mapping->type == MAPPING_KEY) {
+
+        /* Send the key up events */
+        FK_DEBUG("\t--> Key release %d\n", mapping->keycode);
+        release_keys(mapping_keys(list, mapping), mapping->key_count);
+    } else if (mapping->type == MAPPING_MOUSE) {
+
+        /* Stop moving the pointer */
+        stop_mouse_motion(mapping->keycode, mapping->step);
+    }
+}
+
+/* Search for the GPIO mask into the whole mapping list and apply the required
+ * actions, used when the mapping table cannot be compiled
+ */
+static void apply_mapping_list(mapping_list_t *list, uint32_t gpio_mask)
 {
     mapping_t *mapping;
+    unsigned int i;
 
     /* Search the whole mapping sorted by decreasing simultaneous GPIO number
      * The whole mapping must be checked, as several GPIO combinations may be
      * active at the same time, and no longer matching combinations must be
      * deactivated
      */
-    for (mapping = first_mapping(list); !last_mapping(list, mapping);
-        mapping = next_mapping(mapping)) {
+    for_each_mapping(mapping, i, list) {
         if ((mapping->gpio_mask & gpio_mask) == mapping->gpio_mask)  {
 
             /* If the current GPIO mask contains the mapping GPIO mask */
             FK_DEBUG("Found matching mapping:\n");
 #ifdef DEBUG_GPIO
-            dump_mapping(mapping);
+            dump_mapping(list, mapping);
 #endif // DEBUG_GPIO
             if (mapping->activated == false) {
-
-                /* Activate mapping */
-                mapping->activated = true;
-                if (mapping->type == MAPPING_KEY) {
-
-                    /* Send the key down event */
-                    FK_DEBUG("\t--> Key press %d\n", mapping->value.keycode);
-                    sendKey(mapping->value.keycode, 1);
-                } else if (mapping->type == MAPPING_COMMAND) {
-
-                    /* Execute the corresponding Shell command */
-                    FK_DEBUG("\t--> Execute Shell command \"%s\"\n",
-                    mapping->value.command);
-                    system(mapping->value.command);
-                }
+                activate_mapping(list, mapping);
             }
 
             /* Subtract the matching GPIOs from
@@ -160,17 +608,417 @@ static void apply_mapping(mapping_list_t *list, uint32_t gpio_mask)
             /* Non-matching activated mapping, deactivate it */
             FK_DEBUG("Found activated mapping:\n");
 #ifdef DEBUG_GPIO
-            dump_mapping(mapping);
+            dump_mapping(list, mapping);
+#endif // DEBUG_GPIO
+            deactivate_mapping(list, mapping);
+        }
+    }
+}
+
+/* Evaluate incrementally the mappings involving the changed GPIOs in mapping
+ * list order, and apply the required actions. A mapping state change in turn
+ * triggers the evaluation of the next mappings involving its GPIOs
+ */
+static void apply_mapping_index(mapping_context_t *context,
+    uint32_t gpio_mask, uint32_t changed_mask)
+{
+    mapping_list_t *list = context->list;
+    mapping_table_t *table = &context->table;
+    mapping_t *mapping;
+    unsigned int word;
+    uint32_t mask;
+    int position, bit;
+    bool match;
+
+    memset(table->candidates, 0,
+        table->words * sizeof (uint32_t));
+    add_mapping_candidates(table, changed_mask, NO_OWNER);
+    for (word = 0; word < table->words; word++) {
+        while (table->candidates[word]) {
+            bit = __builtin_ctz(table->candidates[word]);
+            table->candidates[word] &= ~(1u << bit);
+            position = word * 32 + bit;
+            mapping = &list->mappings[list->order[position]];
+
+            /* The mapping matches if all its GPIOs are active and none of them
+             * is owned by an activated mapping with more simultaneous GPIOs
+             */
+            match = (mapping->gpio_mask & gpio_mask) == mapping->gpio_mask;
+            for (mask = mapping->gpio_mask; match && mask; mask &= mask - 1) {
+                bit = __builtin_ctz(mask);
+                if (table->owner[bit] != NO_OWNER &&
+                    table->owner[bit] < position) {
+                    match = false;
+                }
+            }
+            if (match && mapping->activated == false) {
+                FK_DEBUG("Found matching mapping:\n");
+                for (mask = mapping->gpio_mask; mask; mask &= mask - 1) {
+                    table->owner[__builtin_ctz(mask)] = position;
+                }
+                add_mapping_candidates(table, mapping->gpio_mask,
+                    position);
+                activate_mapping(list, mapping);
+            } else if (match == false && mapping->activated) {
+                FK_DEBUG("Found activated mapping:\n");
+                for (mask = mapping->gpio_mask; mask; mask &= mask - 1) {
+                    bit = __builtin_ctz(mask);
+                    if (table->owner[bit] == position) {
+                        table->owner[bit] = NO_OWNER;
+                    }
+                }
+                add_mapping_candidates(table, mapping->gpio_mask,
+                    position);
+                deactivate_mapping(list, mapping);
+            }
+        }
+    }
+}
+
+/* Mapping table compilation timer callback */
+static void compile_mapping_table_timer(void *data)
+{
+    mapping_context_t *context = (mapping_context_t *) data;
+
+    context->compile_timer = NO_TIMER;
+    if (context->table.generation != context->list->generation) {
+        compile_mapping_table(&context->table, context->list);
+    }
+}
+
+/* Look up the GPIO mask into the mapping table of a mapping context and apply
+ * the required actions for the difference between the previously and the
+ * newly active mapping sets
+ */
+static void apply_mapping(mapping_context_t *context, uint32_t gpio_mask)
+{
+    mapping_list_t *list = context->list;
+    mapping_table_t *table = &context->table;
+    mapping_t *mapping;
+    uint32_t i, mark, changed_mask;
+    int entry;
+
+    changed_mask = gpio_mask ^ table->gpio_mask;
+    table->gpio_mask = gpio_mask;
+    if (table->compiled == false ||
+        table->generation != list->generation) {
+
+        /* The mapping list has changed since the mapping table compilation,
+         * defer the compilation so that consecutive changes are compiled at
+         * once and that the GPIO events are not delayed
+         */
+        if (table->generation != list->generation &&
+            context->compile_timer == NO_TIMER) {
+            context->compile_timer = add_timer(MAPPING_TABLE_COMPILE_DELAY_US, 0,
+                compile_mapping_table_timer, context);
+        }
+
+        /* Meanwhile, evaluate incrementally the mappings involving the changed
+         * GPIOs only, or all of them if the mapping list has changed since
+         */
+        if (table->indexed == false ||
+            table->index_generation != list->generation) {
+            if (index_mapping_table(table, list) == false) {
+                apply_mapping_list(list, gpio_mask);
+                return;
+            }
+            changed_mask = table->mapped_mask;
+        }
+        if (changed_mask & table->mapped_mask) {
+            apply_mapping_index(context, gpio_mask, changed_mask);
+        }
+        return;
+    }
+
+    /* No mapped GPIO change */
+    if ((changed_mask & table->mapped_mask) == 0 &&
+        table->previous != NO_ENTRY) {
+        return;
+    }
+    entry = lookup_mapping_table(table, gpio_mask);
+    if (entry == table->previous) {
+
+        /* Same active mapping set, nothing to do */
+        return;
+    }
+    mark = mark_mapping_table(table, entry);
+
+    /* Deactivate the activated mappings that are no longer in the active set.
+     * Right after a compilation, the previous set is unknown and the whole
+     * mapping must be checked
+     */
+    if (table->previous == NO_ENTRY) {
+        for (i = 0; i < table->mapping_count; i++) {
+            mapping = &list->mappings[i];
+            if (mapping->activated && table->marks[i] != mark) {
+                FK_DEBUG("Found activated mapping:\n");
+                deactivate_mapping(list, mapping);
+            }
+        }
+    } else {
+        for (i = table->index[table->previous];
+            i < table->index[table->previous + 1]; i++) {
+            mapping = &list->mappings[table->pool[i]];
+            if (mapping->activated &&
+                table->marks[table->pool[i]] != mark) {
+                FK_DEBUG("Found activated mapping:\n");
+                deactivate_mapping(list, mapping);
+            }
+        }
+    }
+
+    /* Activate the mappings in the active set that are not yet activated */
+    for (i = table->index[entry]; i < table->index[entry + 1];
+        i++) {
+        mapping = &list->mappings[table->pool[i]];
+        if (mapping->activated == false) {
+            FK_DEBUG("Found matching mapping:\n");
+#ifdef DEBUG_GPIO
+            dump_mapping(list, mapping);
 #endif // DEBUG_GPIO
-            mapping->activated = false;
-            if (mapping->type == MAPPING_KEY) {
+            activate_mapping(list, mapping);
+        }
+    }
+    table->previous = entry;
+}
+
+/* Get the GPIOs mapped in a mapping context */
+static uint32_t context_mapped_mask(mapping_context_t *context)
+{
+    mapping_t *mapping;
+    unsigned int i;
+
+    if (context->mapped_generation != context->list->generation) {
+        context->mapped_mask = 0;
+        for_each_mapping(mapping, i, context->list) {
+            context->mapped_mask |= mapping->gpio_mask;
+        }
+        context->mapped_generation = context->list->generation;
+    }
+    return context->mapped_mask;
+}
+
+/* Apply the mapping for the GPIO mask through the modifier layers: the
+ * buttons of the fully pressed layer combinations are consumed, the buttons
+ * mapped by the active layer go to its mapping context and the other ones to
+ * the base mapping context. Switching layers only swaps the active layer
+ * context pointer, the per-event cost does not depend on the number of layers
+ * and mappings
+ */
+static void apply_layer_mapping(mapping_list_t *list, uint32_t gpio_mask)
+{
+    mapping_context_t *context, *active = NULL;
+    mapping_layer_t *layer;
+    uint32_t pressed_mask, consumed_mask = 0, mapped_mask;
+    unsigned int i;
+
+    pressed_mask = gpio_mask & ~layer_gpio_mask;
+    layer_gpio_mask = gpio_mask;
+    for (i = 0; i < list->layer_count; i++) {
+        layer = &list->layers[i];
+        context = &contexts[i + 1];
+        context->list = &layer->list;
+        if (context->layer_gpio_mask != layer->gpio_mask) {
+
+            /* New layer in this context, a layer published again by a LOAD
+             * keeps its toggle state
+             */
+            context->layer_gpio_mask = layer->gpio_mask;
+            context->toggled = false;
+        }
+        if ((gpio_mask & layer->gpio_mask) == layer->gpio_mask) {
+            consumed_mask |= layer->gpio_mask;
+            if (layer->toggle && (pressed_mask & layer->gpio_mask)) {
+                context->toggled = !context->toggled;
+                FK_DEBUG("Layer 0x%04X toggled %s\n", layer->gpio_mask,
+                    context->toggled ? "on" : "off");
+            }
+        }
+        if (active == NULL && (layer->toggle ? context->toggled :
+            (gpio_mask & layer->gpio_mask) == layer->gpio_mask)) {
+            active = context;
+        }
+    }
+    if (active != layer_context) {
+
+        /* Release the mappings of the previously active layer */
+        if (layer_context != NULL) {
+            apply_mapping(layer_context, 0);
+        }
+        layer_context = active;
+    }
+    gpio_mask &= ~consumed_mask;
+    if (layer_context == NULL) {
+        apply_mapping(&contexts[BASE_CONTEXT], gpio_mask);
+        return;
+    }
+    mapped_mask = context_mapped_mask(layer_context);
+    apply_mapping(&contexts[BASE_CONTEXT], gpio_mask & ~mapped_mask);
+    apply_mapping(layer_context, gpio_mask & mapped_mask);
+}
+
+/* Chord recognition window timer callback, the held back GPIOs are applied */
+static void chord_window_timer(void *data)
+{
+    mapping_list_t *list = (mapping_list_t *) data;
+
+    FK_DEBUG("Chord window expired, applying held GPIOs 0x%04X\n",
+        chord_held_mask);
+    chord_timer = NO_TIMER;
+    chord_held_mask = 0;
+    apply_layer_mapping(list, chord_gpio_mask);
+    release_stale_gestures(chord_gpio_mask);
+}
+
+/* Apply the mapping for the GPIO mask, holding back the newly pressed GPIOs
+ * that are an ambiguous prefix of a mapping with a chord recognition window,
+ * until the chord completes, a held GPIO is released, another GPIO is pressed
+ * or the window expires. The GPIOs that are not part of any chord are never
+ * delayed
+ */
+static void apply_chord_mapping(mapping_list_t *list, uint32_t gpio_mask)
+{
+    mapping_table_t *table = &contexts[BASE_CONTEXT].table;
+    mapping_chord_t *chord;
+    unsigned int i;
+    uint32_t pressed_mask, released_mask, hold_mask, window_us;
+    bool resolved;
+
+    if (table->chords_collected == false ||
+        table->chord_generation != list->generation) {
+        collect_mapping_chords(table, list);
+    }
+    pressed_mask = gpio_mask & ~chord_gpio_mask;
+    released_mask = chord_gpio_mask & ~gpio_mask;
+    chord_gpio_mask = gpio_mask;
+    if (chord_held_mask) {
+
+        /* A chord is pending: check if it is resolved */
+        resolved = (pressed_mask & ~table->chord_mask) != 0;
+        for (i = 0, chord = table->chords;
+            i < table->chord_count && resolved == false; i++, chord++) {
+            if ((chord->gpio_mask & chord_held_mask) &&
+                (chord->gpio_mask & ~gpio_mask) == 0) {
+                resolved = true;
+            }
+        }
+        if (released_mask & chord_held_mask) {
 
-                /* Send the key up event */
-                FK_DEBUG("\t--> Key release %d\n", mapping->value.keycode);
-                sendKey(mapping->value.keycode, 0);
+            /* Held GPIOs released early are still pressed and released */
+            FK_DEBUG("Chord tap 0x%04X\n", released_mask & chord_held_mask);
+            apply_layer_mapping(list, gpio_mask | (released_mask & chord_held_mask));
+            resolved = true;
+        }
+        if (resolved) {
+            cancel_timer(chord_timer);
+            chord_timer = NO_TIMER;
+            chord_held_mask = 0;
+        } else {
+            chord_held_mask |= pressed_mask;
+        }
+    } else if (pressed_mask & table->chord_mask) {
+
+        /* Hold back the newly pressed GPIOs of incomplete chords, unless a
+         * chord completes at once
+         */
+        hold_mask = 0;
+        window_us = 0;
+        for (i = 0, chord = table->chords;
+            i < table->chord_count; i++, chord++) {
+            if ((chord->gpio_mask & pressed_mask) == 0) {
+                continue;
+            }
+            if ((chord->gpio_mask & ~gpio_mask) == 0) {
+                hold_mask = 0;
+                break;
+            }
+            hold_mask |= chord->gpio_mask & pressed_mask;
+            if (chord->window_us > window_us) {
+                window_us = chord->window_us;
+            }
+        }
+        if (hold_mask) {
+            chord_timer = add_timer(window_us, 0, chord_window_timer, list);
+            if (chord_timer != NO_TIMER) {
+                FK_DEBUG("Chord hold 0x%04X for %u us\n", hold_mask,
+                    window_us);
+                chord_held_mask = hold_mask;
             }
         }
     }
+    apply_layer_mapping(list, gpio_mask & ~chord_held_mask);
+    release_stale_gestures(gpio_mask & ~chord_held_mask);
+}
+
+/* I2C retry timer callback, flag the chip for a forced access */
+static void i2c_retry_timer(void *data)
+{
+    i2c_chip_t *chip = (i2c_chip_t *) data;
+
+    chip->timer = NO_TIMER;
+    chip->retry = true;
+    chip->retries++;
+}
+
+/* Handle an I2C access failure: schedule a retry with exponential backoff,
+ * and reinitialize the chip once the retry budget is exhausted
+ */
+static void i2c_failure(i2c_chip_t *chip)
+{
+    uint64_t delay_us;
+
+    chip->errors++;
+    chip->failures++;
+    if (chip->failures > I2C_RETRY_BUDGET) {
+
+        /* Retry budget exhausted, reinitialize the chip */
+        chip->state = I2C_REINIT;
+        chip->reinits++;
+        FK_ERROR("%s I2C failure, reinitializing chip\n", chip->name);
+        chip->deinit();
+        if (chip->init() == false) {
+            chip->failed_reinits++;
+            FK_ERROR("Cannot reinitialize %s\n", chip->name);
+        }
+        chip->failures = 0;
+    } else if (chip->state == I2C_OK) {
+        FK_ERROR("%s I2C failure, retrying\n", chip->name);
+        chip->state = I2C_RETRY;
+    }
+
+    /* Schedule the next retry, keep the pending one if any */
+    if (chip->timer == NO_TIMER) {
+        delay_us = I2C_RETRY_BASE_US << (chip->failures < 8 ?
+            chip->failures : 8);
+        if (delay_us > I2C_RETRY_MAX_US) {
+            delay_us = I2C_RETRY_MAX_US;
+        }
+        chip->timer = add_timer(delay_us, 0, i2c_retry_timer, chip);
+    }
+}
+
+/* Handle an I2C access success, ending any recovery in progress */
+static void i2c_success(i2c_chip_t *chip)
+{
+    if (chip->state != I2C_OK) {
+        chip->recoveries++;
+        FK_NOTICE("%s I2C recovered after %u errors (%u retries, %u reinits)\n",
+            chip->name, chip->errors, chip->retries, chip->reinits);
+        chip->state = I2C_OK;
+        cancel_timer(chip->timer);
+        chip->timer = NO_TIMER;
+    }
+    chip->failures = 0;
+    chip->retry = false;
+}
+
+/* Dump the I2C recovery statistics of a chip */
+static void dump_i2c_chip(const i2c_chip_t *chip)
+{
+    printf("%s state %s errors %u retries %u reinits %u failed_reinits %u recoveries %u\n",
+        chip->name, i2c_state_names[chip->state], chip->errors,
+        chip->retries, chip->reinits, chip->failed_reinits,
+        chip->recoveries);
 }
 
 /* Initialize the GPIO interrupt for the I2C expander chip */
@@ -207,15 +1055,205 @@ static void deinit_gpio_interrupt(int fd)
     gpio_fd_close(fd);
 }
 
+/* Initialize a mapping context */
+static void init_mapping_context(mapping_context_t *context,
+    mapping_list_t *list)
+{
+    init_mapping_table(&context->table);
+    context->list = list;
+    context->compile_timer = NO_TIMER;
+    context->mapped_generation = 0;
+    context->layer_gpio_mask = 0;
+    context->toggled = false;
+}
+
+/* Reset the evaluation state of mapping contexts put aside, their compiled
+ * mapping tables and layer toggle states are kept
+ */
+static void reset_mapping_contexts(mapping_context_t *context_array)
+{
+    mapping_context_t *context;
+    unsigned int i;
+
+    for (i = 0; i <= MAX_NUM_LAYERS; i++) {
+        context = &context_array[i];
+        cancel_timer(context->compile_timer);
+        context->compile_timer = NO_TIMER;
+        context->table.gpio_mask = 0;
+        context->table.previous = NO_ENTRY;
+        context->table.indexed = false;
+    }
+}
+
+/* Free the mapping list and compiled mapping tables of a profile slot */
+static void free_profile(profile_t *profile)
+{
+    unsigned int i;
+
+    for (i = 0; i <= MAX_NUM_LAYERS; i++) {
+        free_mapping_table(&profile->contexts[i].table);
+        init_mapping_context(&profile->contexts[i], NULL);
+    }
+    free_mapping_list(&profile->list);
+}
+
+/* Find a resident profile by name */
+static int find_profile(const char *name)
+{
+    unsigned int i;
+
+    for (i = 0; i < profile_count; i++) {
+        if (strcmp(profiles[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return NO_PROFILE;
+}
+
+/* Compile the mapping tables of a profile */
+static void compile_profile(profile_t *profile)
+{
+    mapping_context_t *context;
+    unsigned int i;
+
+    context = &profile->contexts[BASE_CONTEXT];
+    context->list = &profile->list;
+    compile_mapping_table(&context->table, context->list);
+    collect_mapping_chords(&context->table, context->list);
+    for (i = 0; i < profile->list.layer_count; i++) {
+        context = &profile->contexts[i + 1];
+        context->list = &profile->list.layers[i].list;
+        context->layer_gpio_mask = profile->list.layers[i].gpio_mask;
+        compile_mapping_table(&context->table, context->list);
+    }
+}
+
+/* Preload a new mapping list as a resident profile, and compile its mapping
+ * tables at once. The new mapping list is moved into the profile and left
+ * empty, preloading the active profile again publishes it at once
+ */
+bool preload_profile(mapping_list_t *mapping_list, const char *name,
+    mapping_list_t *new_list)
+{
+    profile_t *profile;
+    unsigned int i;
+    int index;
+
+    index = find_profile(name);
+    if (index != NO_PROFILE && index == active_profile) {
+        publish_mapping_list(mapping_list, new_list);
+        return true;
+    }
+    if (index == NO_PROFILE) {
+        if (profile_count == MAX_NUM_PROFILES) {
+            FK_ERROR("Too many profiles\n");
+            return false;
+        }
+        index = profile_count++;
+        snprintf(profiles[index].name, sizeof (profiles[index].name), "%s",
+            name);
+        for (i = 0; i <= MAX_NUM_LAYERS; i++) {
+            init_mapping_context(&profiles[index].contexts[i], NULL);
+        }
+    } else {
+        free_profile(&profiles[index]);
+    }
+    profile = &profiles[index];
+    profile->list = *new_list;
+    init_mapping_list(new_list);
+    compile_profile(profile);
+    FK_DEBUG("Preloaded profile \"%s\" with %u mappings\n", name,
+        profile->list.count);
+    return true;
+}
+
+/* Use a resident profile: its mapping list and mapping contexts are swapped
+ * with the live ones, without any parsing nor compilation, and the held keys
+ * carry over to their equivalent mappings. The live mapping list goes back to
+ * the slot of the previously active profile, if any, or is discarded
+ */
+bool use_profile(mapping_list_t *mapping_list, const char *name)
+{
+    profile_t *profile, *previous;
+    mapping_context_t context;
+    unsigned int i;
+    int index;
+
+    index = find_profile(name);
+    if (index == NO_PROFILE) {
+        FK_ERROR("Unknown profile \"%s\"\n", name);
+        return false;
+    }
+    if (index == active_profile) {
+        return true;
+    }
+    profile = &profiles[index];
+
+    /* Swap the mapping lists and the mapping contexts */
+    exchange_mapping_list(mapping_list, &profile->list);
+    reset_mapping_contexts(contexts);
+    for (i = 0; i <= MAX_NUM_LAYERS; i++) {
+        context = contexts[i];
+        contexts[i] = profile->contexts[i];
+        profile->contexts[i] = context;
+    }
+    contexts[BASE_CONTEXT].list = mapping_list;
+    profile->contexts[BASE_CONTEXT].list = &profile->list;
+    layer_context = NULL;
+
+    /* Put the previous live mapping list back in its profile slot */
+    if (active_profile != NO_PROFILE) {
+        previous = &profiles[active_profile];
+        previous->list = profile->list;
+        memcpy(previous->contexts, profile->contexts,
+            sizeof (previous->contexts));
+        previous->contexts[BASE_CONTEXT].list = &previous->list;
+        init_mapping_list(&profile->list);
+        for (i = 0; i <= MAX_NUM_LAYERS; i++) {
+            init_mapping_context(&profile->contexts[i], NULL);
+        }
+    } else {
+        free_profile(profile);
+    }
+    active_profile = index;
+    FK_DEBUG("Using profile \"%s\"\n", name);
+    return true;
+}
+
 /* Initialize the GPIO mapping */
 bool init_gpio_mapping(const char *config_filename,
     mapping_list_t *mapping_list)
 {
+    unsigned int i;
+
     init_mapping_list(mapping_list);
 
-    /* Read the configuration file to get all valid GPIO mappings */
+    /* The mapping tables are compiled after the first GPIO change, the
+     * configuration file may already use a resident profile
+     */
+    for (i = 0; i <= MAX_NUM_LAYERS; i++) {
+        init_mapping_context(&contexts[i], NULL);
+    }
+    contexts[BASE_CONTEXT].list = mapping_list;
+    layer_context = NULL;
+
+    /* Initialize the asynchronous command executor */
+    fd_command = init_command_executor();
+    if (fd_command < 0) {
+        return false;
+    }
+
+    /* Prepare the default shutdown sequences */
+    if (init_shutdown() == false) {
+        return false;
+    }
+
+    /* Read the configuration file to get all valid GPIO mappings. There is
+     * no previous mapping list to keep at startup, so the mappings parsed
+     * before an error are used if any
+     */
     if (parse_config_file(config_filename, mapping_list, &monitored_gpio_mask) ==
-        false) {
+        false && mapping_list->count == 0) {
         return false;
     }
 #ifdef DEBUG_GPIO
@@ -229,6 +1267,18 @@ bool init_gpio_mapping(const char *config_filename,
     /* Clear the current GPIO mask */
     current_gpio_mask = 0;
 
+    layer_gpio_mask = 0;
+    chord_held_mask = 0;
+    chord_timer = NO_TIMER;
+    chord_gpio_mask = 0;
+
+    /* Initialize the timer queue and the timer driven key repeat */
+    init_timer_queue();
+    init_key_repeat();
+#ifdef SANITY_CHECK_PERIOD_US
+    sanity_check_deadline_us = get_time_us() + SANITY_CHECK_PERIOD_US;
+#endif
+
     /* Initialize the PCAL5616AHF I2C GPIO expander chip */
     if (pcal6416a_init() == false) {
         return false;
@@ -273,6 +1323,8 @@ bool init_gpio_mapping(const char *config_filename,
 /*  Deinitialize the GPIO mapping */
 void deinit_gpio_mapping(void)
 {
+    unsigned int i;
+
     /* Deinitialize the GPIO interrupt for the I2C GPIO expander chip */
     FK_DEBUG("DeInitiating interrupt for GPIO_PIN_I2C_EXPANDER_INTERRUPT\n");
     deinit_gpio_interrupt(fd_pcal6416a);
@@ -290,69 +1342,133 @@ void deinit_gpio_mapping(void)
     /* Close the FIFO pseudo-file */
     FK_DEBUG("Close the FIFO pseudo-file \n");
     close(fd_fifo);
+
+    /* Deinitialize the command executor, the native actions and the shutdown
+     * sequences
+     */
+    deinit_command_executor();
+    deinit_native_actions();
+    deinit_shutdown();
+
+    /* Free the mapping tables */
+    for (i = 0; i <= MAX_NUM_LAYERS; i++) {
+        free_mapping_table(&contexts[i].table);
+    }
+
+    /* Free the resident profiles */
+    for (i = 0; i < profile_count; i++) {
+        free_profile(&profiles[i]);
+    }
+    profile_count = 0;
+    active_profile = NO_PROFILE;
+}
+
+/* Dump the GPIO and command statistics */
+void dump_gpio_stats(void)
+{
+    dump_i2c_chip(&chip_pcal6416a);
+    dump_i2c_chip(&chip_axp209);
+    dump_command_stats();
 }
 
 /* Handle the GPIO mapping (with interrupts) */
 void handle_gpio_mapping(mapping_list_t *list)
 {
-    int result, gpio, int_status, max_fd, fd, val_int_bank_3;
+    int result, gpio, int_status, gpio_status, max_fd, val_int_bank_3;
+    int fd_server;
     ssize_t read_bytes;
     fd_set read_fds, except_fds;
+    struct timeval timeout, *timeout_ptr = NULL;
     uint32_t interrupt_mask, previous_gpio_mask;
     bool pcal6416a_interrupt = false;
     bool axp209_interrupt = false;
     bool forced_interrupt = false;
-    char buffer[2], *next_line;
+    char *next_line;
     mapping_t *mapping;
+    unsigned int generation;
+#ifdef SANITY_CHECK_PERIOD_US
+    uint64_t now;
+#endif
 
-    /* Initialize masks */
+    /* Keep the last known GPIO mask, it is only updated upon a successful
+     * read of the GPIO expander
+     */
     previous_gpio_mask = current_gpio_mask;
-    current_gpio_mask = 0;
 
     /* Listen to FIFO read availability */
     FD_ZERO(&read_fds);
     FD_SET(fd_fifo, &read_fds);
 
+    /* Listen to the command terminations and command server status */
+    FD_SET(fd_command, &read_fds);
+    fd_server = get_command_server_fd();
+    if (fd_server >= 0) {
+        FD_SET(fd_server, &read_fds);
+    }
+
     /* Listen to interrupt exceptions */
     FD_ZERO(&except_fds);
-    FD_SET(fd_pcal6416a, &except_fds);
-    FD_SET(fd_axp209, &except_fds);
+    FD_SET(fd_pcal6416a, &interrupt_fds);
+    FD_SET(fd_axp209, &interrupt_fds);
 
     /* Compute the maximum file descriptor number */
     max_fd = (fd_pcal6416a > fd_axp209) ? fd_pcal6416a : fd_axp209;
     max_fd = (fd_fifo > max_fd) ? fd_fifo : max_fd;
+    max_fd = (fd_command > max_fd) ? fd_command : max_fd;
+    max_fd = (fd_server > max_fd) ? fd_server : max_fd;
 
-#ifdef TIMEOUT_MICROSEC_SANITY_CHECK_GPIO_EXP
-
-    /* Select with normal (short) timeout */
-    struct timeval timeout = {0, TIMEOUT_MICROSEC_SANITY_CHECK_GPIO_EXP};
-    result = select(max_fd + 1, &read_fds, NULL, &except_fds, &timeout);
-#elif TIMEOUT_SEC_SANITY_CHECK_GPIO_EXP
+    /* Wait until the next timer, if any */
+    if (get_timer_timeout(&timeout)) {
+        timeout_ptr = &timeout;
+    }
+#ifdef SANITY_CHECK_PERIOD_US
+
+    /* Wait no longer than the next sanity check */
+    now = get_time_us();
+    if (sanity_check_deadline_us <= now) {
+        timeout.tv_sec = timeout.tv_usec = 0;
+        timeout_ptr = &timeout;
+    } else if (timeout_ptr == NULL || (uint64_t) timeout.tv_sec * 1000000 +
+        timeout.tv_usec > sanity_check_deadline_us - now) {
+        timeout.tv_sec = (sanity_check_deadline_us - now) / 1000000;
+        timeout.tv_usec = (sanity_check_deadline_us - now) % 1000000;
+        timeout_ptr = &timeout;
+    }
+#endif
+    result = select(max_fd + 1, &read_fds, NULL, &except_fds, timeout_ptr);
+    if (result < 0) {
 
-    /* Select with debug (slow) timeout */
-    struct timeval timeout = {TIMEOUT_SEC_SANITY_CHECK_GPIO_EXP, 0};
-    result = select(max_fd + 1, &read_fds, NULL, &except_fds, &timeout);
-#else
+        /* Error case  */
+        FK_ERROR("select: %s\n", strerror(errno));
+        return;
+    }
 
-    /* Select with no timeout */
-    result = select(max_fd + 1, &read_fds, NULL, &except_fds, NULL);
-#endif
-    if (result == 0) {
+    /* Run the expired timers */
+    process_timer_queue();
+#ifdef SANITY_CHECK_PERIOD_US
+    now = get_time_us();
+    if (result == 0 && sanity_check_deadline_us <= now) {
 
         /* Timeout case */
         FK_PERIODIC("Timeout, forcing sanity check\n");
 
         /* Timeout forces a "Found interrupt" event for sanity check */
         pcal6416a_interrupt = axp209_interrupt = forced_interrupt = true;
-    } else if (result < 0) {
+    }
+#endif
 
-        /* Error case  */
-        FK_ERROR("select: %s\n", strerror(errno));
-        return;
-    } else {
+    /* Pending I2C retries force an interrupt on the failed chips */
+    if (chip_pcal6416a.retry) {
+        pcal6416a_interrupt = forced_interrupt = true;
+    }
+    if (chip_axp209.retry) {
+        axp209_interrupt = forced_interrupt = true;
+    }
+    if (result > 0) {
 
         /* Check if we received something from the FIFO */
         if (FD_ISSET(fd_fifo, &read_fds)) {
+            generation = list->generation;
             while (true) {
                 read_bytes = read(fd_fifo, &fifo_buffer[total_bytes],
                     sizeof (fifo_buffer) - 1);
@@ -381,28 +1497,44 @@ void handle_gpio_mapping(mapping_list_t *list)
                     return;
                 }
             }
+
+            /* Apply the held GPIOs to a changed mapping list at once, the
+             * mappings carried over by a LOAD are left untouched
+             */
+            if (list->generation != generation) {
+                apply_chord_mapping(list, current_gpio_mask);
+            }
         }
 
-        /* Check which file descriptor is available for read */
-        for (fd = 0; fd <= max_fd; fd++) {
-            if (FD_ISSET(fd, &except_fds)) {
+        /* Reap the terminated commands */
+        if (FD_ISSET(fd_command, &read_fds)) {
+            reap_commands();
+        }
 
-                /* Rewind file and dummy read the current GPIO value */
-                lseek(fd, 0, SEEK_SET);
-                if (read(fd, &buffer, 2) != 2) {
-		    FK_ERROR("read: %s\n", strerror(errno));
-                    break;
-                }
+        /* Read the command server status, unless stopped in the meantime */
+        if (fd_server >= 0 && fd_server == get_command_server_fd() &&
+            FD_ISSET(fd_server, &read_fds)) {
+            read_command_server();
+        }
 
-                /* Check if the interrupt is from I2C GPIO expander or AXP209 */
-                if (fd == fd_pcal6416a) {
-                    FK_DEBUG("Found interrupt generated by PCAL6416AHF\r\n");
-                    pcal6416a_interrupt = true;
-                } else if (fd == fd_axp209) {
-                    FK_DEBUG("Found interrupt generated by AXP209\r\n");
-                    axp209_interrupt = true;
-                }
+        /* Check if the interrupt is from I2C GPIO expander or AXP209 */
+        if (FD_ISSET(fd_pcal6416a, &interrupt_fds)) {
+
+            /* Acknowledge the interrupt */
+            if (gpio_fd_ack(fd_pcal6416a) < 0) {
+                FK_ERROR("read: %s\n", strerror(errno));
             }
+            FK_DEBUG("Found interrupt generated by PCAL6416AHF\r\n");
+            pcal6416a_interrupt = true;
+        }
+        if (FD_ISSET(fd_axp209, &interrupt_fds)) {
+
+            /* Acknowledge the interrupt */
+            if (gpio_fd_ack(fd_axp209) < 0) {
+                FK_ERROR("read: %s\n", strerror(errno));
+            }
+            FK_DEBUG("Found interrupt generated by AXP209\r\n");
+            axp209_interrupt = true;
         }
     }
 
@@ -416,29 +1548,34 @@ void handle_gpio_mapping(mapping_list_t *list)
         val_int_bank_3 = axp209_read_interrupt_bank_3();
         if (val_int_bank_3 < 0) {
             FK_DEBUG("Could not read AXP209 by I2C\n");
-            return;
+            i2c_failure(&chip_axp209);
+            val_int_bank_3 = 0;
+        } else {
+            i2c_success(&chip_axp209);
         }
 
         /* Proccess the Power Enable Key (PEK) short keypress */
         if (val_int_bank_3 & AXP209_INTERRUPT_PEK_SHORT_PRESS) {
             FK_DEBUG("AXP209 short PEK key press detected\n");
-            mapping = find_mapping(list, SHORT_PEK_PRESS_GPIO_MASK);
+            mapping = find_mapping(list, SHORT_PEK_PRESS_GPIO_MASK,
+                VARIANT_NONE);
             if (mapping != NULL) {
                 FK_DEBUG("Found matching mapping:\n");
 #ifdef DEBUG_GPIO
-                dump_mapping(mapping);
+                dump_mapping(list, mapping);
 #endif // DEBUG_GPIO
                 if (mapping->type == MAPPING_KEY) {
                     FK_DEBUG("\t--> Key press and release %d\n",
-                        mapping->value.keycode);
-                    sendKey(mapping->value.keycode, 1);
+                        mapping->keycode);
+                    sendKeys(mapping_keys(list, mapping), mapping->key_count,
+                        1);
                     usleep(SHORT_PEK_PRESS_DURATION_US);
-                    sendKey(mapping->value.keycode, 0);
-                } else if (mapping->type == MAPPING_COMMAND) {
-                    FK_DEBUG("\t--> Execute Shell command \"%s\"\n",
-                        mapping->value.command);
-                    system(mapping->value.command);
+                    sendKeys(mapping_keys(list, mapping), mapping->key_count,
+                        0);
+                } else if (mapping->type == MAPPING_ACTION) {
+                    run_native_action(mapping->keycode, mapping->step);
                 }
+                execute_mapping_command(list, mapping);
             }
             }
 
@@ -447,9 +1584,7 @@ void handle_gpio_mapping(mapping_list_t *list)
          */
         if (val_int_bank_3 & AXP209_INTERRUPT_PEK_LONG_PRESS) {
             FK_DEBUG("AXP209 long PEK key press detected\n");
-            FK_DEBUG("\t--> Execute Shell command \"%s\"\n",
-                SHELL_COMMAND_SHUTDOWN);
-            system(SHELL_COMMAND_SHUTDOWN);
+            run_shutdown(SHUTDOWN_PEK);
         }
     }
 
@@ -460,21 +1595,30 @@ void handle_gpio_mapping(mapping_list_t *list)
         } else {
             FK_DEBUG("Processing real PCAL6416AHF interrupt\n");
         }
+#ifdef SANITY_CHECK_PERIOD_US
+        sanity_check_deadline_us = now + SANITY_CHECK_PERIOD_US;
+#endif
 
-        /* Read the interrupt mask */
+        /* Read the interrupt mask, on failure keep the last known GPIO mask
+         * until the chip recovers
+         */
         int_status = pcal6416a_read_mask_interrupts();
         if (int_status < 0) {
             FK_DEBUG("Could not read PCAL6416A interrupt status by I2C\n");
+            i2c_failure(&chip_pcal6416a);
             return;
         }
         interrupt_mask = (uint32_t) int_status;
 
         /* Read the GPIO mask */
-        current_gpio_mask = pcal6416a_read_mask_active_GPIOs();
-        if (current_gpio_mask < 0) {
+        gpio_status = pcal6416a_read_mask_active_GPIOs();
+        if (gpio_status < 0) {
             FK_DEBUG("Could not read PCAL6416A active GPIOS by I2C\n");
+            i2c_failure(&chip_pcal6416a);
             return;
         }
+        i2c_success(&chip_pcal6416a);
+        current_gpio_mask = (uint32_t) gpio_status;
 
         /* Keep only monitored GPIOS */
         interrupt_mask &= monitored_gpio_mask;
@@ -514,14 +1658,12 @@ void handle_gpio_mapping(mapping_list_t *list)
          */
         if (interrupt_mask & NOE_GPIO_MASK) {
             FK_DEBUG("NOE detected\n");
-            FK_DEBUG("\t--> Execute Shell command \"%s\"\n",
-                SHELL_COMMAND_SHUTDOWN);
             interrupt_mask &= ~NOE_GPIO_MASK;
-            system(SHELL_COMMAND_SHUTDOWN);
+            run_shutdown(SHUTDOWN_NOE);
         }
     }
 
         /* Apply the mapping for the current gpio mask */
-        apply_mapping(list, current_gpio_mask);
+        apply_chord_mapping(list, current_gpio_mask);
     return;
 }
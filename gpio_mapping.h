@@ -30,9 +30,16 @@
 
 #include "mapping_list.h"
 
+/* Maximum resident profile name length */
+#define MAX_PROFILE_NAME_LENGTH 31
+
 bool init_gpio_mapping(const char* config_filename,
     mapping_list_t *mapping_list);
 void deinit_gpio_mapping(void);
 void handle_gpio_mapping(mapping_list_t *mapping_list);
+void dump_gpio_stats(void);
+bool preload_profile(mapping_list_t *mapping_list, const char *name,
+    mapping_list_t *new_list);
+bool use_profile(mapping_list_t *mapping_list, const char *name);
 
 #endif  //_GPIO_MAPPING_H_
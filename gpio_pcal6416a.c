@@ -27,6 +27,7 @@
 
 #include <fcntl.h>
 #include <stdio.h>
+#include <string.h>
 #include <stdint.h>
 #include <syslog.h>
 #include <unistd.h>
@@ -34,6 +35,7 @@
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
 #include "gpio_pcal6416a.h"
+#include "i2c_regmap.h"
 #include "smbus.h"
 
 //#define DEBUG_PCAL6416A
@@ -57,8 +59,21 @@ typedef struct {
     char *name;
 } i2c_expander_t;
 
-/* PCAL6416A/PCAL9539A I2C GPIO expander chip pseudo-file descriptor */
-static int fd_i2c_expander;
+/* PCAL6416A/PCAL9539A I2C GPIO expander chip register shadow cache */
+#undef X
+#define X(name, address, width, access, cache, reset) \
+    REGMAP_CACHE_FIELD(name, width, cache)
+typedef struct {
+    PCAL6416A_REGISTERS
+} pcal6416a_cache_t;
+
+/* PCAL6416A/PCAL9539A I2C GPIO expander chip pseudo-file descriptor, -1
+ * when closed
+ */
+static int fd_i2c_expander = -1;
+
+/* PCAL6416A/PCAL9539A I2C GPIO expander chip register shadow cache */
+static pcal6416a_cache_t pcal6416a_cache;
 
 /* The I2C bus pseudo-file name */
 static char i2c0_sysfs_filename[] = "/dev/i2c-0";
@@ -73,13 +88,55 @@ static i2c_expander_t i2c_chip[] = {
     {0, NULL}
 };
 
+/* PCAL6416A/PCAL9539A I2C GPIO expander chip register accessors,
+ * pcal6416a_read_<name>() and pcal6416a_write_<name>()
+ */
+#undef X
+#define X(name, address, width, access, cache, reset) \
+    REGMAP_ACCESSORS(pcal6416a, fd_i2c_expander, pcal6416a_cache, name, \
+        address, width, access, cache)
+PCAL6416A_REGISTERS
+
+/* PCAL6416A/PCAL9539A I2C GPIO expander chip initialization sequence:
+ * - all GPIOs are inputs,
+ * - no input latch,
+ * - enable pull-up/pull-down resistors on all GPIOs...
+ * - ...and select pull-ups,
+ * - mask the interrupts for the unused GPIOs
+ */
+#define PCAL6416A_INIT_SEQUENCE \
+    X(CONFIG,         0xFFFF) \
+    X(INPUT_LATCH,    0x0000) \
+    X(EN_PULLUPDOWN,  0xFFFF) \
+    X(SEL_PULLUPDOWN, 0xFFFF) \
+    X(INT_MASK,       0x0320)
+
+#undef X
+#define X(name, value)  REGMAP_BATCH_ENTRY(PCAL6416A, name, value)
+static const regmap_batch_t pcal6416a_init_sequence[] = {
+    PCAL6416A_INIT_SEQUENCE
+};
+
+#define PCAL6416A_INIT_SEQUENCE_LENGTH \
+    (sizeof (pcal6416a_init_sequence) / sizeof (pcal6416a_init_sequence[0]))
+
+/* Load the shadow cache with the written initialization sequence */
+static void pcal6416a_cache_init_sequence(void)
+{
+#undef X
+#define X(name, value) \
+    pcal6416a_cache.name = value; \
+    pcal6416a_cache.name##_valid = true;
+    PCAL6416A_INIT_SEQUENCE
+}
+
 /* Initialize the PCAL6416A/PCAL9539A I2C GPIO expander chip */
 bool pcal6416a_init(void)
 {
     int i;
 
     /* Open the I2C bus pseudo-file */
-    if ((fd_i2c_expander = open(i2c0_sysfs_filename,O_RDWR)) < 0) {
+    if ((fd_i2c_expander = i2c_open(i2c0_sysfs_filename,O_RDWR)) < 0) {
         FK_ERROR("Failed to open the I2C bus %s", i2c0_sysfs_filename);
         return false;
     }
@@ -87,7 +144,8 @@ bool pcal6416a_init(void)
     /* Probing known I2C GPIO expander chips */
     for (i = 0, i2c_expander_addr = 0; i2c_chip[i].address; i++) {
 
-        if (ioctl(fd_i2c_expander, I2C_SLAVE_FORCE, i2c_chip[i]) < 0 ||
+        if (i2c_ioctl(fd_i2c_expander, I2C_SLAVE_FORCE,
+            i2c_chip[i].address) < 0 ||
             pcal6416a_read_mask_interrupts() < 0) {
             FK_DEBUG("Failed to acquire bus access and/or talk to slave %s at address 0x%02X.\n",
                 i2c_chip[i].name, i2c_chip[i].address);
@@ -102,13 +160,23 @@ bool pcal6416a_init(void)
     /* GPIO expander chip found? */
     if (!i2c_expander_addr) {
         FK_ERROR("Failed to acquire bus access and/or talk to slave, exit\n");
+        close(fd_i2c_expander);
+        fd_i2c_expander = -1;
         return false;
     }
-    i2c_smbus_write_word_data ( fd_i2c_expander, PCAL6416A_CONFIG, 0xffff);
-    i2c_smbus_write_word_data ( fd_i2c_expander, PCAL6416A_INPUT_LATCH, 0x0000);
-    i2c_smbus_write_word_data ( fd_i2c_expander, PCAL6416A_EN_PULLUPDOWN, 0xffff);
-    i2c_smbus_write_word_data ( fd_i2c_expander, PCAL6416A_SEL_PULLUPDOWN, 0xffff);
-    i2c_smbus_write_word_data ( fd_i2c_expander, PCAL6416A_INT_MASK, 0x0320);
+
+    /* Configure the GPIO expander chip and make sure it is fully configured */
+    memset(&pcal6416a_cache, 0, sizeof (pcal6416a_cache));
+    if (regmap_write_batch(fd_i2c_expander, i2c_expander_addr,
+        pcal6416a_init_sequence, PCAL6416A_INIT_SEQUENCE_LENGTH) == false ||
+        regmap_verify_batch(fd_i2c_expander, i2c_expander_addr,
+        pcal6416a_init_sequence, PCAL6416A_INIT_SEQUENCE_LENGTH) == false) {
+        FK_ERROR("Failed to initialize %s\n", i2c_chip[i].name);
+        close(fd_i2c_expander);
+        fd_i2c_expander = -1;
+        return false;
+    }
+    pcal6416a_cache_init_sequence();
     return true;
 }
 
@@ -116,8 +184,13 @@ bool pcal6416a_init(void)
 bool pcal6416a_deinit(void)
 {
 
-    /* Close the I2C bus pseudo-file */
-    close(fd_i2c_expander);
+    /* Close the I2C bus pseudo-file, unless a failed initialization already
+     * closed it
+     */
+    if (fd_i2c_expander >= 0) {
+        close(fd_i2c_expander);
+        fd_i2c_expander = -1;
+    }
     return true;
 }
 
@@ -127,7 +200,7 @@ int pcal6416a_read_mask_interrupts(void)
     int val_int;
     uint16_t val;
 
-    val_int = i2c_smbus_read_word_data(fd_i2c_expander, PCAL6416A_INT_STATUS);
+    val_int = pcal6416a_read_INT_STATUS();
     if (val_int < 0) {
         return val_int;
     }
@@ -142,7 +215,7 @@ int pcal6416a_read_mask_active_GPIOs(void)
     int val_int;
     uint16_t val;
 
-    val_int = i2c_smbus_read_word_data(fd_i2c_expander, PCAL6416A_INPUT);
+    val_int = pcal6416a_read_INPUT();
     if (val_int <  0){
         return val_int;
     }
@@ -30,24 +30,37 @@
 
 
 #include <stdbool.h>
+#include "i2c_regmap.h"
 
 /* Chip physical address */
 #define PCAL6416A_I2C_ADDR              0x20
 #define PCAL9539A_I2C_ADDR              0x76
 
-/* Chip register adresses */
-#define PCAL6416A_INPUT                 0x00 /* Input port [RO] */
-#define PCAL6416A_DAT_OUT               0x02 /* GPIO DATA OUT [R/W] */
-#define PCAL6416A_POLARITY              0x04 /* Polarity Inversion port [R/W] */
-#define PCAL6416A_CONFIG                0x06 /* Configuration port [R/W] */
-#define PCAL6416A_DRIVE0                0x40 /* Output drive strength Port0 [R/W] */
-#define PCAL6416A_DRIVE1                0x42 /* Output drive strength Port1 [R/W] */
-#define PCAL6416A_INPUT_LATCH           0x44 /* Port0 Input latch [R/W] */
-#define PCAL6416A_EN_PULLUPDOWN         0x46 /* Port0 Pull-up/Pull-down enbl [R/W] */
-#define PCAL6416A_SEL_PULLUPDOWN        0x48 /* Port0 Pull-up/Pull-down slct [R/W] */
-#define PCAL6416A_INT_MASK              0x4A /* Interrupt mask [R/W] */
-#define PCAL6416A_INT_STATUS            0x4C /* Interrupt status [RO] */
-#define PCAL6416A_OUTPUT_CONFIG         0x4F /* Output port config [R/W] */
+/* PCAL6416A I2C GPIO expander interrupt pin */
+#define GPIO_PIN_I2C_EXPANDER_INTERRUPT ((('B' - '@') << 4) + 3) // PB3
+
+/* Chip register map (see i2c_regmap.h) */
+#define PCAL6416A_REGISTERS \
+    X(INPUT,          0x00, 16, RO, VOLATILE, 0xFFFF) /* Input port */ \
+    X(DAT_OUT,        0x02, 16, RW, CACHED,   0xFFFF) /* GPIO DATA OUT */ \
+    X(POLARITY,       0x04, 16, RW, CACHED,   0x0000) /* Polarity Inversion port */ \
+    X(CONFIG,         0x06, 16, RW, CACHED,   0xFFFF) /* Configuration port */ \
+    X(DRIVE0,         0x40, 16, RW, CACHED,   0xFFFF) /* Output drive strength Port0 */ \
+    X(DRIVE1,         0x42, 16, RW, CACHED,   0xFFFF) /* Output drive strength Port1 */ \
+    X(INPUT_LATCH,    0x44, 16, RW, CACHED,   0x0000) /* Input latch */ \
+    X(EN_PULLUPDOWN,  0x46, 16, RW, CACHED,   0x0000) /* Pull-up/Pull-down enable */ \
+    X(SEL_PULLUPDOWN, 0x48, 16, RW, CACHED,   0xFFFF) /* Pull-up/Pull-down select */ \
+    X(INT_MASK,       0x4A, 16, RW, CACHED,   0xFFFF) /* Interrupt mask */ \
+    X(INT_STATUS,     0x4C, 16, RO, VOLATILE, 0x0000) /* Interrupt status */ \
+    X(OUTPUT_CONFIG,  0x4F,  8, RW, CACHED,   0x00)   /* Output port config */
+
+/* Chip register addresses, PCAL6416A_<name>, and widths,
+ * PCAL6416A_<name>_WIDTH
+ */
+#undef X
+#define X(name, address, width, access, cache, reset) \
+    REGMAP_ENUM(PCAL6416A, name, address, width, access)
+enum {PCAL6416A_REGISTERS};
 
 bool pcal6416a_init(void);
 bool pcal6416a_deinit(void);
@@ -0,0 +1,582 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file gpio_sim.c
+ *  This is the in-process simulation of the PCAL6416A I2C GPIO expander and
+ *  AXP209 PMIC chips, it replaces both the I2C bus accesses and the GPIO
+ *  utility functions
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "gpio_axp209.h"
+#include "gpio_pcal6416a.h"
+#include "gpio_utils.h"
+#include "mapping_list.h"
+#include "parse_config.h"
+
+#include "gpio_sim.h"
+
+//#define DEBUG_SIM
+#define ERROR_SIM
+
+#ifdef DEBUG_SIM
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_SIM
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Maximum number of simultaneously opened simulated I2C bus files */
+#define MAX_SIM_I2C_FILES   4
+
+/* Maximum number of simultaneously opened simulated GPIO pseudo-files */
+#define MAX_SIM_GPIO_FILES  4
+
+/* Simulated PCAL6416A "Menu" GPIO, actually wired to the AXP209 PEK */
+#define SIM_PEK_GPIO_MASK   (1 << GPIO_MENU)
+
+/* Simulated PCAL6416A N_NOE GPIO */
+#define SIM_NOE_GPIO_MASK   (1 << GPIO_NU3)
+
+/* Simulated I2C chip */
+typedef struct {
+    unsigned int address;
+    uint8_t registers[256];
+    uint8_t pointer;
+    int interrupt_pin;
+} sim_chip_t;
+
+/* Simulated I2C bus file */
+typedef struct {
+    int fd;
+    unsigned int address;
+} sim_i2c_file_t;
+
+/* Simulated GPIO pseudo-file */
+typedef struct {
+    int fd;
+    unsigned int gpio;
+} sim_gpio_file_t;
+
+/* Simulated PCAL6416A/PCAL9539A I2C GPIO expander chip */
+static sim_chip_t sim_pcal6416a = {
+    .address = PCAL6416A_I2C_ADDR,
+    .interrupt_pin = GPIO_PIN_I2C_EXPANDER_INTERRUPT
+};
+
+/* Simulated AXP209 I2C PMIC chip */
+static sim_chip_t sim_axp209 = {
+    .address = AXP209_I2C_ADDR,
+    .interrupt_pin = GPIO_PIN_AXP209_INTERRUPT
+};
+
+/* Simulated I2C bus files */
+static sim_i2c_file_t sim_i2c_files[MAX_SIM_I2C_FILES];
+
+/* Simulated GPIO pseudo-files */
+static sim_gpio_file_t sim_gpio_files[MAX_SIM_GPIO_FILES];
+
+/* Currently pressed simulated buttons */
+static uint32_t sim_gpio_mask;
+
+/* Simulated lid state */
+static bool sim_lid_closed;
+
+/* Number of upcoming I2C accesses to fail */
+static unsigned int sim_i2c_failures;
+
+/* Simulation initialization flag */
+static bool sim_initialized;
+
+/* Initialize the simulated chips with their power-on register values */
+static void sim_init(void)
+{
+    int i;
+
+    if (sim_initialized) {
+        return;
+    }
+    for (i = 0; i < MAX_SIM_I2C_FILES; i++) {
+        sim_i2c_files[i].fd = -1;
+    }
+    for (i = 0; i < MAX_SIM_GPIO_FILES; i++) {
+        sim_gpio_files[i].fd = -1;
+    }
+
+    /* Load the register reset values from the chip register maps */
+    memset(sim_pcal6416a.registers, 0, sizeof (sim_pcal6416a.registers));
+    memset(sim_axp209.registers, 0, sizeof (sim_axp209.registers));
+#undef X
+#define X(name, address, width, access, cache, reset) \
+    REGMAP_RESET(sim_pcal6416a.registers, address, width, reset)
+    PCAL6416A_REGISTERS
+#undef X
+#define X(name, address, width, access, cache, reset) \
+    REGMAP_RESET(sim_axp209.registers, address, width, reset)
+    AXP209_REGISTERS
+
+    /* All inputs are high (released buttons), except N_NOE, which is low
+     * while the lid is open
+     */
+    sim_pcal6416a.registers[PCAL6416A_INPUT + 1] &= ~(SIM_NOE_GPIO_MASK >> 8);
+    sim_initialized = true;
+}
+
+/* Find a simulated chip by I2C address */
+static sim_chip_t *sim_find_chip(unsigned int address)
+{
+    if (address == PCAL6416A_I2C_ADDR) {
+        return &sim_pcal6416a;
+    } else if (address == AXP209_I2C_ADDR) {
+        return &sim_axp209;
+    }
+    return NULL;
+}
+
+/* Find a simulated I2C bus file */
+static sim_i2c_file_t *sim_find_i2c_file(int fd)
+{
+    int i;
+
+    for (i = 0; i < MAX_SIM_I2C_FILES; i++) {
+        if (sim_i2c_files[i].fd == fd) {
+            return &sim_i2c_files[i];
+        }
+    }
+    return NULL;
+}
+
+/* Raise the interrupt pin of a simulated chip */
+static void sim_raise_interrupt(sim_chip_t *chip)
+{
+    int i;
+
+    for (i = 0; i < MAX_SIM_GPIO_FILES; i++) {
+        if (sim_gpio_files[i].fd >= 0 &&
+            sim_gpio_files[i].gpio == (unsigned int) chip->interrupt_pin) {
+            FK_DEBUG("Raise interrupt on GPIO %d\n", chip->interrupt_pin);
+            eventfd_write(sim_gpio_files[i].fd, 1);
+        }
+    }
+}
+
+/* Read a simulated chip register */
+static uint8_t sim_read_register(sim_chip_t *chip, uint8_t reg)
+{
+    uint8_t value = chip->registers[reg];
+
+    if (chip == &sim_pcal6416a && (reg == PCAL6416A_INPUT ||
+        reg == PCAL6416A_INPUT + 1)) {
+
+        /* Reading the input port clears the interrupt status */
+        chip->registers[PCAL6416A_INT_STATUS + reg - PCAL6416A_INPUT] = 0;
+    }
+    return value;
+}
+
+/* Write a simulated chip register */
+static void sim_write_register(sim_chip_t *chip, uint8_t reg, uint8_t value)
+{
+    if (chip == &sim_pcal6416a) {
+        switch (reg) {
+        case PCAL6416A_INPUT:
+        case PCAL6416A_INPUT + 1:
+        case PCAL6416A_INT_STATUS:
+        case PCAL6416A_INT_STATUS + 1:
+
+            /* Read-only registers */
+            return;
+
+        default:
+            break;
+        }
+    } else if (chip == &sim_axp209 && reg >= AXP209_INTERRUPT_BANK_1_STATUS &&
+        reg <= AXP209_INTERRUPT_BANK_5_STATUS) {
+
+        /* Writing 1s clears the interrupt status bits */
+        chip->registers[reg] &= ~value;
+        return;
+    }
+    chip->registers[reg] = value;
+}
+
+/* Update the simulated GPIO expander input port */
+static void sim_update_gpios(void)
+{
+    uint16_t input, changed, int_mask;
+
+    input = ~(sim_gpio_mask & ~(SIM_PEK_GPIO_MASK | SIM_NOE_GPIO_MASK));
+    if (sim_lid_closed) {
+        input |= SIM_NOE_GPIO_MASK;
+    } else {
+        input &= ~SIM_NOE_GPIO_MASK;
+    }
+    changed = input ^ (sim_pcal6416a.registers[PCAL6416A_INPUT] |
+        (sim_pcal6416a.registers[PCAL6416A_INPUT + 1] << 8));
+    int_mask = sim_pcal6416a.registers[PCAL6416A_INT_MASK] |
+        (sim_pcal6416a.registers[PCAL6416A_INT_MASK + 1] << 8);
+    sim_pcal6416a.registers[PCAL6416A_INPUT] = input & 0xFF;
+    sim_pcal6416a.registers[PCAL6416A_INPUT + 1] = input >> 8;
+    changed &= ~int_mask;
+    if (changed) {
+        sim_pcal6416a.registers[PCAL6416A_INT_STATUS] |= changed & 0xFF;
+        sim_pcal6416a.registers[PCAL6416A_INT_STATUS + 1] |= changed >> 8;
+        sim_raise_interrupt(&sim_pcal6416a);
+    }
+}
+
+/* Simulate an AXP209 Power Enable Key (PEK) press */
+static void sim_pek_press(uint8_t status)
+{
+    sim_axp209.registers[AXP209_INTERRUPT_BANK_3_STATUS] |= status &
+        sim_axp209.registers[AXP209_INTERRUPT_BANK_3_ENABLE];
+    if (sim_axp209.registers[AXP209_INTERRUPT_BANK_3_STATUS]) {
+        sim_raise_interrupt(&sim_axp209);
+    }
+}
+
+/* Simulated I2C SMBus transfer */
+static int sim_i2c_smbus(sim_chip_t *chip, struct i2c_smbus_ioctl_data *args)
+{
+    union i2c_smbus_data *data = args->data;
+
+    switch (args->size) {
+    case I2C_SMBUS_BYTE_DATA:
+        if (args->read_write == I2C_SMBUS_READ) {
+            data->byte = sim_read_register(chip, args->command);
+        } else {
+            sim_write_register(chip, args->command, data->byte);
+        }
+        break;
+
+    case I2C_SMBUS_WORD_DATA:
+        if (args->read_write == I2C_SMBUS_READ) {
+            data->word = sim_read_register(chip, args->command) |
+                (sim_read_register(chip, args->command + 1) << 8);
+        } else {
+            sim_write_register(chip, args->command, data->word & 0xFF);
+            sim_write_register(chip, args->command + 1, data->word >> 8);
+        }
+        break;
+
+    default:
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    return 0;
+}
+
+/* Simulated plain I2C transaction, the first byte written to a chip sets its
+ * register pointer, which is then auto-incremented by each read or written
+ * byte
+ */
+static int sim_i2c_rdwr(struct i2c_rdwr_ioctl_data *transaction)
+{
+    unsigned int i, j;
+    struct i2c_msg *message;
+    sim_chip_t *chip;
+
+    for (i = 0; i < transaction->nmsgs; i++) {
+        message = &transaction->msgs[i];
+        chip = sim_find_chip(message->addr);
+        if (chip == NULL) {
+            errno = ENXIO;
+            return -1;
+        }
+        for (j = 0; j < message->len; j++) {
+            if (message->flags & I2C_M_RD) {
+                message->buf[j] = sim_read_register(chip, chip->pointer++);
+            } else if (j == 0) {
+                chip->pointer = message->buf[0];
+            } else {
+                sim_write_register(chip, chip->pointer++, message->buf[j]);
+            }
+        }
+    }
+    return transaction->nmsgs;
+}
+
+/* Simulated I2C bus file open */
+int sim_i2c_open(const char *pathname, int flags, ...)
+{
+    int i, fd;
+
+    (void) pathname;
+    sim_init();
+
+    /* Use a real file descriptor so that it can be closed */
+    fd = open("/dev/null", flags);
+    if (fd < 0) {
+        return fd;
+    }
+
+    /* Forget any closed file reusing the same descriptor */
+    for (i = 0; i < MAX_SIM_I2C_FILES; i++) {
+        if (sim_i2c_files[i].fd == fd) {
+            sim_i2c_files[i].fd = -1;
+        }
+    }
+    for (i = 0; i < MAX_SIM_I2C_FILES; i++) {
+        if (sim_i2c_files[i].fd < 0) {
+            FK_DEBUG("Open simulated I2C bus %s as fd %d\n", pathname, fd);
+            sim_i2c_files[i].fd = fd;
+            sim_i2c_files[i].address = 0;
+            return fd;
+        }
+    }
+    close(fd);
+    errno = EMFILE;
+    return -1;
+}
+
+/* Simulated I2C bus ioctl */
+int sim_i2c_ioctl(int fd, unsigned long request, ...)
+{
+    va_list args;
+    unsigned long arg;
+    sim_i2c_file_t *file;
+    sim_chip_t *chip;
+
+    va_start(args, request);
+    arg = va_arg(args, unsigned long);
+    va_end(args);
+    file = sim_find_i2c_file(fd);
+    if (file == NULL) {
+
+        /* The file may have been closed and its descriptor reused */
+        errno = EBADF;
+        return -1;
+    }
+    if (request == I2C_SLAVE || request == I2C_SLAVE_FORCE) {
+        file->address = arg;
+        return 0;
+    }
+    if (sim_i2c_failures && request == I2C_RDWR) {
+        sim_i2c_failures--;
+        errno = EIO;
+        return -1;
+    } else if (request == I2C_RDWR) {
+        return sim_i2c_rdwr((struct i2c_rdwr_ioctl_data *) arg);
+    }
+    chip = sim_find_chip(file->address);
+    if (chip == NULL) {
+        errno = ENXIO;
+        return -1;
+    }
+    if (sim_i2c_failures) {
+        sim_i2c_failures--;
+        errno = EIO;
+        return -1;
+    }
+    if (request == I2C_SMBUS) {
+        return sim_i2c_smbus(chip, (struct i2c_smbus_ioctl_data *) arg);
+    }
+    errno = ENOTTY;
+    return -1;
+}
+
+/* Parse and execute a simulation command:
+ *   SIM <button_combination>   Set the currently pressed buttons
+ *   SIM                        Release all buttons
+ *   SIM PEK SHORT|LONG         Simulate a short or long PEK press
+ *   SIM LID OPEN|CLOSE         Simulate the lid Reed switch
+ *   SIM I2C FAIL <count>       Fail the given number of I2C accesses
+ */
+bool sim_command(char *args)
+{
+    char *token, *next_token, *button, *next_button;
+    uint32_t gpio_mask = 0;
+    uint8_t gpio;
+
+    sim_init();
+    token = strtok_r(args, " \t", &next_token);
+    if (token != NULL && strcasecmp(token, "PEK") == 0) {
+        token = strtok_r(NULL, " \t", &next_token);
+        if (token != NULL && strcasecmp(token, "SHORT") == 0) {
+            sim_pek_press(AXP209_INTERRUPT_PEK_SHORT_PRESS);
+        } else if (token != NULL && strcasecmp(token, "LONG") == 0) {
+            sim_pek_press(AXP209_INTERRUPT_PEK_LONG_PRESS);
+        } else {
+            FK_ERROR("Invalid PEK press\n");
+            return false;
+        }
+        return true;
+    } else if (token != NULL && strcasecmp(token, "LID") == 0) {
+        token = strtok_r(NULL, " \t", &next_token);
+        if (token != NULL && strcasecmp(token, "OPEN") == 0) {
+            sim_lid_closed = false;
+        } else if (token != NULL && strcasecmp(token, "CLOSE") == 0) {
+            sim_lid_closed = true;
+        } else {
+            FK_ERROR("Invalid lid state\n");
+            return false;
+        }
+        sim_update_gpios();
+        return true;
+    } else if (token != NULL && strcasecmp(token, "I2C") == 0) {
+        token = strtok_r(NULL, " \t", &next_token);
+        if (token == NULL || strcasecmp(token, "FAIL") != 0 ||
+            (token = strtok_r(NULL, " \t", &next_token)) == NULL) {
+            FK_ERROR("Invalid I2C failure count\n");
+            return false;
+        }
+        sim_i2c_failures = (unsigned int) atoi(token);
+        return true;
+    }
+
+    /* Button combination */
+    if (token != NULL) {
+        for (button = strtok_r(token, "+", &next_button); button != NULL;
+            button = strtok_r(NULL, "+", &next_button)) {
+            for (gpio = 0; gpio < GPIO_LAST; gpio++) {
+                if (*gpio_name(gpio) && strcasecmp(button, gpio_name(gpio)) == 0) {
+                    gpio_mask |= 1 << gpio;
+                    break;
+                }
+            }
+            if (gpio == GPIO_LAST) {
+                FK_ERROR("Unknown button \"%s\"\n", button);
+                return false;
+            }
+        }
+    }
+    FK_DEBUG("Simulated buttons 0x%04X\n", gpio_mask);
+
+    /* The Menu button is the AXP209 PEK */
+    if (gpio_mask & ~sim_gpio_mask & SIM_PEK_GPIO_MASK) {
+        sim_pek_press(AXP209_INTERRUPT_PEK_SHORT_PRESS);
+    }
+    sim_gpio_mask = gpio_mask;
+    sim_update_gpios();
+    return true;
+}
+
+/* Export a simulated GPIO */
+int gpio_export(unsigned int gpio)
+{
+    (void) gpio;
+    sim_init();
+    return 0;
+}
+
+/* Unexport a simulated GPIO */
+int gpio_unexport(unsigned int gpio)
+{
+    (void) gpio;
+    return 0;
+}
+
+/* Set a simulated GPIO direction */
+int gpio_set_dir(unsigned int gpio, const char *dir)
+{
+    (void) gpio;
+    (void) dir;
+    return 0;
+}
+
+/* Set a simulated GPIO value */
+int gpio_set_value(unsigned int gpio, unsigned int value)
+{
+    (void) gpio;
+    (void) value;
+    return 0;
+}
+
+/* Get a simulated GPIO value, interrupt pins are active low */
+int gpio_get_value(unsigned int gpio, unsigned int *value)
+{
+    (void) gpio;
+    *value = 1;
+    return 0;
+}
+
+/* Set a simulated GPIO interrupt edge */
+int gpio_set_edge(unsigned int gpio, const char *edge)
+{
+    (void) gpio;
+    (void) edge;
+    return 0;
+}
+
+/* Open a simulated GPIO pseudo-file, actually an eventfd signaled upon
+ * interrupts
+ */
+int gpio_fd_open(unsigned int gpio, unsigned int dir)
+{
+    int i, fd;
+
+    (void) dir;
+    sim_init();
+    for (i = 0; i < MAX_SIM_GPIO_FILES; i++) {
+        if (sim_gpio_files[i].fd < 0) {
+            fd = eventfd(0, EFD_NONBLOCK);
+            if (fd < 0) {
+                perror("gpio/fd_open");
+                return fd;
+            }
+            sim_gpio_files[i].fd = fd;
+            sim_gpio_files[i].gpio = gpio;
+            return fd;
+        }
+    }
+    errno = EMFILE;
+    perror("gpio/fd_open");
+    return -1;
+}
+
+/* Acknowledge a simulated GPIO interrupt */
+int gpio_fd_ack(int fd)
+{
+    eventfd_t value;
+
+    return eventfd_read(fd, &value);
+}
+
+/* Close a simulated GPIO pseudo-file */
+int gpio_fd_close(int fd)
+{
+    int i;
+
+    for (i = 0; i < MAX_SIM_GPIO_FILES; i++) {
+        if (sim_gpio_files[i].fd == fd) {
+            sim_gpio_files[i].fd = -1;
+        }
+    }
+    return close(fd);
+}
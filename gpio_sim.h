@@ -0,0 +1,45 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file gpio_sim.h
+ *  This is the in-process simulation of the PCAL6416A I2C GPIO expander and
+ *  AXP209 PMIC chips, enabled by building with "make SIMULATION=1"
+ *
+ *  The simulation replaces the /dev/i2c-0 character device and the sysfs GPIO
+ *  pseudo-files: the register state lives in memory and the interrupt pins are
+ *  eventfds. The simulated inputs are driven by the SIM script command.
+ */
+
+#ifndef _GPIO_SIM_H_
+#define _GPIO_SIM_H_
+
+#ifdef SIMULATION
+
+#include <stdbool.h>
+
+int sim_i2c_open(const char *pathname, int flags, ...);
+int sim_i2c_ioctl(int fd, unsigned long request, ...);
+bool sim_command(char *args);
+
+#endif // SIMULATION
+
+#endif // _GPIO_SIM_H_
@@ -163,6 +163,20 @@ int gpio_fd_open(unsigned int gpio, unsigned int dir)
     return fd;
 }
 
+/* Acknowledge a GPIO interrupt by rewinding the sysfs pseudo-file and dummy
+ * reading the current GPIO value
+ */
+int gpio_fd_ack(int fd)
+{
+    char buf[2];
+
+    lseek(fd, 0, SEEK_SET);
+    if (read(fd, buf, 2) != 2) {
+        return -1;
+    }
+    return 0;
+}
+
 /* Close a GPIO pseudo-file from the sysfs pseudo-filesystem */
 int gpio_fd_close(int fd)
 {
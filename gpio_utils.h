@@ -35,6 +35,7 @@ int gpio_set_value(unsigned int gpio, unsigned int value);
 int gpio_get_value(unsigned int gpio, unsigned int *value);
 int gpio_set_edge(unsigned int gpio, const char *edge);
 int gpio_fd_open(unsigned int gpio, unsigned int dir);
+int gpio_fd_ack(int fd);
 int gpio_fd_close(int fd);
 
 #endif // _GPIO_UTILS_H_
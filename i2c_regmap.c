@@ -0,0 +1,192 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file i2c_regmap.c
+ *  This file contains the I2C chip register map batch transactions
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+#include "gpio_sim.h"
+#include "i2c_regmap.h"
+#include "smbus.h"
+
+//#define DEBUG_REGMAP
+#define ERROR_REGMAP
+
+#ifdef DEBUG_REGMAP
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_REGMAP
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Check if plain I2C transfers are not supported by the adapter */
+#define I2C_RDWR_UNSUPPORTED(result) \
+    ((result) < 0 && (errno == EOPNOTSUPP || errno == ENOTTY))
+
+/* Open an I2C bus character device, or the simulated one */
+int i2c_open(const char *pathname, int flags)
+{
+#ifdef SIMULATION
+    return sim_i2c_open(pathname, flags);
+#else
+    return open(pathname, flags);
+#endif
+}
+
+/* Control an I2C bus character device, or the simulated one */
+int i2c_ioctl(int fd, unsigned long request, unsigned long arg)
+{
+#ifdef SIMULATION
+    return sim_i2c_ioctl(fd, request, arg);
+#else
+    return ioctl(fd, request, arg);
+#endif
+}
+
+/* Write a batch of registers in a single I2C transaction */
+bool regmap_write_batch(int fd, unsigned int address,
+    const regmap_batch_t *batch, unsigned int length)
+{
+    unsigned int i;
+    int result;
+    uint8_t buffers[REGMAP_MAX_BATCH][3];
+    struct i2c_msg messages[REGMAP_MAX_BATCH];
+    struct i2c_rdwr_ioctl_data transaction = {messages, length};
+
+    if (length > REGMAP_MAX_BATCH) {
+        FK_ERROR("Too many registers in batch: %u\n", length);
+        return false;
+    }
+    for (i = 0; i < length; i++) {
+        buffers[i][0] = batch[i].reg;
+        buffers[i][1] = batch[i].value & 0xFF;
+        buffers[i][2] = batch[i].value >> 8;
+        messages[i].addr = address;
+        messages[i].flags = 0;
+        messages[i].len = 1 + batch[i].width / 8;
+        messages[i].buf = buffers[i];
+    }
+    result = i2c_ioctl(fd, I2C_RDWR, (unsigned long) &transaction);
+    if (result == (int) length) {
+        return true;
+    } else if (!I2C_RDWR_UNSUPPORTED(result)) {
+        FK_ERROR("Cannot write batch to I2C chip 0x%02X: %s\n", address,
+            result < 0 ? strerror(errno) : "partial transfer");
+        return false;
+    }
+
+    /* Plain I2C transfers are not supported by the adapter, fall back to
+     * SMBus writes
+     */
+    FK_DEBUG("I2C_RDWR not supported, falling back to SMBus\n");
+    for (i = 0; i < length; i++) {
+        if (batch[i].width == 16) {
+            result = i2c_smbus_write_word_data(fd, batch[i].reg,
+                batch[i].value);
+        } else {
+            result = i2c_smbus_write_byte_data(fd, batch[i].reg,
+                batch[i].value);
+        }
+        if (result < 0) {
+            FK_ERROR("Cannot write I2C chip 0x%02X register 0x%02X\n",
+                address, batch[i].reg);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Read back and verify a batch of registers in a single I2C transaction */
+bool regmap_verify_batch(int fd, unsigned int address,
+    const regmap_batch_t *batch, unsigned int length)
+{
+    unsigned int i;
+    int result, value;
+    bool verified = true;
+    uint8_t registers[REGMAP_MAX_BATCH];
+    uint8_t values[REGMAP_MAX_BATCH][2];
+    struct i2c_msg messages[2 * REGMAP_MAX_BATCH];
+    struct i2c_rdwr_ioctl_data transaction = {messages, 2 * length};
+
+    if (length > REGMAP_MAX_BATCH) {
+        FK_ERROR("Too many registers in batch: %u\n", length);
+        return false;
+    }
+    for (i = 0; i < length; i++) {
+        registers[i] = batch[i].reg;
+        values[i][1] = 0;
+        messages[2 * i].addr = address;
+        messages[2 * i].flags = 0;
+        messages[2 * i].len = 1;
+        messages[2 * i].buf = &registers[i];
+        messages[2 * i + 1].addr = address;
+        messages[2 * i + 1].flags = I2C_M_RD;
+        messages[2 * i + 1].len = batch[i].width / 8;
+        messages[2 * i + 1].buf = values[i];
+    }
+    result = i2c_ioctl(fd, I2C_RDWR, (unsigned long) &transaction);
+    if (result != (int) (2 * length)) {
+        if (!I2C_RDWR_UNSUPPORTED(result)) {
+            FK_ERROR("Cannot read back batch from I2C chip 0x%02X: %s\n",
+                address, result < 0 ? strerror(errno) : "partial transfer");
+            return false;
+        }
+
+        /* Fall back to SMBus reads */
+        for (i = 0; i < length; i++) {
+            if (batch[i].width == 16) {
+                value = i2c_smbus_read_word_data(fd, batch[i].reg);
+            } else {
+                value = i2c_smbus_read_byte_data(fd, batch[i].reg);
+            }
+            if (value < 0) {
+                FK_ERROR("Cannot read I2C chip 0x%02X register 0x%02X\n",
+                    address, batch[i].reg);
+                return false;
+            }
+            values[i][0] = value & 0xFF;
+            values[i][1] = (value >> 8) & 0xFF;
+        }
+    }
+    for (i = 0; i < length; i++) {
+        value = values[i][0] | (values[i][1] << 8);
+        if (value != batch[i].value) {
+            FK_ERROR("I2C chip 0x%02X register 0x%02X is 0x%04X instead of 0x%04X\n",
+                address, batch[i].reg, value, batch[i].value);
+            verified = false;
+        }
+    }
+    return verified;
+}
@@ -0,0 +1,157 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file i2c_regmap.h
+ *  This file contains the I2C chip register map generators
+ *
+ *  A chip register map is an X-macro list of register descriptions:
+ *
+ *      X(name, address, width, access, cacheability, reset_value)
+ *
+ *  where width is 8 or 16 (bits), access is RO or RW and cacheability is
+ *  CACHED or VOLATILE. From it are generated at compile time:
+ *  - the <CHIP>_<name> register addresses and <CHIP>_<name>_WIDTH widths
+ *    (REGMAP_ENUM),
+ *  - the shadow cache structure, with one field per cached register only
+ *    (REGMAP_CACHE_FIELD),
+ *  - the <chip>_read_<name>() accessors, served from the shadow cache for
+ *    cached registers, and the <chip>_write_<name>() accessors for RW
+ *    registers only (REGMAP_ACCESSORS),
+ *  - the batch transaction descriptors, from an X(name, value) list of
+ *    writable registers (REGMAP_BATCH_ENTRY).
+ */
+
+#ifndef _I2C_REGMAP_H_
+#define _I2C_REGMAP_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "smbus.h"
+
+/* Maximum number of registers in a batch transaction: the verification reads
+ * use two messages per register, and the kernel accepts at most 42 messages
+ * per transaction
+ */
+#define REGMAP_MAX_BATCH    21
+
+/* Batch transaction descriptor entry */
+typedef struct {
+    uint8_t reg;
+    uint8_t width;
+    uint16_t value;
+} regmap_batch_t;
+
+/* Register addresses, widths and writability */
+#define REGMAP_ENUM(chip, name, address, width, access) \
+    chip##_##name = address, \
+    chip##_##name##_WIDTH = width, \
+    chip##_##name##_WRITABLE = REGMAP_WRITABLE_##access,
+#define REGMAP_WRITABLE_RO  0
+#define REGMAP_WRITABLE_RW  1
+
+/* Shadow cache fields, for cached registers only */
+#define REGMAP_CACHE_FIELD(name, width, cache) \
+    REGMAP_CACHE_FIELD_##cache(name, width)
+#define REGMAP_CACHE_FIELD_CACHED(name, width) \
+    uint##width##_t name; \
+    bool name##_valid;
+#define REGMAP_CACHE_FIELD_VOLATILE(name, width)
+
+/* SMBus accesses by register width */
+#define REGMAP_SMBUS_READ_8     i2c_smbus_read_byte_data
+#define REGMAP_SMBUS_READ_16    i2c_smbus_read_word_data
+#define REGMAP_SMBUS_WRITE_8    i2c_smbus_write_byte_data
+#define REGMAP_SMBUS_WRITE_16   i2c_smbus_write_word_data
+
+/* Typed register accessors, using the given chip pseudo-file descriptor and
+ * shadow cache variables
+ */
+#define REGMAP_ACCESSORS(prefix, fd, cache_var, name, address, width, access, \
+    cache) \
+    REGMAP_READ_##cache(prefix, fd, cache_var, name, address, width) \
+    REGMAP_WRITE_##access##_##cache(prefix, fd, cache_var, name, address, width)
+
+#define REGMAP_READ_VOLATILE(prefix, fd, cache_var, name, address, width) \
+static inline int prefix##_read_##name(void) \
+{ \
+    return REGMAP_SMBUS_READ_##width(fd, address); \
+}
+
+#define REGMAP_READ_CACHED(prefix, fd, cache_var, name, address, width) \
+static inline int prefix##_read_##name(void) \
+{ \
+    int value; \
+\
+    if (cache_var.name##_valid) { \
+        return cache_var.name; \
+    } \
+    value = REGMAP_SMBUS_READ_##width(fd, address); \
+    if (value >= 0) { \
+        cache_var.name = (uint##width##_t) value; \
+        cache_var.name##_valid = true; \
+    } \
+    return value; \
+}
+
+#define REGMAP_WRITE_RO_VOLATILE(prefix, fd, cache_var, name, address, width)
+#define REGMAP_WRITE_RO_CACHED(prefix, fd, cache_var, name, address, width)
+
+#define REGMAP_WRITE_RW_VOLATILE(prefix, fd, cache_var, name, address, width) \
+static inline int prefix##_write_##name(uint##width##_t value) \
+{ \
+    return REGMAP_SMBUS_WRITE_##width(fd, address, value); \
+}
+
+#define REGMAP_WRITE_RW_CACHED(prefix, fd, cache_var, name, address, width) \
+static inline int prefix##_write_##name(uint##width##_t value) \
+{ \
+    int result; \
+\
+    if (cache_var.name##_valid && cache_var.name == value) { \
+        return 0; \
+    } \
+    result = REGMAP_SMBUS_WRITE_##width(fd, address, value); \
+    cache_var.name = value; \
+    cache_var.name##_valid = result >= 0; \
+    return result; \
+}
+
+/* Batch transaction descriptor entry, which must be writable */
+#define REGMAP_BATCH_ENTRY(chip, name, value) \
+    {chip##_##name + 0 * sizeof (char [chip##_##name##_WRITABLE ? 1 : -1]), \
+    chip##_##name##_WIDTH, value},
+
+/* Reset value of a register in a byte array register file */
+#define REGMAP_RESET(registers, address, width, reset) \
+    (registers)[address] = (reset) & 0xFF; \
+    if ((width) == 16) { \
+        (registers)[(address) + 1] = ((reset) >> 8) & 0xFF; \
+    }
+
+int i2c_open(const char *pathname, int flags);
+int i2c_ioctl(int fd, unsigned long request, unsigned long arg);
+bool regmap_write_batch(int fd, unsigned int address,
+    const regmap_batch_t *batch, unsigned int length);
+bool regmap_verify_batch(int fd, unsigned int address,
+    const regmap_batch_t *batch, unsigned int length);
+
+#endif // _I2C_REGMAP_H_
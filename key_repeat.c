@@ -0,0 +1,220 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file key_repeat.c
+ *  This file contains the key autorepeat and turbo functions
+ */
+
+#include <stdio.h>
+#include <syslog.h>
+#include <linux/input.h>
+#include "key_repeat.h"
+#include "timer_queue.h"
+#include "uinput.h"
+
+//#define DEBUG_KEY_REPEAT
+#define ERROR_KEY_REPEAT
+
+#ifdef DEBUG_KEY_REPEAT
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_KEY_REPEAT
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Input core autorepeat delay and period in ms, also the delay of the
+ * REPEAT mode
+ */
+#define INPUT_REPEAT_DELAY_MS       250
+#define INPUT_REPEAT_PERIOD_MS      33
+#define REPEAT_DELAY_US             (INPUT_REPEAT_DELAY_MS * 1000)
+
+/* Maximum number of simultaneously repeating keys */
+#define MAX_NUM_REPEATING_KEYS      16
+
+/* Free repeating key slot */
+#define NO_KEY                      (-1)
+
+/* Repeating key */
+typedef struct {
+    int keycode;
+    key_repeat_t repeat;
+    int timer;
+    bool down;
+} repeating_key_t;
+
+#undef X
+#define X(a, b) b,
+static const char *repeat_names[] = {KEY_REPEAT_MODES};
+
+/* Repeating keys, and their count */
+static repeating_key_t repeating_keys[MAX_NUM_REPEATING_KEYS];
+static unsigned int repeating_count;
+
+/* Suspend the input core autorepeat while keys are repeated by the daemon, so
+ * that they are not repeated twice, or resume it
+ */
+static void suspend_input_repeat(bool suspend)
+{
+    FK_DEBUG("%s input core autorepeat\n", suspend ? "Suspend" : "Resume");
+    sendRep(REP_DELAY, suspend ? 0 : INPUT_REPEAT_DELAY_MS);
+    sendRep(REP_PERIOD, suspend ? 0 : INPUT_REPEAT_PERIOD_MS);
+}
+
+/* Stop repeating a key and free its slot */
+static void stop_repeat(repeating_key_t *key)
+{
+    cancel_timer(key->timer);
+    key->timer = NO_TIMER;
+    key->keycode = NO_KEY;
+    if (--repeating_count == 0) {
+        suspend_input_repeat(false);
+    }
+}
+
+/* Key repeat timer callback: send a repeat event, or toggle the key in turbo
+ * mode
+ */
+static void repeat_timer(void *data)
+{
+    repeating_key_t *key = (repeating_key_t *) data;
+
+    if (key->repeat == REPEAT_TURBO) {
+        key->down = !key->down;
+        sendKey(key->keycode, key->down ? 1 : 0);
+    } else {
+        sendKey(key->keycode, 2);
+    }
+}
+
+/* Initialize the key repeat */
+void init_key_repeat(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_NUM_REPEATING_KEYS; i++) {
+        repeating_keys[i].keycode = NO_KEY;
+        repeating_keys[i].timer = NO_TIMER;
+    }
+    repeating_count = 0;
+}
+
+/* Press keys in a single frame and start repeating the last one in the given
+ * mode while they are held. By default, the keys are left to the input core
+ * autorepeat, unchanged
+ */
+void press_keys(const int *keycodes, unsigned int count, key_repeat_t repeat,
+    unsigned int rate_hz)
+{
+    repeating_key_t *key, *free_key = NULL;
+    uint64_t delay_us, period_us;
+    int keycode = keycodes[count - 1];
+
+    for (key = repeating_keys; key < &repeating_keys[MAX_NUM_REPEATING_KEYS];
+        key++) {
+        if (key->keycode == keycode) {
+            stop_repeat(key);
+        }
+        if (key->keycode == NO_KEY && free_key == NULL) {
+            free_key = key;
+        }
+    }
+    if (repeat == REPEAT_DEFAULT) {
+        sendKeys(keycodes, count, 1);
+        return;
+    }
+    if (repeat == REPEAT_TURBO) {
+        delay_us = period_us = 1000000 / (2 * rate_hz);
+    } else {
+        delay_us = REPEAT_DELAY_US;
+        period_us = 1000000 / rate_hz;
+    }
+    if (free_key == NULL) {
+        FK_ERROR("Too many repeating keys\n");
+    } else if ((free_key->timer = add_timer(delay_us, period_us,
+        repeat_timer, free_key)) != NO_TIMER) {
+        FK_DEBUG("Repeat key %d %s every %llu us\n", keycode,
+            repeat_name(repeat), (unsigned long long) period_us);
+        free_key->keycode = keycode;
+        free_key->repeat = repeat;
+        free_key->down = true;
+
+        /* The input core autorepeat is suspended before the key press,
+         * otherwise it would start repeating it
+         */
+        if (repeating_count++ == 0) {
+            suspend_input_repeat(true);
+        }
+    }
+    sendKeys(keycodes, count, 1);
+}
+
+/* Press a key and start repeating it in the given mode while it is held */
+void press_key(int keycode, key_repeat_t repeat, unsigned int rate_hz)
+{
+    press_keys(&keycode, 1, repeat, rate_hz);
+}
+
+/* Stop repeating the last of keys pressed together and release them in a
+ * single frame, the last one unless already released in turbo mode
+ */
+void release_keys(const int *keycodes, unsigned int count)
+{
+    repeating_key_t *key;
+    int keycode = keycodes[count - 1];
+    bool down = true;
+
+    for (key = repeating_keys; key < &repeating_keys[MAX_NUM_REPEATING_KEYS];
+        key++) {
+        if (key->keycode == keycode) {
+            down = key->down;
+            stop_repeat(key);
+            break;
+        }
+    }
+    if (down) {
+        sendKeys(keycodes, count, 0);
+    } else if (count > 1) {
+        sendKeys(keycodes, count - 1, 0);
+    }
+}
+
+/* Stop repeating a key and release it */
+void release_key(int keycode)
+{
+    release_keys(&keycode, 1);
+}
+
+/* Get a key repeat mode name */
+const char *repeat_name(key_repeat_t repeat)
+{
+    if (repeat <= REPEAT_TURBO) {
+        return repeat_names[repeat];
+    }
+    return "?";
+}
@@ -0,0 +1,61 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file key_repeat.h
+ *  This file contains the key autorepeat and turbo functions
+ *
+ *  By default, the held keys are repeated by the input core software
+ *  autorepeat of the uinput device. The keys of the mappings with a REPEAT or
+ *  TURBO option are repeated from the timer queue instead, at their own rate,
+ *  or pressed and released periodically in turbo mode, the input core
+ *  autorepeat being suspended while they are held.
+ */
+
+#ifndef _KEY_REPEAT_H_
+#define _KEY_REPEAT_H_
+
+#include <stdbool.h>
+
+/* Maximum key repeat rate in Hz */
+#define MAX_REPEAT_HZ       60
+
+/* Definition of the different key repeat modes */
+#define KEY_REPEAT_MODES \
+    X(REPEAT_DEFAULT, "") \
+    X(REPEAT_AUTO, "REPEAT") \
+    X(REPEAT_TURBO, "TURBO")
+
+/* Enumeration of the different key repeat modes */
+#undef X
+#define X(a, b) a,
+typedef enum {KEY_REPEAT_MODES} key_repeat_t;
+
+void init_key_repeat(void);
+void press_keys(const int *keycodes, unsigned int count, key_repeat_t repeat,
+    unsigned int rate_hz);
+void press_key(int keycode, key_repeat_t repeat, unsigned int rate_hz);
+void release_keys(const int *keycodes, unsigned int count);
+void release_key(int keycode);
+const char *repeat_name(key_repeat_t repeat);
+
+#endif // _KEY_REPEAT_H_
@@ -345,6 +345,16 @@ const key_names_s key_names[] = {
   { "BTN_MODE",	0x13c },
   { "BTN_THUMBL",	0x13d },
   { "BTN_THUMBR",	0x13e },
+  { "BTN_SOUTH",	0x130 },
+  { "BTN_EAST",	0x131 },
+  { "BTN_NORTH",	0x133 },
+  { "BTN_WEST",	0x134 },
+
+  /* Gamepad D-pad, sent as the ABS_HAT0X/ABS_HAT0Y hat */
+  { "BTN_DPAD_UP",	0x220 },
+  { "BTN_DPAD_DOWN",	0x221 },
+  { "BTN_DPAD_LEFT",	0x222 },
+  { "BTN_DPAD_RIGHT",	0x223 },
 
 #if 0
 
@@ -65,21 +65,49 @@ static void print_usage(void)
            "KEYDOWN <keycode>                                   Send a key down event with the given keycode\n"
            "KEYPRESS <keycode>                                  Send key press event with the given keycode\n"
            "KEYUP <keycode>                                     Send a key up event with the given keycode\n"
+           "LAYER <button_combination> [TOGGLE]                 Start a modifier layer block, ended by END\n"
            "LOAD <configuration_file>                           Load a configuration file\n"
            "MAP <button_combination> TO KEY <keycode>           Map a button combination to a keycode\n"
            "MAP <button_combination> TO COMMAND <shell_command> Map a button combination to a Shell command\n"
+           "MAP <button_combination> TO MOUSE X|Y <step>        Map a button combination to a mouse motion\n"
+           "MAP <button_combination> TO ACTION <action>         Map a button combination to a native action\n"
+           "MAP <button_combination> <options> TO ...           Map a button combination with options\n"
+           "MAP <button_combination> TO KEY <keycode> <options> Map a button combination to a keycode with options\n"
+           "MAP <button_combination> TO KEY <keycode> [<options>] COMMAND <shell_command>\n"
+           "                                                    Map a button combination to a keycode and a Shell command\n"
+           "PRELOAD <profile> <configuration_file>              Preload a configuration file as a resident profile\n"
+           "SAVE <configuration_file>                           Save to a configuration file\n"
+           "SERVER [<handlers_file> <handler> ...]              Start the command server, or stop it without arguments\n"
+           "SHUTDOWN PEK|NOE [SYNC] <shutdown_method>           Set the shutdown sequence of a power event\n"
            "SLEEP <delays_ms>                                   Sleep for the given delay in ms\n"
+           "STATS                                               Dump the daemon statistics\n"
            "TYPE <string>                                       Type in a string\n"
            "UNMAP <button_combination>                          Unmap a button combination\n"
+           "USE <profile>                                       Use a preloaded resident profile\n"
            "\n"
            "where:\n"
            " - <button_combination> is a list of UP, DOWN, LEFT, RIGHT, A, B, L, R, X, Y, MENU, START or FN\n"
-           "   separated by \"+\" signs\n"
+           "   separated by \"+\" signs, optionally followed by a :SHORT, :LONG or :DOUBLE press variant\n"
            " - <shell_command> is any valid Shell command with its arguments\n"
+           " - <step> is the signed mouse pointer motion in pixels per frame, from 1 to 127\n"
+           " - <action> is VOLUME <percent>, BRIGHTNESS <percent> or SNAPSHOT\n"
+           " - <options> is a list of mapping options:\n"
+           "   - CHORD <window_ms>: wait up to <window_ms> ms for the whole button combination\n"
+           "   - REPEAT <rate>HZ: repeat the held key at <rate> Hz instead of the input core autorepeat\n"
+           "   - TURBO <rate>HZ: press and release the held key <rate> times per second\n"
+           "   - POLICY DROP|COALESCE|QUEUE <limit>|PARALLEL <limit>: execution policy of the\n"
+           "     Shell command while it is still running\n"
+           "   - NICE <increment>: nice increment of the Shell command, from -20 to 19\n"
+           "   - CPUS <cpu>[+<cpu>...]: CPU affinity of the Shell command, CPUs from 0 to 7\n"
+           "   - CGROUP <cgroup_directory>: control group of the Shell command\n"
+           "   - TIMEOUT <timeout_ms>: terminate the Shell command after <timeout_ms> ms\n"
            " - <configuration_file> is the full path to a configurtion file\n"
+           " - <handlers_file> is a Shell file defining the command server <handler> functions\n"
+           " - <shutdown_method> is COMMAND <shell_command>, INIT or NONE\n"
            " - <delay_ms> is a delay in ms\n"
            " - <string> is a character string\n"
-           " - <keycode> is taken from the Linux key and button codes\n"
+           " - <keycode> is a code or up to 4 codes separated by \"+\" signs, sent in a single frame,\n"
+           "   each taken from the Linux key and button codes\n"
            "     (https://github.com/torvalds/linux/blob/master/include/uapi/linux/input-event-codes.h),\n"
            "     which in turn is modeled after USB HUT 1.12 (see http://www.usb.org/developers/hidpage):\n"
            "   - KEY_0 to KEY_9, KEY_A to KEY_Z\n"
@@ -89,6 +117,8 @@ static void print_usage(void)
            "     BTN_MIDDLE, BTN_MISC, BTN_MODE, BTN_MOUSE, BTN_PINKIE, BTN_RIGHT, BTN_SELECT, BTN_SIDE,\n"
            "     BTN_START, BTN_TASK, BTN_THUMB, BTN_THUMB2, BTN_THUMBL, BTN_THUMBR, BTN_TL, BTN_TL2, \n"
            "     BTN_TOP, BTN_TOP2, BTN_TR, BTN_TR2, BTN_TRIGGER,\n"
+           "   - BTN_SOUTH, BTN_EAST, BTN_NORTH, BTN_WEST, BTN_DPAD_UP, BTN_DPAD_DOWN, BTN_DPAD_LEFT,\n"
+           "     BTN_DPAD_RIGHT\n"
            "   - KEY_102ND, KEY_AGAIN, KEY_ALTERASE, KEY_APOSTROPHE, KEY_BACK, KEY_BACKSLASH, KEY_BACKSPACE,\n"
            "     KEY_BASSBOOST, KEY_BATTERY, KEY_BLUETOOTH, KEY_BOOKMARKS, KEY_BRIGHTNESSDOWN,\n"
            "     KEY_BRIGHTNESSUP, KEY_BRIGHTNESS_CYCLE, KEY_BRIGHTNESS_ZERO, KEY_CALC, KEY_CAMERA,\n"
@@ -245,6 +275,9 @@ int main(int argc, char *argv[])
     /* Deinitialize the GPIO mapping */
     deinit_gpio_mapping();
 
+    /* Free the mapping list */
+    free_mapping_list(&mapping_list);
+
     /* Close the uinput device */
     close_uinput();
     if (daemon) {
@@ -1,6 +1,5 @@
 /*
     Copyright (C) 2020-2021 Michel Stempin <michel.stempin@funkey-project.com>
-    Mostly inspired from the Linux kernel lists
 
     This file is part of the FunKey S GPIO keyboard daemon.
 
@@ -30,7 +29,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include "command_executor.h"
+#include "key_repeat.h"
 #include "mapping_list.h"
+#include "mouse_motion.h"
+#include "native_action.h"
 #include "parse_config.h"
 #include "uinput.h"
 
@@ -56,142 +59,252 @@
     #define FK_ERROR(...)
 #endif
 
-/* Compute the byte offset of a structure member */
-#undef offsetof
-#ifdef __compiler_offsetof
-#define offsetof(TYPE, MEMBER)  __compiler_offsetof(TYPE, MEMBER)
-#else
-#define offsetof(TYPE, MEMBER)  ((size_t)&((TYPE *)0)->MEMBER)
-#endif
+/* Initial number of mapping slots */
+#define INITIAL_MAPPING_LIST_SIZE   32
 
-/* Retrieve a typed pointer to the structure containing the given member */
-#define container_of(ptr, type, member) ({ \
-    void *__mptr = (void *)(ptr); \
-    ((type *)(__mptr - offsetof(type, member))); })
+/* Empty hash index bucket */
+#define NO_SLOT                     UINT16_MAX
 
-/* Retrieve a typed list entry containing the given node as member */
-#define list_entry(ptr, type, member) \
-    container_of(ptr, type, member)
+/* Fibonacci hashing multiplier */
+#define HASH_MULTIPLIER             0x9E3779B1u
 
-/* Loop over the list nodes */
-#define list_for_each(pos, head) \
-    for (pos = (head)->next; pos != (head); pos = pos->next)
+/* Mapping list generation counter, a new generation is given to a mapping
+ * list upon each modification so that the structures compiled from it know
+ * when to be rebuilt
+ */
+static unsigned int generation_counter;
 
-/* Loop over the list nodes backwards */
-#define list_for_each_prev(pos, head) \
-    for (pos = (head)->prev; pos != (head); pos = pos->prev)
+#undef X
+#define X(a, b) b,
+static const char *variant_names[] = {MAPPING_VARIANTS};
 
-/* Loop over the nodes of a list, the node may be destroyed safely during the
- * process
- */
-#define list_for_each_safe(pos, n, head) \
-    for (pos = (head)->next, n = pos->next; pos != (head); \
-        pos = n, n = pos->next)
+/* Initalize a mapping list */
+void init_mapping_list(mapping_list_t *list)
+{
+    list->mappings = NULL;
+    list->data = NULL;
+    list->order = NULL;
+    list->hash = NULL;
+    list->hash_bits = 0;
+    list->count = 0;
+    list->size = 0;
+    list->generation = ++generation_counter;
+    init_arena(&list->arena);
+    list->layers = NULL;
+    list->layer_count = 0;
+}
 
-/* Add a mapping between a previous and a next one */
-static inline void list_add_between(struct mapping_list_t *new,
-    struct mapping_list_t *prev, struct mapping_list_t *next)
+/* Get the home hash index bucket of a GPIO mask and press variant */
+static inline unsigned int hash_bucket(const mapping_list_t *list,
+    uint32_t gpio_mask, mapping_variant_t variant)
 {
-    next->prev = new;
-    new->next = next;
-    new->prev = prev;
-    prev->next = new;
+    return ((gpio_mask ^ ((uint32_t) variant << 24)) * HASH_MULTIPLIER) >>
+        (32 - list->hash_bits);
 }
 
-/* Add a mapping to the mapping list head */
-static inline void list_add(struct mapping_list_t *new,
-    struct mapping_list_t *head)
+/* Find the hash index bucket holding a GPIO mask and press variant, or the
+ * empty bucket where it would be inserted, using linear probing
+ */
+static unsigned int find_bucket(const mapping_list_t *list, uint32_t gpio_mask,
+    mapping_variant_t variant)
 {
-    list_add_between(new, head, head->next);
+    unsigned int bucket, mask = (1 << list->hash_bits) - 1;
+    const mapping_t *mapping;
+
+    for (bucket = hash_bucket(list, gpio_mask, variant);
+        list->hash[bucket] != NO_SLOT; bucket = (bucket + 1) & mask) {
+        mapping = &list->mappings[list->hash[bucket]];
+        if (mapping->gpio_mask == gpio_mask && mapping->variant == variant) {
+            break;
+        }
+    }
+    return bucket;
 }
 
-/* Add a mapping to the mapping list tail */
-static inline void list_add_tail(struct mapping_list_t *new,
-    struct mapping_list_t *head)
+/* Empty a hash index bucket, and shift back the next entries of the probe
+ * sequence that cannot be found anymore otherwise
+ */
+static void delete_bucket(mapping_list_t *list, unsigned int bucket)
 {
-    list_add_between(new, head->prev, head);
+    unsigned int next, home, mask = (1 << list->hash_bits) - 1;
+    const mapping_t *mapping;
+
+    for (next = (bucket + 1) & mask; list->hash[next] != NO_SLOT;
+        next = (next + 1) & mask) {
+        mapping = &list->mappings[list->hash[next]];
+        home = hash_bucket(list, mapping->gpio_mask, mapping->variant);
+
+        /* The entry can fill the hole if its home bucket is not cyclically
+         * between the hole and itself
+         */
+        if (((next - home) & mask) >= ((next - bucket) & mask)) {
+            list->hash[bucket] = list->hash[next];
+            bucket = next;
+        }
+    }
+    list->hash[bucket] = NO_SLOT;
 }
 
-/* Delete a mapping between a previous and a next one */
-static inline void list_delete_between(struct mapping_list_t *prev,
-    struct mapping_list_t *next)
+/* Rebuild the hash index from the mapping slots */
+static void rebuild_hash(mapping_list_t *list)
 {
-    next->prev = prev;
-    prev->next = next;
+    unsigned int slot;
+
+    memset(list->hash, 0xFF, (1 << list->hash_bits) * sizeof (uint16_t));
+    for (slot = 0; slot < list->count; slot++) {
+        list->hash[find_bucket(list, list->mappings[slot].gpio_mask,
+            list->mappings[slot].variant)] = slot;
+    }
 }
 
-/* Delete a mapping from the mapping list */
-static inline void list_delete(struct mapping_list_t *entry)
+/* Release a mapping, the interned strings are only released upon clear. The
+ * press variant mappings send their key events upon gesture recognition only
+ */
+static void release_mapping(mapping_list_t *list, unsigned int slot)
 {
-    list_delete_between(entry->prev, entry->next);
+    mapping_t *mapping = &list->mappings[slot];
+
+    if (mapping->activated == false || mapping->variant != VARIANT_NONE) {
+        return;
+    }
+    if (mapping->type == MAPPING_KEY) {
+        release_keys(mapping_keys(list, mapping), mapping->key_count);
+    } else if (mapping->type == MAPPING_MOUSE) {
+        stop_mouse_motion(mapping->keycode, mapping->step);
+    }
 }
 
-/* Initalize a mapping list */
-void init_mapping_list(mapping_list_t *list)
+/* Release the keys and argument vector of a mapping into the free lists of
+ * the list arena, its interned command is kept for the next mappings
+ */
+static void release_mapping_data(mapping_list_t *list, unsigned int slot)
 {
-    list->next = list;
-    list->prev = list;
+    mapping_data_t *data = &list->data[slot];
+
+    arena_free(&list->arena, (void *) data->keys,
+        list->mappings[slot].key_count * sizeof (int));
+    release_command(&list->arena, data->command, data->argv);
 }
 
-/* Clear a mapping list */
+/* Clear a mapping list and its layers */
 void clear_mapping_list(mapping_list_t *list)
 {
-    struct mapping_list_t *p, *n;
-    mapping_t *tmp;
-
-    list_for_each_safe(p, n, list) {
-        tmp = list_entry(p, mapping_t, mappings);
-        list_delete(&tmp->mappings);
-        if (tmp->type == MAPPING_COMMAND) {
-            if (tmp->value.command != NULL) {
-                free(tmp->value.command);
-            }
-        } else if (tmp->activated == true) {
-	    sendKey(tmp->value.keycode, 0);
-	}
-        free(tmp);
+    unsigned int slot, layer;
+
+    for (slot = 0; slot < list->count; slot++) {
+        release_mapping(list, slot);
+    }
+    for (layer = 0; layer < list->layer_count; layer++) {
+        free_mapping_list(&list->layers[layer].list);
     }
+    list->layer_count = 0;
+    list->count = 0;
+    if (list->hash != NULL) {
+        memset(list->hash, 0xFF, (1 << list->hash_bits) * sizeof (uint16_t));
+    }
+    reset_arena(&list->arena);
+    list->generation = ++generation_counter;
 }
 
-/* Get a type pointer on the first mapping in a mapping list */
-mapping_t *first_mapping(mapping_list_t *list)
+/* Clear a mapping list and free its storage */
+void free_mapping_list(mapping_list_t *list)
 {
-    return list_entry(list->next, mapping_t, mappings);
+    clear_mapping_list(list);
+    free(list->mappings);
+    free(list->data);
+    free(list->order);
+    free(list->hash);
+    free(list->layers);
+    free_arena(&list->arena);
+    init_mapping_list(list);
 }
 
-/* Get a type pointer on the next mapping in a mapping list */
-mapping_t *next_mapping(mapping_t *mapping)
+/* Grow the mapping list storage */
+static bool grow_mapping_list(mapping_list_t *list)
 {
-    return list_entry(mapping->mappings.next, __typeof__(*(mapping)), mappings);
-}
+    unsigned int size;
+    mapping_t *mappings;
+    mapping_data_t *data;
+    uint16_t *order, *hash;
+
+    size = list->size ? 2 * list->size : INITIAL_MAPPING_LIST_SIZE;
+    if (size > NO_SLOT) {
+        FK_ERROR("Too many mappings\n");
+        return false;
+    }
+    mappings = (mapping_t *) realloc(list->mappings, size * sizeof (mapping_t));
+    if (mappings == NULL) {
+        return false;
+    }
+    list->mappings = mappings;
+    data = (mapping_data_t *) realloc(list->data, size *
+        sizeof (mapping_data_t));
+    if (data == NULL) {
+        return false;
+    }
+    list->data = data;
+    order = (uint16_t *) realloc(list->order, size * sizeof (uint16_t));
+    if (order == NULL) {
+        return false;
+    }
+    list->order = order;
 
-/* Check if the mapping is the last in the mapping list */
-bool last_mapping(const mapping_list_t *list, const mapping_t *mapping)
-{
-    return mapping->mappings.next->prev == list;
+    /* The hash index is kept at most half full */
+    hash = (uint16_t *) realloc(list->hash, 2 * size * sizeof (uint16_t));
+    if (hash == NULL) {
+        return false;
+    }
+    list->hash = hash;
+    list->hash_bits = __builtin_ctz(2 * size);
+    list->size = size;
+    rebuild_hash(list);
+    return true;
 }
 
-/* Allocated and insert a mapping in the mapping list */
-bool insert_mapping(mapping_list_t *list, mapping_t *mapping)
+/* Insert a mapping in the mapping list, a key mapping may have several keys
+ * and a command, and a command has execution options, the default ones if
+ * NULL
+ */
+bool insert_mapping(mapping_list_t *list, const mapping_t *mapping,
+    const int *keys, const char *command, const command_options_t *options)
 {
-    mapping_t *new_mapping, *next_mapping;
-    struct mapping_list_t *cur;
+    unsigned int slot, i;
+    const char *new_command = NULL;
+    char *const *new_argv = NULL;
+    int *new_keys = NULL;
 
-    new_mapping = (mapping_t *) malloc(sizeof (mapping_t));
-    if (new_mapping == NULL) {
+    if (list->count == list->size && grow_mapping_list(list) == false) {
         return false;
     }
-    new_mapping->gpio_mask = mapping->gpio_mask;
-    new_mapping->type = mapping->type;
-    new_mapping->bit_count = mapping->bit_count;
-    new_mapping->activated = mapping->activated;
     switch (mapping->type) {
-        case MAPPING_COMMAND:
-        new_mapping->value.command = strdup(mapping->value.command);
+    case MAPPING_KEY:
+        if (mapping->key_count > 1) {
+            new_keys = (int *) arena_alloc(&list->arena,
+                mapping->key_count * sizeof (int));
+            if (new_keys == NULL) {
+                return false;
+            }
+            memcpy(new_keys, keys, mapping->key_count * sizeof (int));
+        }
+        if (command == NULL) {
+            break;
+        }
+
+        /* Fall through */
+    case MAPPING_COMMAND:
+        new_command = arena_intern(&list->arena, command);
+        if (new_command == NULL) {
+            arena_free(&list->arena, new_keys,
+                mapping->key_count * sizeof (int));
+            return false;
+        }
+
+        /* Parse the command once, it is executed by the Shell otherwise */
+        new_argv = parse_command(&list->arena, new_command);
         break;
 
-    case MAPPING_KEY:
-        new_mapping->value.keycode = mapping->value.keycode;
+    case MAPPING_MOUSE:
+    case MAPPING_ACTION:
         break;
 
     default:
@@ -199,81 +312,301 @@ bool insert_mapping(mapping_list_t *list, mapping_t *mapping)
         return false;
     }
 
+    /* The new mapping takes the first free slot */
+    slot = list->count++;
+    list->mappings[slot] = *mapping;
+    list->data[slot].keys = new_keys;
+    list->data[slot].command = new_command;
+    list->data[slot].argv = new_argv;
+    if (options != NULL && new_command != NULL) {
+        list->data[slot].options = *options;
+    } else {
+        memset(&list->data[slot].options, 0, sizeof (command_options_t));
+    }
+    list->hash[find_bucket(list, mapping->gpio_mask, mapping->variant)] = slot;
+
     /* Insert the mapping before any mapping with the same count of simultaneous
      * GPIOs, the list is thus kept in this order
      */
-    list_for_each(cur, list) {
-        next_mapping = list_entry(cur, mapping_t, mappings);
-        if (next_mapping->bit_count <= mapping->bit_count) {
-            list_add_between(&new_mapping->mappings, cur->prev, cur);
-            return true;
+    for (i = 0; i < slot; i++) {
+        if (list->mappings[list->order[i]].bit_count <= mapping->bit_count) {
+            break;
         }
     }
-
-    /* By default, the ne mapping is inserted at the head position */
-    list_add(&new_mapping->mappings, list);
+    memmove(&list->order[i + 1], &list->order[i],
+        (slot - i) * sizeof (uint16_t));
+    list->order[i] = slot;
+    list->generation = ++generation_counter;
     return true;
 }
 
-/* Find a mapping in a mappining list with the exact same GPIO mask */
-mapping_t *find_mapping(mapping_list_t *list, uint32_t gpio_mask)
+/* Find a mapping in a mappining list with the exact same GPIO mask and press
+ * variant
+ */
+mapping_t *find_mapping(mapping_list_t *list, uint32_t gpio_mask,
+    mapping_variant_t variant)
 {
-    struct mapping_list_t *cur;
-    mapping_t *mapping;
+    unsigned int slot;
 
-    list_for_each(cur, list) {
-        mapping = list_entry(cur, mapping_t, mappings);
-        if (mapping->gpio_mask == gpio_mask) {
-            return mapping;
-        }
+    if (list->hash == NULL) {
+        return NULL;
     }
-    return NULL;
+    slot = list->hash[find_bucket(list, gpio_mask, variant)];
+    return slot == NO_SLOT ? NULL : &list->mappings[slot];
 }
 
 /* Remove a mapping from the mapping list */
 bool remove_mapping(mapping_list_t *list, mapping_t *mapping)
 {
-    struct mapping_list_t *p;
-    mapping_t *tmp;
-
-    list_for_each(p, list) {
-        tmp = list_entry(p, mapping_t, mappings);
-        if (tmp == mapping) {
-            list_delete(&tmp->mappings);
-            switch (tmp->type) {
-                case MAPPING_COMMAND:
-                if (tmp->value.command != NULL) {
-                    free(tmp->value.command);
-                }
+    unsigned int slot, last, i;
+
+    if (mapping < list->mappings || mapping >= &list->mappings[list->count]) {
+        return false;
+    }
+    slot = mapping_slot(list, mapping);
+    release_mapping(list, slot);
+    release_mapping_data(list, slot);
+    delete_bucket(list, find_bucket(list, mapping->gpio_mask,
+        mapping->variant));
+
+    /* Remove the slot from the order, and renumber the last slot, which is
+     * moved into the free slot to keep the storage contiguous
+     */
+    last = --list->count;
+    for (i = 0; i < list->count; i++) {
+        if (list->order[i] == slot) {
+            memmove(&list->order[i], &list->order[i + 1],
+                (list->count - i) * sizeof (uint16_t));
+            break;
+        }
+    }
+    if (slot != last) {
+        for (i = 0; i < list->count; i++) {
+            if (list->order[i] == last) {
+                list->order[i] = slot;
                 break;
+            }
+        }
+        list->hash[find_bucket(list, list->mappings[last].gpio_mask,
+            list->mappings[last].variant)] = slot;
+        list->mappings[slot] = list->mappings[last];
+        list->data[slot] = list->data[last];
+    }
+    list->generation = ++generation_counter;
+    return true;
+}
 
-            case MAPPING_KEY:
-	        if (tmp->activated == true) {
-		    sendKey(tmp->value.keycode, 0);
-		}
+/* Insert a modifier layer in the base mapping list, or update an existing one
+ * with the same button combination, returns the layer mapping list
+ */
+mapping_list_t *insert_layer(mapping_list_t *list, uint32_t gpio_mask,
+    bool toggle)
+{
+    mapping_layer_t *layer;
+    unsigned int i;
+
+    for (i = 0; i < list->layer_count; i++) {
+        if (list->layers[i].gpio_mask == gpio_mask) {
+            list->layers[i].toggle = toggle;
+            return &list->layers[i].list;
+        }
+    }
+    if (list->layer_count == MAX_NUM_LAYERS) {
+        FK_ERROR("Too many layers\n");
+        return NULL;
+    }
+    if (list->layers == NULL) {
+        list->layers = (mapping_layer_t *) malloc(MAX_NUM_LAYERS *
+            sizeof (mapping_layer_t));
+        if (list->layers == NULL) {
+            FK_ERROR("Cannot allocate layers\n");
+            return NULL;
+        }
+    }
+    layer = &list->layers[list->layer_count++];
+    layer->gpio_mask = gpio_mask;
+    layer->toggle = toggle;
+    init_mapping_list(&layer->list);
+    list->generation = ++generation_counter;
+    return &layer->list;
+}
+
+/* Copy the mappings and layers of a mapping list into an empty mapping list,
+ * the copied mappings are not activated
+ */
+bool copy_mapping_list(mapping_list_t *list, const mapping_list_t *source)
+{
+    mapping_t mapping;
+    mapping_list_t *layer_list;
+    unsigned int i;
+
+    /* Insert the mappings backwards to keep them in the same order */
+    for (i = source->count; i-- > 0;) {
+        mapping = source->mappings[source->order[i]];
+        mapping.activated = false;
+        if (insert_mapping(list, &mapping,
+            mapping_keys(source, &source->mappings[source->order[i]]),
+            mapping_command(source, &source->mappings[source->order[i]]),
+            mapping_options(source, &source->mappings[source->order[i]])) ==
+            false) {
+            return false;
+        }
+    }
+    for (i = 0; i < source->layer_count; i++) {
+        layer_list = insert_layer(list, source->layers[i].gpio_mask,
+            source->layers[i].toggle);
+        if (layer_list == NULL ||
+            copy_mapping_list(layer_list, &source->layers[i].list) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Find the mapping of a mapping list equivalent to a mapping of another one,
+ * that is with the same GPIO mask, press variant and action, and for keys the
+ * same repeat mode and rate, a held key keeping its repeat timer
+ */
+static mapping_t *find_equivalent_mapping(mapping_list_t *list,
+    const mapping_list_t *other, const mapping_t *mapping)
+{
+    mapping_t *equivalent;
+    const char *command, *other_command;
+    const command_options_t *options, *other_options;
+
+    equivalent = find_mapping(list, mapping->gpio_mask, mapping->variant);
+    if (equivalent == NULL || equivalent->type != mapping->type) {
+        return NULL;
+    }
+    if (mapping->type == MAPPING_MOUSE || mapping->type == MAPPING_ACTION) {
+        return equivalent->keycode == mapping->keycode &&
+            equivalent->step == mapping->step ? equivalent : NULL;
+    }
+    if (mapping->type == MAPPING_KEY &&
+        (equivalent->key_count != mapping->key_count ||
+        equivalent->repeat != mapping->repeat ||
+        equivalent->rate_hz != mapping->rate_hz ||
+        memcmp(mapping_keys(list, equivalent), mapping_keys(other, mapping),
+        mapping->key_count * sizeof (int)) != 0)) {
+        return NULL;
+    }
+    command = mapping_command(list, equivalent);
+    other_command = mapping_command(other, mapping);
+    options = mapping_options(list, equivalent);
+    other_options = mapping_options(other, mapping);
+    if (equal_command_options(options, other_options) == false) {
+        return NULL;
+    }
+    if (command == NULL || other_command == NULL) {
+        return command == other_command ? equivalent : NULL;
+    }
+    return strcmp(command, other_command) == 0 ? equivalent : NULL;
+}
+
+/* Carry the activated mappings of a mapping list and its layers over to
+ * their equivalent mappings in a new mapping list, so that they are neither
+ * released nor activated again
+ */
+static void carry_over_mappings(mapping_list_t *list,
+    mapping_list_t *new_list)
+{
+    mapping_t *mapping, *equivalent;
+    unsigned int slot, i, j;
+
+    for (slot = 0; slot < list->count; slot++) {
+        mapping = &list->mappings[slot];
+        if (mapping->activated == false) {
+            continue;
+        }
+        equivalent = find_equivalent_mapping(new_list, list, mapping);
+        if (equivalent != NULL) {
+            FK_DEBUG("Carry over mapping with gpio_mask 0x%04X\n",
+                mapping->gpio_mask);
+            equivalent->activated = true;
+            mapping->activated = false;
+        }
+    }
+    for (i = 0; i < list->layer_count; i++) {
+        for (j = 0; j < new_list->layer_count; j++) {
+            if (new_list->layers[j].gpio_mask == list->layers[i].gpio_mask) {
+                carry_over_mappings(&list->layers[i].list,
+                    &new_list->layers[j].list);
                 break;
+            }
+        }
+    }
+}
 
-            default:
-                FK_ERROR("Unknown mapping type %d\n", tmp->type);
-                return false;
+/* Release the activated mappings of a mapping list and its layers */
+static void release_mappings(mapping_list_t *list)
+{
+    unsigned int slot, layer;
+
+    for (slot = 0; slot < list->count; slot++) {
+        release_mapping(list, slot);
+        list->mappings[slot].activated = false;
+    }
+    for (layer = 0; layer < list->layer_count; layer++) {
+        release_mappings(&list->layers[layer].list);
+    }
+}
+
+/* Exchange the contents of two mapping lists in one step: the activated
+ * mappings of the first one carry over to their equivalent mappings in the
+ * second one, the other ones are released. The lists keep their addresses
+ * and generations
+ */
+void exchange_mapping_list(mapping_list_t *list, mapping_list_t *other)
+{
+    mapping_list_t swap;
+
+    carry_over_mappings(list, other);
+    release_mappings(list);
+    swap = *list;
+    *list = *other;
+    *other = swap;
+}
+
+/* Publish a new mapping list in place of a mapping list in one step, the new
+ * mapping list is left empty
+ */
+void publish_mapping_list(mapping_list_t *list, mapping_list_t *new_list)
+{
+    exchange_mapping_list(list, new_list);
+    free_mapping_list(new_list);
+}
+
+/* Print a button combination, returns the printed length or -1 upon error */
+static int print_buttons(FILE *fp, uint32_t gpio_mask)
+{
+    int i, length;
+
+    for (i = 0, length = 0; i < MAX_NUM_GPIO; i++, gpio_mask >>= 1) {
+        if (gpio_mask & 1) {
+            if (fprintf(fp, "%s%s", gpio_name(i), gpio_mask == 1 ? "" : "+") <
+                0) {
+                return -1;
             }
-            free(tmp);
-            return true;
+            length += strlen(gpio_name(i)) + (gpio_mask == 1 ? 0 : 1);
         }
     }
-   return false;
+    return length;
 }
 
 /* Dump a mapping */
-void dump_mapping(mapping_t *mapping)
+void dump_mapping(const mapping_list_t *list, const mapping_t *mapping)
 {
     int i;
     uint32_t gpio_mask;
+    const int *keys;
+    const command_options_t *options;
 
-    printf("mapping %p, prev %p, next %p\n", mapping, mapping->mappings.prev,
-        mapping->mappings.next);
+    printf("mapping slot %u\n", mapping_slot(list, mapping));
     printf("gpio_mask 0x%04X bit_count %d activated %s\n", mapping->gpio_mask,
         mapping->bit_count, mapping->activated ? "true" : "false");
+    if (mapping->chord_ms) {
+        printf("chord window %d ms\n", mapping->chord_ms);
+    }
     printf("button%s ", mapping->bit_count == 1 ? " " : "s");
     for (i = 0, gpio_mask = mapping->gpio_mask; i < MAX_NUM_GPIO;
         i++, gpio_mask >>= 1) {
@@ -281,14 +614,55 @@ void dump_mapping(mapping_t *mapping)
             printf("%s%s", gpio_name(i), gpio_mask == 1 ? "\n" : "+");
         }
     }
+    if (mapping->variant != VARIANT_NONE) {
+        printf("variant %s\n", variant_name(mapping->variant));
+    }
+    options = mapping_options(list, mapping);
+    if (options->limit) {
+        printf("policy %s %d\n", command_policy_name(options->policy),
+            options->limit);
+    } else if (options->policy != POLICY_DEFAULT) {
+        printf("policy %s\n", command_policy_name(options->policy));
+    }
+    if (options->nice) {
+        printf("nice %+d\n", options->nice);
+    }
+    if (options->cpu_mask) {
+        printf("cpu_mask 0x%02X\n", options->cpu_mask);
+    }
+    if (options->cgroup) {
+        printf("cgroup \"%s\"\n", command_cgroup_path(options->cgroup));
+    }
+    if (options->timeout_ms) {
+        printf("timeout %u ms\n", options->timeout_ms);
+    }
     switch (mapping->type) {
     case MAPPING_COMMAND:
-        printf("command \"%s\"\n", mapping->value.command);
+        printf("command \"%s\"\n", mapping_command(list, mapping));
         break;
 
     case MAPPING_KEY:
-        printf("keycode %s (%d)\n", keycode_name(mapping->value.keycode),
-            mapping->value.keycode);
+        keys = mapping_keys(list, mapping);
+        for (i = 0; i < mapping->key_count; i++) {
+            printf("keycode %s (%d)\n", keycode_name(keys[i]), keys[i]);
+        }
+        if (mapping->repeat != REPEAT_DEFAULT) {
+            printf("repeat %s %d Hz\n", repeat_name(mapping->repeat),
+                mapping->rate_hz);
+        }
+        if (mapping_command(list, mapping) != NULL) {
+            printf("command \"%s\"\n", mapping_command(list, mapping));
+        }
+        break;
+
+    case MAPPING_MOUSE:
+        printf("mouse %s step %d\n", mouse_axis_name(mapping->keycode),
+            mapping->step);
+        break;
+
+    case MAPPING_ACTION:
+        printf("action %s step %+d\n", native_action_name(mapping->keycode),
+            mapping->step);
         break;
 
     default:
@@ -298,51 +672,132 @@ void dump_mapping(mapping_t *mapping)
 }
 
 /* Dump a mapping list */
-void dump_mapping_list(mapping_list_t *list)
+void dump_mapping_list(const mapping_list_t *list)
 {
-    struct mapping_list_t *p;
-    mapping_t *tmp;
+    unsigned int i;
+    const mapping_t *mapping;
+    const mapping_layer_t *layer;
 
-    list_for_each(p, list) {
-        tmp = list_entry(p, mapping_t, mappings);
-        dump_mapping(tmp);
+    for_each_mapping(mapping, i, list) {
+        dump_mapping(list, mapping);
         printf("\n");
     }
+    for (i = 0; i < list->layer_count; i++) {
+        layer = &list->layers[i];
+        printf("layer ");
+        print_buttons(stdout, layer->gpio_mask);
+        printf("%s\n\n", layer->toggle ? " toggle" : "");
+        dump_mapping_list(&layer->list);
+        printf("end layer\n\n");
+    }
 }
 
 /* Save a mapping */
-bool save_mapping(FILE *fp, mapping_t *mapping)
+bool save_mapping(FILE *fp, const mapping_list_t *list,
+    const mapping_t *mapping)
 {
-  int i, length;
-    uint32_t gpio_mask;
+    int i, length;
+    const int *keys;
+    const command_options_t *options;
+    unsigned int cpu_mask;
 
     if (fprintf(fp, "MAP ") < 0) {
         return false;
     }
-    for (i = 0, length = 0, gpio_mask = mapping->gpio_mask; i < MAX_NUM_GPIO;
-        i++, gpio_mask >>= 1) {
-        if (gpio_mask & 1) {
-            if (fprintf(fp, "%s%s", gpio_name(i), gpio_mask == 1 ? " " : "+") < 0) {
-                return false;
-            }
-            length += strlen(gpio_name(i)) + 1;
+    if ((length = print_buttons(fp, mapping->gpio_mask)) < 0) {
+        return false;
+    }
+    length++;
+
+    /* The press variant is appended to the button combination */
+    if (mapping->variant != VARIANT_NONE) {
+        if (fprintf(fp, ":%s", variant_name(mapping->variant)) < 0) {
+            return false;
         }
+        length += strlen(variant_name(mapping->variant)) + 1;
+    }
+    if (fprintf(fp, " ") < 0) {
+        return false;
     }
     for (i = 9 - length; i > 0; i--) {
         if (fprintf(fp, " ") < 0) {
             return false;
         }
     }
+    if (mapping->chord_ms && fprintf(fp, "CHORD %d ", mapping->chord_ms) < 0) {
+        return false;
+    }
+    options = mapping_options(list, mapping);
+    if (options->policy != POLICY_DEFAULT && (fprintf(fp, "POLICY %s ",
+        command_policy_name(options->policy)) < 0 ||
+        (options->limit && fprintf(fp, "%d ", options->limit) < 0))) {
+        return false;
+    }
+    if (options->nice && fprintf(fp, "NICE %d ", options->nice) < 0) {
+        return false;
+    }
+    if (options->cpu_mask) {
+        if (fprintf(fp, "CPUS ") < 0) {
+            return false;
+        }
+        for (i = 0, cpu_mask = options->cpu_mask; cpu_mask;
+            i++, cpu_mask >>= 1) {
+            if ((cpu_mask & 1) && fprintf(fp, "%d%s", i,
+                cpu_mask == 1 ? " " : "+") < 0) {
+                return false;
+            }
+        }
+    }
+    if (options->cgroup && fprintf(fp, "CGROUP %s ",
+        command_cgroup_path(options->cgroup)) < 0) {
+        return false;
+    }
+    if (options->timeout_ms &&
+        fprintf(fp, "TIMEOUT %u ", options->timeout_ms) < 0) {
+        return false;
+    }
     switch (mapping->type) {
     case MAPPING_COMMAND:
-        if (fprintf(fp, "TO COMMAND %s\n", mapping->value.command) < 0) {
+        if (fprintf(fp, "TO COMMAND %s\n", mapping_command(list, mapping)) < 0) {
             return false;
         }
         break;
 
     case MAPPING_KEY:
-        if (fprintf(fp, "TO KEY     %s\n",
-            keycode_name(mapping->value.keycode)) < 0) {
+        if (fprintf(fp, "TO KEY     ") < 0) {
+            return false;
+        }
+        keys = mapping_keys(list, mapping);
+        for (i = 0; i < mapping->key_count; i++) {
+            if (fprintf(fp, "%s%s", keycode_name(keys[i]),
+                i < mapping->key_count - 1 ? "+" : "") < 0) {
+                return false;
+            }
+        }
+        if (mapping->repeat != REPEAT_DEFAULT && fprintf(fp, " %s %dHZ",
+            repeat_name(mapping->repeat), mapping->rate_hz) < 0) {
+            return false;
+        }
+        if (mapping_command(list, mapping) != NULL && fprintf(fp,
+            " COMMAND %s", mapping_command(list, mapping)) < 0) {
+            return false;
+        }
+        if (fprintf(fp, "\n") < 0) {
+            return false;
+        }
+        break;
+
+    case MAPPING_MOUSE:
+        if (fprintf(fp, "TO MOUSE   %s %d\n", mouse_axis_name(mapping->keycode),
+            mapping->step) < 0) {
+            return false;
+        }
+        break;
+
+    case MAPPING_ACTION:
+        if (fprintf(fp, "TO ACTION  %s", native_action_name(mapping->keycode))
+            < 0 || (mapping->step && fprintf(fp, " %+d", mapping->step) < 0) ||
+            fprintf(fp, "\n") < 0) {
             return false;
         }
         break;
@@ -355,11 +810,46 @@ bool save_mapping(FILE *fp, mapping_t *mapping)
     return true;
 }
 
+/* Get a mapping press variant name */
+const char *variant_name(mapping_variant_t variant)
+{
+    if (variant <= VARIANT_DOUBLE) {
+        return variant_names[variant];
+    }
+    return "?";
+}
+
+/* Save the mappings of a mapping list backwards, so that loading them inserts
+ * them back in the same order
+ */
+static bool save_mappings(FILE *fp, const mapping_list_t *list)
+{
+    unsigned int i;
+
+    for (i = list->count; i-- > 0;) {
+        if (save_mapping(fp, list, &list->mappings[list->order[i]]) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Save a modifier layer block */
+static bool save_layer(FILE *fp, const mapping_layer_t *layer)
+{
+    if (fprintf(fp, "LAYER ") < 0 || print_buttons(fp, layer->gpio_mask) < 0 ||
+        fprintf(fp, "%s\n", layer->toggle ? " TOGGLE" : "") < 0 ||
+        save_mappings(fp, &layer->list) == false || fprintf(fp, "END\n") < 0) {
+        return false;
+    }
+    return true;
+}
+
 /* Save a mapping list */
-bool save_mapping_list(const char *name, mapping_list_t *list)
+bool save_mapping_list(const char *name, const mapping_list_t *list)
 {
-    struct mapping_list_t *p;
-    mapping_t *tmp;
+    unsigned int i;
+    bool result;
     FILE *fp;
 
     if (name[0] == '\0') {
@@ -373,16 +863,19 @@ bool save_mapping_list(const char *name, mapping_list_t *list)
         return false;
     }
     fprintf(fp, "CLEAR\n");
-    list_for_each_prev(p, list) {
-        tmp = list_entry(p, mapping_t, mappings);
-        if (save_mapping(fp, tmp) == false) {
-            FK_ERROR("Cannot write to save file \"%s\": %s\n", name,
-                strerror(errno));
-            if (fp != stdout) {
-                fclose(fp);
-            }
-            return false;
+
+    /* Save the base mappings, then the layers */
+    result = save_mappings(fp, list);
+    for (i = 0; i < list->layer_count && result; i++) {
+        result = save_layer(fp, &list->layers[i]);
+    }
+    if (result == false) {
+        FK_ERROR("Cannot write to save file \"%s\": %s\n", name,
+            strerror(errno));
+        if (fp != stdout) {
+            fclose(fp);
         }
+        return false;
     }
     if (fp == stdout) {
         return true;
@@ -30,46 +30,169 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "arena.h"
+#include "command_executor.h"
+#include "key_repeat.h"
 
 #define MAX_NUM_GPIO    32
 
 /* Definition of the different mapping types */
 #define MAPPING_TYPES \
     X(MAPPING_KEY, "KEY") \
-    X(MAPPING_COMMAND, "COMMAND")
+    X(MAPPING_COMMAND, "COMMAND") \
+    X(MAPPING_MOUSE, "MOUSE") \
+    X(MAPPING_ACTION, "ACTION")
 
 /* Enumeration of the different mapping types */
 #undef X
 #define X(a, b) a,
 typedef enum {MAPPING_TYPES} mapping_type_t;
 
-typedef struct mapping_list_t {
-    struct mapping_list_t *next, *prev;
-} mapping_list_t;
+/* Definition of the different mapping press variants */
+#define MAPPING_VARIANTS \
+    X(VARIANT_NONE, "") \
+    X(VARIANT_SHORT, "SHORT") \
+    X(VARIANT_LONG, "LONG") \
+    X(VARIANT_DOUBLE, "DOUBLE")
+
+/* Enumeration of the different mapping press variants */
+#undef X
+#define X(a, b) a,
+typedef enum {MAPPING_VARIANTS} mapping_variant_t;
+
+/* Maximum number of modifier layers */
+#define MAX_NUM_LAYERS  8
+
+/* Maximum number of keys of a key mapping */
+#define MAX_MAPPING_KEYS    4
 
-typedef struct mapping_t {
-    struct mapping_list_t mappings;
+/* Maximum chord recognition window in ms */
+#define MAX_CHORD_MS    1000
+
+/* Mapping hot fields, scanned upon each GPIO change. The keycode of a key
+ * mapping is its first key out of key_count, the keycode of a mouse mapping
+ * is its REL_X or REL_Y axis, moved by step pixels per frame, and the keycode
+ * of a native action mapping is its action, adjusting a level by step percent
+ */
+typedef struct {
     uint32_t gpio_mask;
     mapping_type_t type;
-    union {
-        char *command;
-        int keycode;
-    } value;
+    int keycode;
     uint8_t bit_count;
     bool activated;
+    uint16_t chord_ms;
+    mapping_variant_t variant;
+    key_repeat_t repeat;
+    uint8_t rate_hz;
+    int8_t step;
+    uint8_t key_count;
 } mapping_t;
 
+/* Mapping cold fields, only used upon activation, dump or save: the keys of a
+ * key mapping with several keys, and the command of a command mapping or of
+ * a key mapping that also runs a command, along with its argument vector
+ * parsed once if it does not require the Shell, all stored in the list arena,
+ * and its execution options
+ */
+typedef struct {
+    const int *keys;
+    const char *command;
+    char *const *argv;
+    command_options_t options;
+} mapping_data_t;
+
+/* Mapping list, stored in contiguous arrays indexed by mapping slots: the
+ * slots are stable until the mapping is removed, the order array holds the
+ * slots sorted by decreasing count of simultaneous GPIOs, and the hash array
+ * is an open-addressing index of the slots by GPIO mask and press variant.
+ * The storage is reused after a clear, and the strings are interned in the
+ * list arena, which is reset in one step upon clear. The base mapping list
+ * also holds the modifier layers, in a fixed array so that their lists never
+ * move
+ */
+struct mapping_layer_t;
+typedef struct {
+    mapping_t *mappings;
+    mapping_data_t *data;
+    uint16_t *order;
+    uint16_t *hash;
+    unsigned int hash_bits;
+    unsigned int count;
+    unsigned int size;
+    unsigned int generation;
+    arena_t arena;
+    struct mapping_layer_t *layers;
+    unsigned int layer_count;
+} mapping_list_t;
+
+/* Modifier layer: while its button combination is held, or once toggled by
+ * it, its mapping list replaces the base one for the buttons it maps
+ */
+typedef struct mapping_layer_t {
+    uint32_t gpio_mask;
+    bool toggle;
+    mapping_list_t list;
+} mapping_layer_t;
+
+/* Loop over the mappings sorted by decreasing simultaneous GPIO number */
+#define for_each_mapping(mapping, i, list) \
+    for ((i) = 0; (i) < (list)->count && \
+        ((mapping) = &(list)->mappings[(list)->order[i]], true); (i)++)
+
+/* Get the slot of a mapping */
+static inline unsigned int mapping_slot(const mapping_list_t *list,
+    const mapping_t *mapping)
+{
+    return mapping - list->mappings;
+}
+
+/* Get the keycodes of a key mapping */
+static inline const int *mapping_keys(const mapping_list_t *list,
+    const mapping_t *mapping)
+{
+    return mapping->key_count > 1 ?
+        list->data[mapping_slot(list, mapping)].keys : &mapping->keycode;
+}
+
+/* Get the command of a mapping */
+static inline const char *mapping_command(const mapping_list_t *list,
+    const mapping_t *mapping)
+{
+    return list->data[mapping_slot(list, mapping)].command;
+}
+
+/* Get the command argument vector of a mapping */
+static inline char *const *mapping_argv(const mapping_list_t *list,
+    const mapping_t *mapping)
+{
+    return list->data[mapping_slot(list, mapping)].argv;
+}
+
+/* Get the command execution options of a mapping */
+static inline const command_options_t *mapping_options(
+    const mapping_list_t *list, const mapping_t *mapping)
+{
+    return &list->data[mapping_slot(list, mapping)].options;
+}
+
 void init_mapping_list(mapping_list_t *list);
 void clear_mapping_list(mapping_list_t *list);
-mapping_t *first_mapping(mapping_list_t *list);
-mapping_t *next_mapping(mapping_t *mapping);
-bool last_mapping(const mapping_list_t *list, const mapping_t *mapping);
-bool insert_mapping(mapping_list_t *list, mapping_t *mapping);
-mapping_t *find_mapping(mapping_list_t *list, uint32_t gpio_mask);
+void free_mapping_list(mapping_list_t *list);
+bool insert_mapping(mapping_list_t *list, const mapping_t *mapping,
+    const int *keys, const char *command, const command_options_t *options);
+mapping_t *find_mapping(mapping_list_t *list, uint32_t gpio_mask,
+    mapping_variant_t variant);
+const char *variant_name(mapping_variant_t variant);
 bool remove_mapping(mapping_list_t *list, mapping_t *mapping);
-void dump_mapping(mapping_t *mapping);
-void dump_mapping_list(mapping_list_t *list);
-bool save_mapping(FILE *fp, mapping_t *mapping);
-bool save_mapping_list(const char *name, mapping_list_t *list);
+mapping_list_t *insert_layer(mapping_list_t *list, uint32_t gpio_mask,
+    bool toggle);
+bool copy_mapping_list(mapping_list_t *list, const mapping_list_t *source);
+void exchange_mapping_list(mapping_list_t *list, mapping_list_t *other);
+void publish_mapping_list(mapping_list_t *list, mapping_list_t *new_list);
+void dump_mapping(const mapping_list_t *list, const mapping_t *mapping);
+void dump_mapping_list(const mapping_list_t *list);
+bool save_mapping(FILE *fp, const mapping_list_t *list,
+    const mapping_t *mapping);
+bool save_mapping_list(const char *name, const mapping_list_t *list);
 
 #endif // _MAPPING_LIST_H_
@@ -0,0 +1,338 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file mapping_table.c
+ *  This file contains the compiled GPIO state to active mappings table
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include "mapping_table.h"
+
+//#define DEBUG_MAPPING_TABLE
+#define ERROR_MAPPING_TABLE
+
+#ifdef DEBUG_MAPPING_TABLE
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_MAPPING_TABLE
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Initial number of mapping identifiers in the pool */
+#define INITIAL_POOL_SIZE   256
+
+/* Initialize a mapping table */
+void init_mapping_table(mapping_table_t *table)
+{
+    int bit;
+
+    memset(table, 0, sizeof (*table));
+    table->previous = NO_ENTRY;
+    for (bit = 0; bit < MAX_NUM_TABLE_GPIO; bit++) {
+        table->owner[bit] = NO_OWNER;
+    }
+}
+
+/* Free the compiled mapping table entries */
+static void free_mapping_table_entries(mapping_table_t *table)
+{
+    free(table->marks);
+    free(table->index);
+    free(table->pool);
+    table->marks = NULL;
+    table->index = NULL;
+    table->pool = NULL;
+    table->pool_size = 0;
+    table->mapping_count = 0;
+    table->mark = 0;
+    table->previous = NO_ENTRY;
+    table->compiled = false;
+}
+
+/* Free a mapping table */
+void free_mapping_table(mapping_table_t *table)
+{
+    free_mapping_table_entries(table);
+    free(table->gpio_mappings);
+    free(table->candidates);
+    free(table->chords);
+    init_mapping_table(table);
+}
+
+/* Collect the mapped GPIOs of a mapping list, returns false if they do not
+ * fit in the mapping table
+ */
+static bool collect_mapped_gpios(mapping_list_t *list, uint32_t *mapped_mask)
+{
+    mapping_t *mapping;
+    unsigned int i;
+
+    *mapped_mask = 0;
+    for_each_mapping(mapping, i, list) {
+        *mapped_mask |= mapping->gpio_mask;
+    }
+    if (*mapped_mask >> MAX_NUM_TABLE_GPIO) {
+        FK_ERROR("Cannot compile mapping table for GPIO mask 0x%04X\n",
+            *mapped_mask);
+        return false;
+    }
+    return true;
+}
+
+/* Gather the bits of a byte selected by a mask into the low bits */
+static uint8_t gather_bits(uint8_t value, uint8_t mask)
+{
+    int bit, position;
+    uint8_t result;
+
+    for (bit = 0, position = 0, result = 0; bit < 8; bit++) {
+        if (mask & (1 << bit)) {
+            if (value & (1 << bit)) {
+                result |= 1 << position;
+            }
+            position++;
+        }
+    }
+    return result;
+}
+
+/* Compile a mapping list into a mapping table */
+bool compile_mapping_table(mapping_table_t *table, mapping_list_t *list)
+{
+    mapping_t *mapping;
+    unsigned int i, count, entry, entries, length;
+    uint32_t mapped_mask, gpio_mask;
+    uint16_t *pool;
+    int bit, bit_count, bits[MAX_NUM_TABLE_GPIO];
+
+    /* A failed compilation is not retried until the mapping list changes */
+    free_mapping_table_entries(table);
+    table->generation = list->generation;
+
+    /* Collect the mapped GPIOs */
+    count = list->count;
+    if (collect_mapped_gpios(list, &mapped_mask) == false) {
+        return false;
+    }
+    for (bit = 0, bit_count = 0; bit < MAX_NUM_TABLE_GPIO; bit++) {
+        if (mapped_mask & (1 << bit)) {
+            bits[bit_count++] = bit;
+        }
+    }
+    entries = 1 << bit_count;
+    table->marks = (uint32_t *) calloc(count + 1, sizeof (uint32_t));
+    table->index = (uint32_t *) malloc((entries + 1) * sizeof (uint32_t));
+    table->pool_size = INITIAL_POOL_SIZE;
+    table->pool = (uint16_t *) malloc(table->pool_size * sizeof (uint16_t));
+    if (table->marks == NULL || table->index == NULL || table->pool == NULL) {
+        FK_ERROR("Cannot allocate mapping table\n");
+        free_mapping_table_entries(table);
+        return false;
+    }
+    table->mapping_count = count;
+
+    /* Build the gathering tables */
+    table->mapped_mask = mapped_mask;
+    table->gather_shift = __builtin_popcount(mapped_mask & 0xFF);
+    for (entry = 0; entry < 256; entry++) {
+        table->gather[0][entry] = gather_bits(entry, mapped_mask & 0xFF);
+        table->gather[1][entry] = gather_bits(entry, (mapped_mask >> 8) & 0xFF);
+    }
+
+    /* For each combination of the mapped GPIOs, search the whole mapping
+     * sorted by decreasing simultaneous GPIO number: if the current GPIO mask
+     * contains the mapping GPIO mask, the mapping is active and its GPIOs are
+     * subtracted from the current GPIO mask
+     */
+    for (entry = 0, length = 0; entry < entries; entry++) {
+        table->index[entry] = length;
+        for (bit = 0, gpio_mask = 0; bit < bit_count; bit++) {
+            if (entry & (1 << bit)) {
+                gpio_mask |= 1 << bits[bit];
+            }
+        }
+        for (i = 0; i < count && gpio_mask; i++) {
+            mapping = &list->mappings[list->order[i]];
+            if ((mapping->gpio_mask & gpio_mask) == mapping->gpio_mask) {
+                if (length == table->pool_size) {
+                    pool = (uint16_t *) realloc(table->pool,
+                        2 * table->pool_size * sizeof (uint16_t));
+                    if (pool == NULL) {
+                        FK_ERROR("Cannot allocate mapping table\n");
+                        free_mapping_table_entries(table);
+                        return false;
+                    }
+                    table->pool = pool;
+                    table->pool_size *= 2;
+                }
+                table->pool[length++] = list->order[i];
+                gpio_mask ^= mapping->gpio_mask;
+            }
+        }
+    }
+    table->index[entries] = length;
+    table->compiled = true;
+    FK_DEBUG("Compiled %u mappings into %u entries, %u active mappings\n",
+        count, entries, length);
+    return true;
+}
+
+/* Mark the mappings in a table entry set, returns the mark value */
+uint32_t mark_mapping_table(mapping_table_t *table, int entry)
+{
+    uint32_t i;
+
+    if (++table->mark == 0) {
+
+        /* Mark wrap-around, clear all marks */
+        memset(table->marks, 0, table->mapping_count * sizeof (uint32_t));
+        table->mark = 1;
+    }
+    for (i = table->index[entry]; i < table->index[entry + 1]; i++) {
+        table->marks[table->pool[i]] = table->mark;
+    }
+    return table->mark;
+}
+
+/* Build the mapping index of a mapping list, the GPIO owners are taken from
+ * the currently activated mappings
+ */
+bool index_mapping_table(mapping_table_t *table, mapping_list_t *list)
+{
+    mapping_t *mapping;
+    unsigned int i, words;
+    uint32_t mapped_mask, gpio_mask, *gpio_mappings, *candidates;
+    int bit;
+
+    table->indexed = false;
+    if (collect_mapped_gpios(list, &mapped_mask) == false) {
+        return false;
+    }
+    words = (list->count + 31) / 32;
+    if (words > table->words) {
+        gpio_mappings = (uint32_t *) realloc(table->gpio_mappings,
+            MAX_NUM_TABLE_GPIO * words * sizeof (uint32_t));
+        if (gpio_mappings == NULL) {
+            FK_ERROR("Cannot allocate mapping index\n");
+            return false;
+        }
+        table->gpio_mappings = gpio_mappings;
+        candidates = (uint32_t *) realloc(table->candidates,
+            words * sizeof (uint32_t));
+        if (candidates == NULL) {
+            FK_ERROR("Cannot allocate mapping index\n");
+            return false;
+        }
+        table->candidates = candidates;
+    }
+    table->words = words;
+    if (words) {
+        memset(table->gpio_mappings, 0,
+            MAX_NUM_TABLE_GPIO * words * sizeof (uint32_t));
+    }
+    for (bit = 0; bit < MAX_NUM_TABLE_GPIO; bit++) {
+        table->owner[bit] = NO_OWNER;
+    }
+    for_each_mapping(mapping, i, list) {
+        for (gpio_mask = mapping->gpio_mask; gpio_mask;
+            gpio_mask &= gpio_mask - 1) {
+            bit = __builtin_ctz(gpio_mask);
+            table->gpio_mappings[bit * words + i / 32] |= 1 << (i % 32);
+            if (mapping->activated) {
+                table->owner[bit] = i;
+            }
+        }
+    }
+    table->mapped_mask = mapped_mask;
+    table->index_generation = list->generation;
+    table->indexed = true;
+    FK_DEBUG("Indexed %u mappings\n", list->count);
+    return true;
+}
+
+/* Add the mappings involving the given GPIOs after the given mapping list
+ * position to the mappings to evaluate
+ */
+void add_mapping_candidates(mapping_table_t *table, uint32_t gpio_mask,
+    int position)
+{
+    unsigned int word, first;
+    uint32_t mask;
+    int bit;
+
+    first = (position + 1) / 32;
+    for (; gpio_mask; gpio_mask &= gpio_mask - 1) {
+        bit = __builtin_ctz(gpio_mask);
+        for (word = first; word < table->words; word++) {
+            mask = table->gpio_mappings[bit * table->words + word];
+            if (word == first) {
+                mask &= ~((1u << ((position + 1) % 32)) - 1);
+            }
+            table->candidates[word] |= mask;
+        }
+    }
+}
+
+/* Collect the chord recognition windows of a mapping list */
+bool collect_mapping_chords(mapping_table_t *table, mapping_list_t *list)
+{
+    mapping_t *mapping;
+    mapping_chord_t *chords;
+    unsigned int i, size;
+
+    /* A failed collection is not retried until the mapping list changes */
+    table->chord_generation = list->generation;
+    table->chords_collected = true;
+    table->chord_count = 0;
+    table->chord_mask = 0;
+    for_each_mapping(mapping, i, list) {
+        if (mapping->chord_ms == 0) {
+            continue;
+        }
+        if (table->chord_count == table->chord_size) {
+            size = table->chord_size ? 2 * table->chord_size : 8;
+            chords = (mapping_chord_t *) realloc(table->chords,
+                size * sizeof (mapping_chord_t));
+            if (chords == NULL) {
+                FK_ERROR("Cannot allocate mapping chords\n");
+                table->chord_count = 0;
+                table->chord_mask = 0;
+                return false;
+            }
+            table->chords = chords;
+            table->chord_size = size;
+        }
+        table->chords[table->chord_count].gpio_mask = mapping->gpio_mask;
+        table->chords[table->chord_count++].window_us =
+            mapping->chord_ms * 1000;
+        table->chord_mask |= mapping->gpio_mask;
+    }
+    return true;
+}
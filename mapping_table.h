@@ -0,0 +1,140 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file mapping_table.h
+ *  This file contains the compiled GPIO state to active mappings table
+ *
+ *  The mapping table holds, for every combination of the mapped GPIOs, the
+ *  set of mappings that must be active, in mapping list order. A GPIO mask is
+ *  reduced to a table entry by gathering its mapped bits with two 256-entry
+ *  byte tables.
+ *
+ *  The mapping index holds, for every GPIO, the set of mappings involving it
+ *  as a bitmap of mapping list positions, and the position of the activated
+ *  mapping owning it. It is cheap to build and allows an incremental
+ *  evaluation of the mappings involving the changed GPIOs only, while the
+ *  mapping table is being compiled.
+ *
+ *  The mapping chords hold the GPIO masks and recognition windows of the
+ *  mappings with a chord recognition window.
+ */
+
+#ifndef _MAPPING_TABLE_H_
+#define _MAPPING_TABLE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "mapping_list.h"
+
+/* Maximum number of mapped GPIOs, the table has 2^n entries */
+#define MAX_NUM_TABLE_GPIO  16
+
+/* Invalid mapping table entry */
+#define NO_ENTRY            (-1)
+
+/* Invalid mapping index GPIO owner */
+#define NO_OWNER            (-1)
+
+/* Chord recognition window of a mapping */
+typedef struct {
+    uint32_t gpio_mask;
+    uint32_t window_us;
+} mapping_chord_t;
+
+typedef struct {
+
+    /* Mapping list generation the table was compiled from, the table may be
+     * compiled from a generation without success
+     */
+    unsigned int generation;
+    bool compiled;
+
+    /* Mapping list generation the index was built from */
+    unsigned int index_generation;
+    bool indexed;
+
+    /* Mapped GPIOs */
+    uint32_t mapped_mask;
+
+    /* Last applied GPIO mask */
+    uint32_t gpio_mask;
+
+    /* Mapped GPIO bits gathering tables */
+    uint8_t gather[2][256];
+    uint8_t gather_shift;
+
+    /* Number of mapping slots */
+    unsigned int mapping_count;
+
+    /* Per-mapping slot set membership marks */
+    uint32_t *marks;
+    uint32_t mark;
+
+    /* Active mapping slots for entry n are pool[index[n]] up to
+     * pool[index[n + 1]] excluded
+     */
+    uint32_t *index;
+    uint16_t *pool;
+    unsigned int pool_size;
+
+    /* Entry of the currently active mapping set */
+    int previous;
+
+    /* Bitmaps of the mapping list positions involving each GPIO, and
+     * bitmap of the mapping list positions to evaluate, in 32-bit words
+     */
+    unsigned int words;
+    uint32_t *gpio_mappings;
+    uint32_t *candidates;
+
+    /* Mapping list position of the activated mapping owning each GPIO */
+    int owner[MAX_NUM_TABLE_GPIO];
+
+    /* Mapping list generation the chords were collected from */
+    unsigned int chord_generation;
+    bool chords_collected;
+
+    /* GPIOs involved in chords, and chords */
+    uint32_t chord_mask;
+    unsigned int chord_count;
+    unsigned int chord_size;
+    mapping_chord_t *chords;
+} mapping_table_t;
+
+/* Get the mapping table entry for a GPIO mask */
+static inline int lookup_mapping_table(const mapping_table_t *table,
+    uint32_t gpio_mask)
+{
+    return table->gather[0][gpio_mask & 0xFF] |
+        (table->gather[1][(gpio_mask >> 8) & 0xFF] << table->gather_shift);
+}
+
+void init_mapping_table(mapping_table_t *table);
+void free_mapping_table(mapping_table_t *table);
+bool compile_mapping_table(mapping_table_t *table, mapping_list_t *list);
+uint32_t mark_mapping_table(mapping_table_t *table, int entry);
+bool index_mapping_table(mapping_table_t *table, mapping_list_t *list);
+void add_mapping_candidates(mapping_table_t *table, uint32_t gpio_mask,
+    int position);
+bool collect_mapping_chords(mapping_table_t *table, mapping_list_t *list);
+
+#endif // _MAPPING_TABLE_H_
@@ -0,0 +1,143 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file mouse_motion.c
+ *  This file contains the mouse emulation functions
+ */
+
+#include <stdio.h>
+#include <syslog.h>
+#include <linux/input.h>
+#include "mouse_motion.h"
+#include "timer_queue.h"
+#include "uinput.h"
+
+//#define DEBUG_MOUSE_MOTION
+#define ERROR_MOUSE_MOTION
+
+#ifdef DEBUG_MOUSE_MOTION
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_MOUSE_MOTION
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Mouse motion frame period */
+#define MOUSE_FRAME_US          (1000000 / MOUSE_FRAME_RATE_HZ)
+
+/* The pointer speed ramps up linearly from the mapping step to the maximum
+ * acceleration times the mapping step in the given number of frames
+ */
+#define MAX_MOUSE_ACCELERATION  4
+#define MOUSE_ACCELERATION_FRAMES   MOUSE_FRAME_RATE_HZ
+
+/* Sub-pixel motion fixed point scale */
+#define MOUSE_SUBPIXEL_SCALE    256
+
+/* Number of mouse axes, indexed by REL_X and REL_Y */
+#define NUM_MOUSE_AXES          2
+
+/* Sum of the steps of the held mappings and sub-pixel motion left, per axis */
+static int velocity[NUM_MOUSE_AXES];
+static int subpixels[NUM_MOUSE_AXES];
+
+/* Number of held mappings, motion frame count and frame timer */
+static unsigned int held_count;
+static unsigned int frame_count;
+static int frame_timer = NO_TIMER;
+
+/* Mouse motion frame timer callback, sends the motion of all the held
+ * mappings at once
+ */
+static void mouse_frame_timer(void *data)
+{
+    int axis, scale, motion[NUM_MOUSE_AXES];
+
+    (void) data;
+    if (frame_count < MOUSE_ACCELERATION_FRAMES) {
+        frame_count++;
+    }
+    scale = MOUSE_SUBPIXEL_SCALE + (MAX_MOUSE_ACCELERATION - 1) *
+        MOUSE_SUBPIXEL_SCALE * frame_count / MOUSE_ACCELERATION_FRAMES;
+    for (axis = 0; axis < NUM_MOUSE_AXES; axis++) {
+        subpixels[axis] += velocity[axis] * scale;
+        motion[axis] = subpixels[axis] / MOUSE_SUBPIXEL_SCALE;
+        subpixels[axis] -= motion[axis] * MOUSE_SUBPIXEL_SCALE;
+    }
+    sendRel(motion[REL_X], motion[REL_Y]);
+}
+
+/* Start moving the pointer along an axis for a held mapping */
+void start_mouse_motion(int axis, int step)
+{
+    if (axis != REL_X && axis != REL_Y) {
+        FK_ERROR("Invalid mouse axis %d\n", axis);
+        return;
+    }
+    FK_DEBUG("Start mouse motion %s %d\n", mouse_axis_name(axis), step);
+    velocity[axis] += step;
+    if (held_count++ == 0) {
+
+        /* The first frame is sent at once, the next ones periodically */
+        frame_count = 0;
+        subpixels[REL_X] = subpixels[REL_Y] = 0;
+        mouse_frame_timer(NULL);
+        frame_timer = add_timer(MOUSE_FRAME_US, MOUSE_FRAME_US,
+            mouse_frame_timer, NULL);
+    }
+}
+
+/* Stop moving the pointer along an axis for a released mapping */
+void stop_mouse_motion(int axis, int step)
+{
+    if ((axis != REL_X && axis != REL_Y) || held_count == 0) {
+        return;
+    }
+    FK_DEBUG("Stop mouse motion %s %d\n", mouse_axis_name(axis), step);
+    velocity[axis] -= step;
+    if (--held_count == 0) {
+        cancel_timer(frame_timer);
+        frame_timer = NO_TIMER;
+        velocity[REL_X] = velocity[REL_Y] = 0;
+    }
+}
+
+/* Get the name of a mouse axis */
+const char *mouse_axis_name(int axis)
+{
+    switch (axis) {
+    case REL_X:
+        return "X";
+
+    case REL_Y:
+        return "Y";
+
+    default:
+        return "?";
+    }
+}
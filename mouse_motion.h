@@ -0,0 +1,46 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file mouse_motion.h
+ *  This file contains the mouse emulation functions
+ *
+ *  The mouse mappings move the pointer of the uinput device while they are
+ *  held: the motion frames are sent at a fixed frame rate from the timer
+ *  queue, the motions of all the held mappings are batched in a single write
+ *  per frame, and the pointer speeds up the longer it moves.
+ */
+
+#ifndef _MOUSE_MOTION_H_
+#define _MOUSE_MOTION_H_
+
+/* Mouse motion frame rate in Hz */
+#define MOUSE_FRAME_RATE_HZ     60
+
+/* Maximum mouse motion step in pixels per frame */
+#define MAX_MOUSE_STEP          127
+
+void start_mouse_motion(int axis, int step);
+void stop_mouse_motion(int axis, int step);
+const char *mouse_axis_name(int axis);
+
+#endif // _MOUSE_MOTION_H_
@@ -0,0 +1,637 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file native_action.c
+ *  This file contains the native quick action functions
+ */
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/fb.h>
+#include <sound/asound.h>
+#include "native_action.h"
+#include "timer_queue.h"
+
+//#define DEBUG_NATIVE_ACTION
+#define ERROR_NATIVE_ACTION
+
+#ifdef DEBUG_NATIVE_ACTION
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_NATIVE_ACTION
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Maximum sysfs attribute and path lengths */
+#define MAX_ATTRIBUTE_LENGTH    16
+#define MAX_PATH_LENGTH         512
+
+/* Maximum numbered suffix of the snapshots taken in the same second */
+#define MAX_SNAPSHOT_SUFFIX     99
+
+/* Number of lines converted and written per snapshot chunk, and interval
+ * between two chunks in us
+ */
+#define SNAPSHOT_CHUNK_LINES    16
+#define SNAPSHOT_CHUNK_US       2000
+
+/* Volume or brightness level, with its cached descriptor, raw value range,
+ * and raw value waiting for a coalesced write
+ */
+typedef struct level_t {
+    const char *name;
+    bool (*open)(struct level_t *level);
+    bool (*read)(struct level_t *level, long *value);
+    bool (*write)(struct level_t *level, long value);
+    int fd;
+    long min;
+    long max;
+    long value;
+    bool pending;
+    int timer;
+    uint64_t write_us;
+} level_t;
+
+/* Snapshot in progress, written in chunks of lines from its copy of the
+ * visible framebuffer
+ */
+typedef struct {
+    struct fb_var_screeninfo var;
+    uint8_t *pixels;
+    uint8_t *rgb;
+    FILE *fp;
+    char path[MAX_PATH_LENGTH];
+    unsigned int y;
+    int timer;
+} snapshot_t;
+
+#undef X
+#define X(a, b) b,
+static const char *action_names[] = {NATIVE_ACTIONS};
+
+static bool open_mixer(level_t *level);
+static bool read_mixer(level_t *level, long *value);
+static bool write_mixer(level_t *level, long value);
+static bool open_backlight(level_t *level);
+static bool read_attribute(level_t *level, long *value);
+static bool write_attribute(level_t *level, long value);
+
+/* Volume and brightness levels */
+static level_t volume = {
+    "volume", open_mixer, read_mixer, write_mixer, -1, 0, 0, 0, false,
+    NO_TIMER, 0
+};
+static level_t brightness = {
+    "brightness", open_backlight, read_attribute, write_attribute, -1, 0, 0,
+    0, false, NO_TIMER, 0
+};
+
+#ifndef SIMULATION
+/* ALSA mixer volume element identifier and channel count */
+static struct snd_ctl_elem_id mixer_id;
+static unsigned int mixer_channels;
+#endif
+
+/* Framebuffer descriptor */
+static int fd_framebuffer = -1;
+
+/* Snapshot in progress, if its framebuffer copy is allocated */
+static snapshot_t snapshot;
+
+/* Read a decimal sysfs attribute */
+static bool read_attribute(level_t *level, long *value)
+{
+    char buffer[MAX_ATTRIBUTE_LENGTH + 1];
+    ssize_t length;
+
+    length = pread(level->fd, buffer, MAX_ATTRIBUTE_LENGTH, 0);
+    if (length <= 0) {
+        FK_ERROR("Cannot read %s: %s\n", level->name,
+            length < 0 ? strerror(errno) : "empty");
+        return false;
+    }
+    buffer[length] = '\0';
+    *value = strtol(buffer, NULL, 10);
+    return true;
+}
+
+/* Write a decimal sysfs attribute */
+static bool write_attribute(level_t *level, long value)
+{
+    char buffer[MAX_ATTRIBUTE_LENGTH + 1];
+    int length;
+
+    length = snprintf(buffer, sizeof (buffer), "%ld\n", value);
+    if (pwrite(level->fd, buffer, length, 0) != length) {
+        FK_ERROR("Cannot write %s: %s\n", level->name, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+#ifdef SIMULATION
+/* Open the simulated mixer, a file holding the volume from 0 to 100 */
+static bool open_mixer(level_t *level)
+{
+    level->fd = open(MIXER_DEVICE, O_RDWR | O_CLOEXEC);
+    if (level->fd < 0) {
+        FK_ERROR("Cannot open \"%s\": %s\n", MIXER_DEVICE, strerror(errno));
+        return false;
+    }
+    level->min = 0;
+    level->max = 100;
+    return true;
+}
+
+/* Read the simulated mixer volume */
+static bool read_mixer(level_t *level, long *value)
+{
+    return read_attribute(level, value);
+}
+
+/* Write the simulated mixer volume */
+static bool write_mixer(level_t *level, long value)
+{
+    return write_attribute(level, value);
+}
+#else
+/* Open the ALSA mixer control device and look up the volume element */
+static bool open_mixer(level_t *level)
+{
+    struct snd_ctl_elem_info info;
+
+    level->fd = open(MIXER_DEVICE, O_RDWR | O_CLOEXEC);
+    if (level->fd < 0) {
+        FK_ERROR("Cannot open \"%s\": %s\n", MIXER_DEVICE, strerror(errno));
+        return false;
+    }
+    memset(&info, 0, sizeof (info));
+    info.id.iface = SNDRV_CTL_ELEM_IFACE_MIXER;
+    strncpy((char *) info.id.name, MIXER_ELEMENT, sizeof (info.id.name) - 1);
+    if (ioctl(level->fd, SNDRV_CTL_IOCTL_ELEM_INFO, &info) < 0 ||
+        info.type != SNDRV_CTL_ELEM_TYPE_INTEGER ||
+        info.value.integer.max <= info.value.integer.min) {
+        FK_ERROR("Cannot find mixer element \"%s\"\n", MIXER_ELEMENT);
+        close(level->fd);
+        level->fd = -1;
+        return false;
+    }
+    mixer_id = info.id;
+    mixer_channels = info.count;
+    if (mixer_channels > sizeof (((struct snd_ctl_elem_value *) 0)->
+        value.integer.value) / sizeof (long)) {
+        mixer_channels = 1;
+    }
+    level->min = info.value.integer.min;
+    level->max = info.value.integer.max;
+    return true;
+}
+
+/* Read the mixer volume of the first channel */
+static bool read_mixer(level_t *level, long *value)
+{
+    struct snd_ctl_elem_value control;
+
+    memset(&control, 0, sizeof (control));
+    control.id = mixer_id;
+    if (ioctl(level->fd, SNDRV_CTL_IOCTL_ELEM_READ, &control) < 0) {
+        FK_ERROR("Cannot read volume: %s\n", strerror(errno));
+        return false;
+    }
+    *value = control.value.integer.value[0];
+    return true;
+}
+
+/* Write the mixer volume of all the channels */
+static bool write_mixer(level_t *level, long value)
+{
+    struct snd_ctl_elem_value control;
+    unsigned int channel;
+
+    memset(&control, 0, sizeof (control));
+    control.id = mixer_id;
+    for (channel = 0; channel < mixer_channels; channel++) {
+        control.value.integer.value[channel] = value;
+    }
+    if (ioctl(level->fd, SNDRV_CTL_IOCTL_ELEM_WRITE, &control) < 0) {
+        FK_ERROR("Cannot write volume: %s\n", strerror(errno));
+        return false;
+    }
+    return true;
+}
+#endif // SIMULATION
+
+/* Open the brightness attribute of the first backlight device, and read its
+ * maximum brightness once
+ */
+static bool open_backlight(level_t *level)
+{
+    char path[MAX_PATH_LENGTH];
+    struct dirent *entry;
+    DIR *directory;
+    bool result;
+
+    directory = opendir(BACKLIGHT_DIRECTORY);
+    if (directory == NULL) {
+        FK_ERROR("Cannot open \"%s\": %s\n", BACKLIGHT_DIRECTORY,
+            strerror(errno));
+        return false;
+    }
+    while ((entry = readdir(directory)) != NULL && entry->d_name[0] == '.');
+    if (entry == NULL) {
+        FK_ERROR("No backlight device found\n");
+        closedir(directory);
+        return false;
+    }
+    snprintf(path, sizeof (path), "%s/%s/max_brightness", BACKLIGHT_DIRECTORY,
+        entry->d_name);
+    level->fd = open(path, O_RDONLY | O_CLOEXEC);
+    result = level->fd >= 0 && read_attribute(level, &level->max);
+    if (level->fd >= 0) {
+        close(level->fd);
+    }
+    snprintf(path, sizeof (path), "%s/%s/brightness", BACKLIGHT_DIRECTORY,
+        entry->d_name);
+    closedir(directory);
+    level->fd = result ? open(path, O_RDWR | O_CLOEXEC) : -1;
+    if (level->fd < 0 || level->max <= 0) {
+        FK_ERROR("Cannot open backlight \"%s\"\n", path);
+        if (level->fd >= 0) {
+            close(level->fd);
+            level->fd = -1;
+        }
+        return false;
+    }
+    level->min = 0;
+    return true;
+}
+
+/* Coalesced level write timer callback */
+static void level_timer(void *data)
+{
+    level_t *level = (level_t *) data;
+
+    level->timer = NO_TIMER;
+    level->pending = false;
+    level->write_us = get_time_us();
+    FK_DEBUG("Set %s to %ld\n", level->name, level->value);
+    level->write(level, level->value);
+}
+
+/* Adjust a level by a step in percent of its range: the first change is
+ * written at once, the next ones within the coalescing interval are
+ * accumulated and written at its end
+ */
+static void adjust_level(level_t *level, int step)
+{
+    long range, percent, value;
+    uint64_t now;
+
+    if (level->fd < 0 && level->open(level) == false) {
+        return;
+    }
+    if (level->pending == false &&
+        level->read(level, &level->value) == false) {
+        return;
+    }
+    range = level->max - level->min;
+    percent = ((level->value - level->min) * 100 + range / 2) / range + step;
+    percent = percent < 0 ? 0 : percent > 100 ? 100 : percent;
+    value = level->min + (percent * range + 50) / 100;
+    if (value == level->value) {
+
+        /* Move by at least one raw step */
+        value += step > 0 ? 1 : -1;
+        value = value < level->min ? level->min :
+            value > level->max ? level->max : value;
+    }
+    level->value = value;
+    if (level->pending) {
+        return;
+    }
+    now = get_time_us();
+    if (now - level->write_us >= ACTION_COALESCE_US) {
+        level->write_us = now;
+        FK_DEBUG("Set %s to %ld\n", level->name, level->value);
+        level->write(level, level->value);
+        return;
+    }
+    level->timer = add_timer(level->write_us + ACTION_COALESCE_US - now, 0,
+        level_timer, level);
+    if (level->timer != NO_TIMER) {
+        level->pending = true;
+    }
+}
+
+/* Convert a framebuffer color component to 8 bits */
+static uint8_t get_component(uint32_t pixel,
+    const struct fb_bitfield *bitfield)
+{
+    uint64_t mask = (1ULL << bitfield->length) - 1;
+
+    if (bitfield->length == 0 || bitfield->offset >= 32) {
+        return 0;
+    }
+    return ((pixel >> bitfield->offset) & mask) * 255 / mask;
+}
+
+/* Copy the visible framebuffer lines */
+static bool copy_framebuffer(const struct fb_var_screeninfo *var,
+    const struct fb_fix_screeninfo *fix, uint8_t *pixels)
+{
+    unsigned int y, bytes = var->bits_per_pixel / 8;
+
+    for (y = 0; y < var->yres; y++, pixels += var->xres * bytes) {
+        if (pread(fd_framebuffer, pixels, var->xres * bytes,
+            (off_t) (var->yoffset + y) * fix->line_length +
+            var->xoffset * bytes) != (ssize_t) (var->xres * bytes)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Convert and write the next lines of the snapshot in progress to its binary
+ * PPM file, preceded by its header for the first ones
+ */
+static bool write_snapshot_lines(unsigned int count)
+{
+    const struct fb_var_screeninfo *var = &snapshot.var;
+    unsigned int x, bytes = var->bits_per_pixel / 8;
+    uint8_t *pixel, *rgb = snapshot.rgb;
+    uint32_t value;
+
+    if (snapshot.y == 0 &&
+        fprintf(snapshot.fp, "P6\n%u %u\n255\n", var->xres, var->yres) < 0) {
+        return false;
+    }
+    for (; count && snapshot.y < var->yres; count--, snapshot.y++) {
+        pixel = &snapshot.pixels[snapshot.y * var->xres * bytes];
+        for (x = 0; x < var->xres; x++, pixel += bytes) {
+            value = bytes == 2 ? *(uint16_t *) pixel : *(uint32_t *) pixel;
+            rgb[3 * x] = get_component(value, &var->red);
+            rgb[3 * x + 1] = get_component(value, &var->green);
+            rgb[3 * x + 2] = get_component(value, &var->blue);
+        }
+        if (fwrite(rgb, 3, var->xres, snapshot.fp) != var->xres) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Create a new snapshot file named after the current time, with a numbered
+ * suffix if a snapshot was already taken in the same second
+ */
+static FILE *create_snapshot_file(char *path)
+{
+    unsigned int length, suffix;
+    time_t now;
+    FILE *fp;
+    int fd;
+
+    now = time(NULL);
+    length = snprintf(path, MAX_PATH_LENGTH, "%s/snapshot_",
+        SNAPSHOT_DIRECTORY);
+    length += strftime(&path[length], MAX_PATH_LENGTH - length,
+        "%Y%m%d_%H%M%S", localtime(&now));
+    for (suffix = 0; suffix <= MAX_SNAPSHOT_SUFFIX; suffix++) {
+        if (suffix) {
+            snprintf(&path[length], MAX_PATH_LENGTH - length, "_%u.ppm",
+                suffix);
+        } else {
+            snprintf(&path[length], MAX_PATH_LENGTH - length, ".ppm");
+        }
+        fd = open(path, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (fd >= 0) {
+            if ((fp = fdopen(fd, "w")) == NULL) {
+                close(fd);
+                break;
+            }
+            return fp;
+        } else if (errno != EEXIST) {
+            break;
+        }
+    }
+    FK_ERROR("Cannot create \"%s\": %s\n", path, strerror(errno));
+    return NULL;
+}
+
+/* Terminate the snapshot in progress, closing its file and releasing its
+ * framebuffer copy
+ */
+static void finish_snapshot(bool result)
+{
+    cancel_timer(snapshot.timer);
+    if (snapshot.fp != NULL && fclose(snapshot.fp) != 0) {
+        result = false;
+    }
+    if (result) {
+        FK_DEBUG("Saved snapshot \"%s\"\n", snapshot.path);
+    } else if (snapshot.fp != NULL) {
+        FK_ERROR("Cannot write \"%s\"\n", snapshot.path);
+    }
+    snapshot.fp = NULL;
+    free(snapshot.pixels);
+    free(snapshot.rgb);
+    snapshot.pixels = NULL;
+    snapshot.rgb = NULL;
+}
+
+/* Write the next chunk of the snapshot in progress, its file being created
+ * by the first chunk
+ */
+static void snapshot_timer(void *data)
+{
+    (void) data;
+    if (snapshot.fp == NULL &&
+        (snapshot.fp = create_snapshot_file(snapshot.path)) == NULL) {
+        finish_snapshot(false);
+    } else if (write_snapshot_lines(SNAPSHOT_CHUNK_LINES) == false) {
+        finish_snapshot(false);
+    } else if (snapshot.y == snapshot.var.yres) {
+        finish_snapshot(true);
+    }
+}
+
+/* Take a snapshot of the visible framebuffer: it is copied at once, then
+ * converted and saved to a binary PPM snapshot file in chunks from a timer,
+ * so that the file creation and writes do not stall the button events
+ */
+static void take_snapshot(void)
+{
+    struct fb_var_screeninfo var;
+    struct fb_fix_screeninfo fix;
+    unsigned int bytes;
+
+    if (snapshot.pixels != NULL) {
+        FK_ERROR("Snapshot already in progress\n");
+        return;
+    }
+    if (fd_framebuffer < 0) {
+        fd_framebuffer = open(FRAMEBUFFER_DEVICE, O_RDONLY | O_CLOEXEC);
+        if (fd_framebuffer < 0) {
+            FK_ERROR("Cannot open \"%s\": %s\n", FRAMEBUFFER_DEVICE,
+                strerror(errno));
+            return;
+        }
+    }
+    if (ioctl(fd_framebuffer, FBIOGET_VSCREENINFO, &var) < 0 ||
+        ioctl(fd_framebuffer, FBIOGET_FSCREENINFO, &fix) < 0) {
+#ifdef SIMULATION
+
+        /* The simulated framebuffer is a raw 240x240 RGB565 file */
+        memset(&var, 0, sizeof (var));
+        var.xres = var.yres = 240;
+        var.bits_per_pixel = 16;
+        var.red.offset = 11;
+        var.red.length = 5;
+        var.green.offset = 5;
+        var.green.length = 6;
+        var.blue.length = 5;
+        fix.line_length = 240 * 2;
+#else
+        FK_ERROR("Cannot get framebuffer information: %s\n", strerror(errno));
+        return;
+#endif
+    }
+    bytes = var.bits_per_pixel / 8;
+    if (bytes != 2 && bytes != 4) {
+        FK_ERROR("Unsupported framebuffer depth %u\n", var.bits_per_pixel);
+        return;
+    }
+    snapshot.var = var;
+    snapshot.y = 0;
+    snapshot.timer = NO_TIMER;
+    snapshot.pixels = (uint8_t *) malloc(var.xres * var.yres * bytes);
+    snapshot.rgb = (uint8_t *) malloc(var.xres * 3);
+    if (snapshot.pixels == NULL || snapshot.rgb == NULL) {
+        FK_ERROR("Cannot allocate snapshot buffers\n");
+        finish_snapshot(false);
+        return;
+    }
+    if (copy_framebuffer(&var, &fix, snapshot.pixels) == false) {
+        FK_ERROR("Cannot read \"%s\": %s\n", FRAMEBUFFER_DEVICE,
+            strerror(errno));
+        finish_snapshot(false);
+        return;
+    }
+    snapshot.timer = add_timer(0, SNAPSHOT_CHUNK_US, snapshot_timer, NULL);
+    if (snapshot.timer == NO_TIMER) {
+        finish_snapshot(false);
+    }
+}
+
+/* Run a native action */
+void run_native_action(native_action_t action, int step)
+{
+    FK_DEBUG("Native action %s %d\n", native_action_name(action), step);
+    switch (action) {
+    case ACTION_VOLUME:
+        adjust_level(&volume, step);
+        break;
+
+    case ACTION_BRIGHTNESS:
+        adjust_level(&brightness, step);
+        break;
+
+    case ACTION_SNAPSHOT:
+        take_snapshot();
+        break;
+
+    default:
+        FK_ERROR("Unknown native action %d\n", action);
+        break;
+    }
+}
+
+/* Close a level, writing its pending value if any */
+static void close_level(level_t *level)
+{
+    if (level->pending) {
+        cancel_timer(level->timer);
+        level_timer(level);
+    }
+    if (level->fd >= 0) {
+        close(level->fd);
+        level->fd = -1;
+    }
+}
+
+/* Deinitialize the native actions, closing their cached descriptors */
+void deinit_native_actions(void)
+{
+    close_level(&volume);
+    close_level(&brightness);
+
+    /* A snapshot in progress is completed at once */
+    if (snapshot.pixels != NULL) {
+        cancel_timer(snapshot.timer);
+        snapshot.timer = NO_TIMER;
+        while (snapshot.pixels != NULL) {
+            snapshot_timer(NULL);
+        }
+    }
+    if (fd_framebuffer >= 0) {
+        close(fd_framebuffer);
+        fd_framebuffer = -1;
+    }
+}
+
+/* Get a native action name */
+const char *native_action_name(native_action_t action)
+{
+    if (action <= ACTION_SNAPSHOT) {
+        return action_names[action];
+    }
+    return "?";
+}
+
+/* Lookup a native action from its name, returns -1 if unknown */
+int lookup_native_action(const char *name)
+{
+    int action;
+
+    for (action = 0; action <= ACTION_SNAPSHOT; action++) {
+        if (strcasecmp(name, action_names[action]) == 0) {
+            return action;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,77 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file native_action.h
+ *  This file contains the native quick action functions
+ *
+ *  The native actions adjust the audio volume through the ALSA mixer control
+ *  device and the screen brightness through the sysfs backlight class, or
+ *  take a screen snapshot from the framebuffer, without any Shell command.
+ *  Their file descriptors are opened once and kept, and the volume and
+ *  brightness changes of rapid presses are coalesced into a single write.
+ */
+
+#ifndef _NATIVE_ACTION_H_
+#define _NATIVE_ACTION_H_
+
+/* Definition of the different native actions */
+#define NATIVE_ACTIONS \
+    X(ACTION_VOLUME, "VOLUME") \
+    X(ACTION_BRIGHTNESS, "BRIGHTNESS") \
+    X(ACTION_SNAPSHOT, "SNAPSHOT")
+
+/* Enumeration of the different native actions */
+#undef X
+#define X(a, b) a,
+typedef enum {NATIVE_ACTIONS} native_action_t;
+
+/* Maximum volume or brightness step in percent */
+#define MAX_ACTION_STEP         100
+
+/* Minimum interval between two volume or brightness writes in us */
+#define ACTION_COALESCE_US      20000
+
+/* The simulation uses fake device files below a root directory */
+#ifdef SIMULATION
+#define ACTION_ROOT             "/tmp/fkgpiod_sim"
+#else
+#define ACTION_ROOT             ""
+#endif
+
+/* ALSA mixer control device and volume element name */
+#define MIXER_DEVICE            ACTION_ROOT "/dev/snd/controlC0"
+#define MIXER_ELEMENT           "Headphone Playback Volume"
+
+/* Backlight class directory */
+#define BACKLIGHT_DIRECTORY     ACTION_ROOT "/sys/class/backlight"
+
+/* Framebuffer device and snapshot directory */
+#define FRAMEBUFFER_DEVICE      ACTION_ROOT "/dev/fb0"
+#define SNAPSHOT_DIRECTORY      ACTION_ROOT "/mnt/FunKey/screenshots"
+
+void run_native_action(native_action_t action, int step);
+void deinit_native_actions(void);
+const char *native_action_name(native_action_t action);
+int lookup_native_action(const char *name);
+
+#endif // _NATIVE_ACTION_H_
@@ -32,9 +32,17 @@
 #include <string.h>
 #include <unistd.h>
 #include <syslog.h>
+#include <linux/input.h>
+#include "command_executor.h"
+#include "gpio_mapping.h"
+#include "gpio_sim.h"
+#include "key_repeat.h"
 #include "keydefs.h"
 #include "mapping_list.h"
+#include "mouse_motion.h"
+#include "native_action.h"
 #include "parse_config.h"
+#include "shutdown.h"
 #include "uinput.h"
 
 //#define DEBUG_CONFIG
@@ -89,25 +97,64 @@ static const keyword_t valid_commands[] = {
     {"TYPE", STATE_TYPE},
     {"DUMP", STATE_DUMP},
     {"SAVE", STATE_SAVE},
+    {"STATS", STATE_STATS},
+    {"LAYER", STATE_LAYER},
+    {"END", STATE_END},
+    {"PRELOAD", STATE_PRELOAD},
+    {"USE", STATE_USE},
+    {"SERVER", STATE_SERVER},
+    {"SHUTDOWN", STATE_SHUTDOWN},
+#ifdef SIMULATION
+    {"SIM", STATE_SIM},
+#endif
     {"", STATE_INVALID}
 };
 
+/* Default command execution options */
+static const command_options_t default_options;
+
 /* Map between function keywords and states */
 static const keyword_t valid_functions[] = {
     {"KEY", STATE_KEY},
     {"COMMAND", STATE_COMMAND},
+    {"MOUSE", STATE_MOUSE},
+    {"ACTION", STATE_ACTION},
+    {"", STATE_INVALID}
+};
+
+/* Map between mapping option keywords and states */
+static const keyword_t valid_options[] = {
+    {"CHORD", STATE_CHORD},
+    {"REPEAT", STATE_REPEAT},
+    {"TURBO", STATE_TURBO},
+    {"POLICY", STATE_POLICY},
+    {"NICE", STATE_NICE},
+    {"CPUS", STATE_CPUS},
+    {"CGROUP", STATE_CGROUP},
+    {"TIMEOUT", STATE_TIMEOUT},
     {"", STATE_INVALID}
 };
 
 /* The command keywor state */
 static parse_state_t keyword;
 
+/* Mapping list of the layer block being defined, if any */
+static mapping_list_t *layer_list;
+
+/* A configuration file is being loaded off to the side */
+static bool loading = false;
+
 /* Buffer for argument parsing */
 static char buffer[MAX_BUFFER_LENGTH + 1];
 
 /* Line buffer for parsing */
 static char line[MAX_LINE_LENGTH + 1];
 
+static bool load_config_file(const char *name, mapping_list_t *list,
+    uint32_t *monitored_gpio_mask);
+static bool preload_config_file(char *arguments, mapping_list_t *list,
+    uint32_t *monitored_gpio_mask);
+
 /* Lookup a command parse state from a token */
 static parse_state_t lookup_command(char *token)
 {
@@ -139,6 +186,98 @@ static parse_state_t lookup_function(char *token)
     return STATE_INVALID;
 }
 
+/* Lookup a mapping option parse state from a token */
+static parse_state_t lookup_option(char *token)
+{
+    int option;
+
+    for (option = 0; valid_options[option].state != STATE_INVALID; option++) {
+        if (strcasecmp(token, valid_options[option].command) == 0) {
+            return valid_options[option].state;
+        }
+    }
+    return STATE_INVALID;
+}
+
+/* Lookup a decimal number within the given range from a token */
+static int lookup_number(char *token, int min, int max)
+{
+    char *s;
+    int number;
+
+    for (s = token; *s; s++) {
+        if (!isdigit(*s)) {
+            FK_ERROR("Invalid number \"%s\"\n", token);
+            return -1;
+        }
+    }
+    number = atoi(token);
+    if (s == token || number < min || number > max) {
+        FK_ERROR("Number \"%s\" out of range [%d-%d]\n", token, min, max);
+        return -1;
+    }
+    return number;
+}
+
+/* Lookup a rate in Hz from a token, with an optional "HZ" unit suffix */
+static int lookup_rate(char *token)
+{
+    size_t length = strlen(token);
+
+    if (length > 2 && strcasecmp(&token[length - 2], "HZ") == 0) {
+        token[length - 2] = '\0';
+    }
+    return lookup_number(token, 1, MAX_REPEAT_HZ);
+}
+
+/* Lookup a mouse axis from a token */
+static int lookup_axis(char *token)
+{
+    if (strcasecmp(token, "X") == 0) {
+        return REL_X;
+    } else if (strcasecmp(token, "Y") == 0) {
+        return REL_Y;
+    }
+    FK_ERROR("Unknown mouse axis \"%s\"\n", token);
+    return -1;
+}
+
+/* Lookup a signed mouse motion or native action step from a token, returns 0
+ * upon error
+ */
+static int lookup_step(char *token, int max)
+{
+    int sign = 1, step;
+
+    if (*token == '-' || *token == '+') {
+        sign = *token++ == '-' ? -1 : 1;
+    }
+    step = lookup_number(token, 1, max);
+    return step < 0 ? 0 : sign * step;
+}
+
+/* Lookup a CPU affinity mask from a token of CPU numbers separated by "+"
+ * signs, returns -1 upon error
+ */
+static int lookup_cpus(char *token)
+{
+    char *cpu, *next_cpu;
+    int mask = 0, value;
+
+    for (cpu = strtok_r(token, "+", &next_cpu); cpu != NULL;
+        cpu = strtok_r(NULL, "+", &next_cpu)) {
+        if ((value = lookup_number(cpu, 0, MAX_COMMAND_CPU)) < 0) {
+            return -1;
+        }
+        mask |= 1 << value;
+    }
+    if (mask == 0) {
+        FK_ERROR("Missing CPU\n");
+        return -1;
+    }
+    return mask;
+}
+
 /* Lookup a GPIO number from a token */
 static int lookup_gpio(char *token)
 {
@@ -155,6 +294,49 @@ static int lookup_gpio(char *token)
     return -1;
 }
 
+/* Lookup a mapping press variant from a token */
+static int lookup_variant(char *token)
+{
+    int variant;
+
+    for (variant = VARIANT_SHORT; variant <= VARIANT_DOUBLE; variant++) {
+        if (strcasecmp(token, variant_name(variant)) == 0) {
+            FK_DEBUG("Found variant \"%s\"\n", token);
+            return variant;
+        }
+    }
+    FK_ERROR("Unknown press variant \"%s\"\n", token);
+    return -1;
+}
+
+/* Remove the existing mappings conflicting with a new mapping: a button
+ * combination is either mapped directly, or with press variants
+ */
+static bool remove_conflicting_mappings(mapping_list_t *list,
+    uint32_t gpio_mask, mapping_variant_t variant)
+{
+    mapping_t *existing_mapping;
+    mapping_variant_t other;
+
+    for (other = VARIANT_NONE; other <= VARIANT_DOUBLE; other++) {
+        if (other != variant && variant != VARIANT_NONE &&
+            other != VARIANT_NONE) {
+            continue;
+        }
+        existing_mapping = find_mapping(list, gpio_mask, other);
+        if (existing_mapping != NULL) {
+            FK_DEBUG("Existing mapping with gpio_mask 0x%04X found\n",
+                gpio_mask);
+            if (remove_mapping(list, existing_mapping) == false) {
+                FK_ERROR("Cannot remove mapping with gpio_mask 0x%04X\n",
+                    gpio_mask);
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 /* Lookup a key code from a token */
 static int lookup_key(char *token)
 {
@@ -164,13 +346,44 @@ static int lookup_key(char *token)
         if (strcasecmp(token, key_names[key].name) == 0) {
             FK_DEBUG("Found keycode \"%s\" (%d)\n", key_names[key].name,
                 key_names[key].code);
-            return key;
+            return key_names[key].code;
         }
     }
     FK_ERROR("Unknown key \"%s\"\n", token);
     return -1;
 }
 
+/* Lookup a '+' separated key code list from a token, returns the number of
+ * keys or -1 upon error
+ */
+static int lookup_keys(char *token, int *keys)
+{
+    int count = 0;
+    char *token_end;
+
+    do {
+        token_end = strchr(token, '+');
+        if (token_end != NULL) {
+            *token_end = '\0';
+        }
+        if (*token == '\0') {
+            FK_ERROR("Missing key\n");
+            return -1;
+        }
+        if (count == MAX_MAPPING_KEYS) {
+            FK_ERROR("More than %d keys\n", MAX_MAPPING_KEYS);
+            return -1;
+        }
+        if ((keys[count++] = lookup_key(token)) < 0) {
+            return -1;
+        }
+        if (token_end != NULL) {
+            token = token_end + 1;
+        }
+    } while (token_end != NULL);
+    return count;
+}
+
 /* Get a GPIO name */
 const char *gpio_name(uint8_t gpio)
 {
@@ -193,20 +406,100 @@ const char *keycode_name(int keycode)
     return "?";
 }
 
+/* Start the command server from its handlers file and handler names, or stop
+ * it without arguments
+ */
+static bool start_server(char *arguments)
+{
+    char *file, *handlers[MAX_NUM_SERVER_HANDLERS + 1], *next_token;
+    unsigned int handler_count = 0;
+
+    file = strtok_r(arguments, " ", &next_token);
+    if (file == NULL) {
+        stop_command_server();
+        return true;
+    }
+    while ((handlers[handler_count] = strtok_r(NULL, " ", &next_token)) !=
+        NULL) {
+        if (++handler_count > MAX_NUM_SERVER_HANDLERS) {
+            FK_ERROR("More than %d server handlers\n",
+                MAX_NUM_SERVER_HANDLERS);
+            return false;
+        }
+    }
+    if (handler_count == 0) {
+        FK_ERROR("Missing server handler\n");
+        return false;
+    }
+    return start_command_server(file, handlers, handler_count);
+}
+
+/* Configure the shutdown of an event from its method, optionally preceded
+ * by SYNC, and followed by its command for the command method
+ */
+static bool configure_shutdown(char *arguments)
+{
+    char *token, *next_token;
+    int event, method;
+    bool sync_disks = false;
+
+    token = strtok_r(arguments, " ", &next_token);
+    if (token == NULL) {
+        FK_ERROR("Missing shutdown event\n");
+        return false;
+    }
+    if ((event = lookup_shutdown_event(token)) < 0) {
+        FK_ERROR("Unknown shutdown event \"%s\"\n", token);
+        return false;
+    }
+    token = strtok_r(NULL, " ", &next_token);
+    if (token != NULL && strcasecmp(token, "SYNC") == 0) {
+        sync_disks = true;
+        token = strtok_r(NULL, " ", &next_token);
+    }
+    if (token == NULL) {
+        FK_ERROR("Missing shutdown method\n");
+        return false;
+    }
+    if ((method = lookup_shutdown_method(token)) < 0) {
+        FK_ERROR("Unknown shutdown method \"%s\"\n", token);
+        return false;
+    }
+    if (method == METHOD_COMMAND && *next_token == '\0') {
+        FK_ERROR("Missing shutdown command\n");
+        return false;
+    } else if (method != METHOD_COMMAND && *next_token != '\0') {
+        FK_ERROR("Unexpected shutdown argument \"%s\"\n", next_token);
+        return false;
+    }
+    return set_shutdown(event, method, sync_disks, next_token);
+}
+
 /* Parse a configuration line */
-bool parse_config_line(char *line, mapping_list_t *list,
+bool parse_config_line(char *config_line, mapping_list_t *list,
     uint32_t *monitored_gpio_mask)
 {
-    int button_count = 0, button, key = 0;
-    parse_state_t state = STATE_INIT;
-    char *token, *next_token, *token_end = NULL, *s;
+    int button_count = 0, button, key_count = 0, value, axis = -1;
+    int action = -1;
+    int keys[MAX_MAPPING_KEYS];
+    parse_state_t state = STATE_INIT, option, option_return = STATE_INIT;
+    char *token, *next_token, *token_end = NULL, *variant_token, *s;
     bool expecting_button = true;
     bool skip_read_token = false;
+    bool key_found = false;
+    bool toggle = false;
     uint32_t gpio_mask = 0;
+    mapping_variant_t variant = VARIANT_NONE;
     mapping_t *existing_mapping, new_mapping;
+    mapping_list_t *target_list;
+    const char *command = NULL;
+    command_options_t options = {POLICY_DEFAULT, 0, 0, 0, 0, 0};
 
+    /* Inside a layer block, the mappings go to the layer mapping list */
+    target_list = layer_list != NULL ? layer_list : list;
     buffer[0] = '\0';
-    token = strtok_r(line, " \t\n", &next_token);
+    memset(&new_mapping, 0, sizeof (new_mapping));
+    token = strtok_r(config_line, " \t\n", &next_token);
     while (token != NULL) {
         switch (state) {
         case STATE_INIT:
@@ -218,6 +511,26 @@ bool parse_config_line(char *line, mapping_list_t *list,
 
         case STATE_UNMAP:
         case STATE_MAP:
+        case STATE_LAYER:
+            if (toggle) {
+                FK_ERROR("Unexpected token \"%s\" after TOGGLE\n", token);
+                return false;
+            }
+            if (state == STATE_LAYER && expecting_button == false &&
+                strcasecmp(token, "TOGGLE") == 0) {
+
+                /* Toggle layer */
+                toggle = true;
+                break;
+            }
+            if (state == STATE_MAP && expecting_button == false &&
+                (option = lookup_option(token)) != STATE_INVALID) {
+
+                /* Mapping option, followed by its value */
+                option_return = state;
+                state = option;
+                break;
+            }
             if (strcasecmp(token, "TO") == 0) {
                 if (state != STATE_MAP) {
                     FK_ERROR("Unexpected keyword \"TO\"\n");
@@ -237,6 +550,22 @@ bool parse_config_line(char *line, mapping_list_t *list,
                 state = STATE_FUNCTION;
                 break;
             }
+            if (variant != VARIANT_NONE) {
+
+                /* The press variant ends the button combination */
+                FK_ERROR("Unexpected button after press variant\n");
+                return false;
+            }
+            variant_token = strchr(token, ':');
+            if (variant_token != NULL) {
+
+                /* Press variant suffix */
+                *variant_token = '\0';
+                if ((value = lookup_variant(variant_token + 1)) < 0) {
+                    return false;
+                }
+                variant = value;
+            }
             do {
                 token_end = strchr(token, '+');
                 if (token_end != NULL) {
@@ -286,6 +615,8 @@ bool parse_config_line(char *line, mapping_list_t *list,
 
         case STATE_CLEAR:
         case STATE_DUMP:
+        case STATE_STATS:
+        case STATE_END:
             break;
 
         case STATE_SLEEP:
@@ -295,9 +626,16 @@ bool parse_config_line(char *line, mapping_list_t *list,
                     return false;
                 }
             }
+
+            /* Fall through */
         case STATE_LOAD:
+        case STATE_PRELOAD:
+        case STATE_USE:
+        case STATE_SERVER:
+        case STATE_SHUTDOWN:
         case STATE_SAVE:
         case STATE_TYPE:
+        case STATE_SIM:
             if (buffer[0] != '\0') {
                 strncat(buffer, " ", MAX_LINE_LENGTH);
             }
@@ -321,13 +659,149 @@ bool parse_config_line(char *line, mapping_list_t *list,
             break;
 
         case STATE_KEY:
-            if ((key = lookup_key(token)) >= 0) {
+            if (keyword == STATE_MAP && key_found == true &&
+                (option = lookup_option(token)) != STATE_INVALID) {
+
+                /* Mapping option after the key, followed by its value */
+                option_return = state;
+                state = option;
+                break;
+            }
+            if (keyword == STATE_MAP && key_found == true &&
+                strcasecmp(token, "COMMAND") == 0) {
+
+                /* Command run along with the keys, up to the end of line */
+                state = STATE_COMMAND;
+                break;
+            }
+            if ((key_count = lookup_keys(token, keys)) > 0) {
+                key_found = true;
                 break;
             } else {
                 return false;
             }
             break;
 
+        case STATE_CHORD:
+
+            /* The chord windows only apply to the base mappings */
+            if (layer_list != NULL) {
+                FK_ERROR("CHORD inside a layer block\n");
+                return false;
+            }
+            if ((value = lookup_number(token, 1, MAX_CHORD_MS)) < 0) {
+                return false;
+            }
+            new_mapping.chord_ms = value;
+            state = option_return;
+            break;
+
+        case STATE_REPEAT:
+        case STATE_TURBO:
+            if ((value = lookup_rate(token)) < 0) {
+                return false;
+            }
+            new_mapping.repeat = state == STATE_TURBO ? REPEAT_TURBO :
+                REPEAT_AUTO;
+            new_mapping.rate_hz = value;
+            state = option_return;
+            break;
+
+        case STATE_POLICY:
+            if ((options.policy == POLICY_QUEUE ||
+                options.policy == POLICY_PARALLEL) && options.limit == 0) {
+
+                /* Limit of the queued or parallel executions */
+                if ((value = lookup_number(token, 1, MAX_COMMAND_LIMIT)) < 0) {
+                    return false;
+                }
+                options.limit = value;
+                state = option_return;
+                break;
+            }
+            if ((value = lookup_command_policy(token)) < 0) {
+                FK_ERROR("Unknown command policy \"%s\"\n", token);
+                return false;
+            }
+            options.policy = value;
+            options.limit = 0;
+            if (value != POLICY_QUEUE && value != POLICY_PARALLEL) {
+                state = option_return;
+            }
+            break;
+
+        case STATE_NICE:
+            if ((value = lookup_step(token, -MIN_COMMAND_NICE)) == 0) {
+                return false;
+            }
+            if (value > MAX_COMMAND_NICE) {
+                FK_ERROR("Nice increment %d out of range [%d-%d]\n", value,
+                    MIN_COMMAND_NICE, MAX_COMMAND_NICE);
+                return false;
+            }
+            options.nice = value;
+            state = option_return;
+            break;
+
+        case STATE_CPUS:
+            if ((value = lookup_cpus(token)) < 0) {
+                return false;
+            }
+            options.cpu_mask = value;
+            state = option_return;
+            break;
+
+        case STATE_CGROUP:
+            if ((value = register_command_cgroup(token)) < 0) {
+                return false;
+            }
+            options.cgroup = value;
+            state = option_return;
+            break;
+
+        case STATE_TIMEOUT:
+            if ((value = lookup_number(token, 1, MAX_COMMAND_TIMEOUT_MS)) < 0) {
+                return false;
+            }
+            options.timeout_ms = value;
+            state = option_return;
+            break;
+
+        case STATE_MOUSE:
+            if (axis < 0) {
+                if ((axis = lookup_axis(token)) < 0) {
+                    return false;
+                }
+                break;
+            }
+            if (new_mapping.step != 0) {
+                FK_ERROR("Unexpected token \"%s\" after mouse step\n", token);
+                return false;
+            }
+            if ((new_mapping.step = lookup_step(token, MAX_MOUSE_STEP)) == 0) {
+                return false;
+            }
+            break;
+
+        case STATE_ACTION:
+            if (action < 0) {
+                if ((action = lookup_native_action(token)) < 0) {
+                    FK_ERROR("Unknown native action \"%s\"\n", token);
+                    return false;
+                }
+                break;
+            }
+            if (new_mapping.step != 0 || action == ACTION_SNAPSHOT) {
+                FK_ERROR("Unexpected token \"%s\" after native action\n",
+                    token);
+                return false;
+            }
+            if ((new_mapping.step = lookup_step(token, MAX_ACTION_STEP)) ==
+                0) {
+                return false;
+            }
+            break;
+
         case STATE_COMMAND:
             if (buffer[0] != '\0') {
                 strncat(buffer, " ", MAX_BUFFER_LENGTH);
@@ -344,17 +818,27 @@ bool parse_config_line(char *line, mapping_list_t *list,
         }
         skip_read_token=false;
     }
+    if (state == STATE_COMMAND && key_found == true) {
+
+        /* Key mapping with a command */
+        if (buffer[0] == '\0') {
+            FK_ERROR("Missing command after keys\n");
+            return false;
+        }
+        command = buffer;
+        state = STATE_KEY;
+    }
     switch (state) {
     case STATE_UNMAP:
         FK_DEBUG("UNMAP gpio_mask 0x%04X button_count %d\n", gpio_mask,
             button_count);
-        existing_mapping = find_mapping(list, gpio_mask);
+        existing_mapping = find_mapping(target_list, gpio_mask, variant);
         if (existing_mapping == NULL) {
             FK_ERROR("Cannot find mapping with gpio_mask 0x%04X\n",
                 gpio_mask);
             return false;
         }
-        if (remove_mapping(list, existing_mapping) == false) {
+        if (remove_mapping(target_list, existing_mapping) == false) {
             FK_ERROR("Cannot remove mapping with gpio_mask 0x%04X\n",
                 gpio_mask);
             return false;
@@ -363,12 +847,76 @@ bool parse_config_line(char *line, mapping_list_t *list,
 
     case STATE_CLEAR:
         FK_DEBUG("CLEAR\n");
-        clear_mapping_list(list);
+        clear_mapping_list(target_list);
+        break;
+
+    case STATE_LAYER:
+        FK_DEBUG("LAYER gpio_mask 0x%04X%s\n", gpio_mask,
+            toggle ? " toggle" : "");
+        if (layer_list != NULL) {
+            FK_ERROR("Nested layer\n");
+            return false;
+        }
+        if (button_count == 0 || expecting_button == true) {
+            FK_ERROR("Missing layer button\n");
+            return false;
+        }
+        if (variant != VARIANT_NONE) {
+            FK_ERROR("Unexpected press variant for a layer\n");
+            return false;
+        }
+        layer_list = insert_layer(list, gpio_mask, toggle);
+        if (layer_list == NULL) {
+            FK_ERROR("Cannot add layer with gpio_mask 0x%04X\n", gpio_mask);
+            return false;
+        }
+        *monitored_gpio_mask |= gpio_mask;
+        break;
+
+    case STATE_END:
+        FK_DEBUG("END\n");
+        if (layer_list == NULL) {
+            FK_ERROR("END without LAYER\n");
+            return false;
+        }
+        layer_list = NULL;
         break;
 
     case STATE_LOAD:
         FK_DEBUG("LOAD file \"%s\"\n", buffer);
-        return parse_config_file(buffer, list, monitored_gpio_mask);
+        if (layer_list != NULL) {
+            FK_ERROR("LOAD inside a layer block\n");
+            return false;
+        }
+        return load_config_file(buffer, list, monitored_gpio_mask);
+        break;
+
+    case STATE_PRELOAD:
+        FK_DEBUG("PRELOAD \"%s\"\n", buffer);
+        if (layer_list != NULL) {
+            FK_ERROR("PRELOAD inside a layer block\n");
+            return false;
+        }
+        return preload_config_file(buffer, list, monitored_gpio_mask);
+        break;
+
+    case STATE_USE:
+        FK_DEBUG("USE profile \"%s\"\n", buffer);
+        if (layer_list != NULL || loading) {
+            FK_ERROR("USE inside a layer block or a loaded file\n");
+            return false;
+        }
+        return use_profile(list, buffer);
+        break;
+
+    case STATE_SERVER:
+        FK_DEBUG("SERVER \"%s\"\n", buffer);
+        return start_server(buffer);
+        break;
+
+    case STATE_SHUTDOWN:
+        FK_DEBUG("SHUTDOWN \"%s\"\n", buffer);
+        return configure_shutdown(buffer);
         break;
 
     case STATE_SLEEP:
@@ -381,40 +929,46 @@ bool parse_config_line(char *line, mapping_list_t *list,
         break;
 
     case STATE_KEY:
+        if (key_count == 0) {
+            FK_ERROR("Missing key\n");
+            return false;
+        }
         switch (keyword) {
         case STATE_KEYUP:
-            sendKey(key, 0);
+            release_keys(keys, key_count);
             break;
 
         case STATE_KEYDOWN:
-            sendKey(key, 1);
+            press_keys(keys, key_count, REPEAT_DEFAULT, 0);
             break;
 
         case STATE_KEYPRESS:
-            sendKey(key, 1);
+            sendKeys(keys, key_count, 1);
             usleep(200 * 1000);
-            sendKey(key, 0);
+            sendKeys(keys, key_count, 0);
             break;
 
         case STATE_MAP:
-            FK_DEBUG("MAP gpio_mask 0x%04X to key %d, button_count %d\n",
-                gpio_mask, key, button_count);
-            existing_mapping = find_mapping(list, gpio_mask);
-            if (existing_mapping != NULL) {
-                FK_DEBUG("Existing mapping with gpio_mask 0x%04X found\n",
-                    gpio_mask);
-                if (remove_mapping(list, existing_mapping) == false) {
-                    FK_ERROR("Cannot remove mapping with gpio_mask 0x%04X\n",
-                        gpio_mask);
-                    return false;
-                }
+            FK_DEBUG("MAP gpio_mask 0x%04X to %d keys %d, button_count %d\n",
+                gpio_mask, key_count, keys[0], button_count);
+            if (remove_conflicting_mappings(target_list, gpio_mask, variant) ==
+                false) {
+                return false;
             }
             new_mapping.gpio_mask = gpio_mask;
+            new_mapping.variant = variant;
             new_mapping.bit_count = button_count;
             new_mapping.activated = false;
+            if (command == NULL &&
+                equal_command_options(&options, &default_options) == false) {
+                FK_ERROR("Command option for a mapping without command\n");
+                return false;
+            }
             new_mapping.type = MAPPING_KEY;
-            new_mapping.value.keycode = key;
-            if (insert_mapping(list, &new_mapping) == false) {
+            new_mapping.keycode = keys[0];
+            new_mapping.key_count = key_count;
+            if (insert_mapping(target_list, &new_mapping, keys, command,
+                &options) == false) {
                 FK_ERROR("Cannot add mapping with gpio_mask 0x%04X\n",
                     gpio_mask);
                 return false;
@@ -431,34 +985,115 @@ bool parse_config_line(char *line, mapping_list_t *list,
     case STATE_COMMAND:
         FK_DEBUG("MAP gpio_mask 0x%04X to command \"%s\", button_count %d\n",
             gpio_mask, buffer, button_count);
-        FK_DEBUG("MAP gpio_mask 0x%04X to key %d, button_count %d\n",
-            gpio_mask, key, button_count);
-        existing_mapping = find_mapping(list, gpio_mask);
-        if (existing_mapping != NULL) {
-            FK_DEBUG("Existing mapping with gpio_mask 0x%04X found\n",
-                gpio_mask);
-            if (remove_mapping(list, existing_mapping) == false) {
-                FK_ERROR("Cannot remove mapping with gpio_mask 0x%04X\n",
-                    gpio_mask);
-                return false;
-            }
+        if (new_mapping.repeat != REPEAT_DEFAULT) {
+            FK_ERROR("Repeat option for a command mapping\n");
+            return false;
+        }
+        if (remove_conflicting_mappings(target_list, gpio_mask, variant) ==
+            false) {
+            return false;
         }
         new_mapping.gpio_mask = gpio_mask;
+        new_mapping.variant = variant;
         new_mapping.bit_count = button_count;
         new_mapping.activated = false;
         new_mapping.type = MAPPING_COMMAND;
-        new_mapping.value.command = buffer;
-        if (insert_mapping(list, &new_mapping) == false) {
+        new_mapping.keycode = 0;
+        if (insert_mapping(target_list, &new_mapping, NULL, buffer,
+            &options) == false) {
+            FK_ERROR("Cannot add mapping with gpio_mask 0x%04X\n",
+                gpio_mask);
+            return false;
+        }
+        break;
+
+    case STATE_MOUSE:
+        FK_DEBUG("MAP gpio_mask 0x%04X to mouse axis %d step %d, "
+            "button_count %d\n", gpio_mask, axis, new_mapping.step,
+            button_count);
+        if (new_mapping.step == 0) {
+            FK_ERROR("Missing mouse axis or step\n");
+            return false;
+        }
+        if (new_mapping.repeat != REPEAT_DEFAULT ||
+            variant != VARIANT_NONE) {
+            FK_ERROR("Repeat option or press variant for a mouse mapping\n");
+            return false;
+        }
+        if (equal_command_options(&options, &default_options) == false) {
+            FK_ERROR("Command option for a mapping without command\n");
+            return false;
+        }
+        if (remove_conflicting_mappings(target_list, gpio_mask, variant) ==
+            false) {
+            return false;
+        }
+        new_mapping.gpio_mask = gpio_mask;
+        new_mapping.variant = variant;
+        new_mapping.bit_count = button_count;
+        new_mapping.activated = false;
+        new_mapping.type = MAPPING_MOUSE;
+        new_mapping.keycode = axis;
+        if (insert_mapping(target_list, &new_mapping, NULL, NULL, NULL) ==
+            false) {
             FK_ERROR("Cannot add mapping with gpio_mask 0x%04X\n",
                 gpio_mask);
             return false;
         }
+        *monitored_gpio_mask |= gpio_mask;
+        break;
+
+    case STATE_ACTION:
+        FK_DEBUG("MAP gpio_mask 0x%04X to native action %d step %d, "
+            "button_count %d\n", gpio_mask, action, new_mapping.step,
+            button_count);
+        if (action < 0 ||
+            (new_mapping.step == 0 && action != ACTION_SNAPSHOT)) {
+            FK_ERROR("Missing native action or step\n");
+            return false;
+        }
+        if (new_mapping.repeat != REPEAT_DEFAULT) {
+            FK_ERROR("Repeat option for a native action mapping\n");
+            return false;
+        }
+        if (equal_command_options(&options, &default_options) == false) {
+            FK_ERROR("Command option for a mapping without command\n");
+            return false;
+        }
+        if (remove_conflicting_mappings(target_list, gpio_mask, variant) ==
+            false) {
+            return false;
+        }
+        new_mapping.gpio_mask = gpio_mask;
+        new_mapping.variant = variant;
+        new_mapping.bit_count = button_count;
+        new_mapping.activated = false;
+        new_mapping.type = MAPPING_ACTION;
+        new_mapping.keycode = action;
+        if (insert_mapping(target_list, &new_mapping, NULL, NULL, NULL) ==
+            false) {
+            FK_ERROR("Cannot add mapping with gpio_mask 0x%04X\n",
+                gpio_mask);
+            return false;
+        }
+        *monitored_gpio_mask |= gpio_mask;
         break;
 
     case STATE_DUMP:
         dump_mapping_list(list);
         break;
 
+    case STATE_STATS:
+        dump_gpio_stats();
+        break;
+
+#ifdef SIMULATION
+    case STATE_SIM:
+        FK_DEBUG("SIM \"%s\"\n", buffer);
+        return sim_command(buffer);
+        break;
+#endif
+
     case STATE_SAVE:
         FK_DEBUG("SAVE file \"%s\"\n", buffer);
         return save_mapping_list(buffer, list);
@@ -468,6 +1103,17 @@ bool parse_config_line(char *line, mapping_list_t *list,
     case STATE_MAP:
        break;
 
+    case STATE_CHORD:
+    case STATE_REPEAT:
+    case STATE_TURBO:
+    case STATE_POLICY:
+    case STATE_NICE:
+    case STATE_CPUS:
+    case STATE_CGROUP:
+    case STATE_TIMEOUT:
+        FK_ERROR("Missing option value\n");
+        return false;
+
     default:
         FK_ERROR("Unknown result state %d\n", state);
         return false;
@@ -475,26 +1121,113 @@ bool parse_config_line(char *line, mapping_list_t *list,
     return true;
 }
 
-/* Parse a configuration file */
+/* Load a configuration file: the current mapping list is copied off to the
+ * side, the file is parsed into the copy, which is then published at once,
+ * so that the GPIO events never see a partially loaded mapping list. The
+ * files loaded from a file being loaded are parsed into the same copy
+ */
+static bool load_config_file(const char *name, mapping_list_t *list,
+    uint32_t *monitored_gpio_mask)
+{
+    mapping_list_t new_list;
+    bool result;
+
+    if (loading) {
+        return parse_config_file(name, list, monitored_gpio_mask);
+    }
+    init_mapping_list(&new_list);
+    if (copy_mapping_list(&new_list, list) == false) {
+        FK_ERROR("Cannot copy mapping list\n");
+        free_mapping_list(&new_list);
+        return false;
+    }
+    loading = true;
+    result = parse_config_file(name, &new_list, monitored_gpio_mask);
+    loading = false;
+    if (result == false) {
+
+        /* Keep the current mapping list */
+        free_mapping_list(&new_list);
+        return false;
+    }
+    publish_mapping_list(list, &new_list);
+    return true;
+}
+
+/* Preload a configuration file as a resident profile: the file is parsed
+ * into a new mapping list, which is kept with its compiled mapping tables
+ * until it is used
+ */
+static bool preload_config_file(char *arguments, mapping_list_t *list,
+    uint32_t *monitored_gpio_mask)
+{
+    char name[MAX_PROFILE_NAME_LENGTH + 1], *file;
+    mapping_list_t new_list;
+    bool outer_loading, result;
+
+    file = strchr(arguments, ' ');
+    if (file == NULL) {
+        FK_ERROR("Missing profile file\n");
+        return false;
+    }
+    *file++ = '\0';
+    if (strlen(arguments) > MAX_PROFILE_NAME_LENGTH) {
+        FK_ERROR("Profile name \"%s\" too long\n", arguments);
+        return false;
+    }
+
+    /* The argument buffer is reused while parsing the file */
+    strcpy(name, arguments);
+    init_mapping_list(&new_list);
+    outer_loading = loading;
+    loading = true;
+    result = parse_config_file(file, &new_list, monitored_gpio_mask);
+    loading = outer_loading;
+    if (result == false ||
+        preload_profile(list, name, &new_list) == false) {
+        free_mapping_list(&new_list);
+        return false;
+    }
+    return true;
+}
+
+/* Parse a configuration file, returns false upon a parse error or a missing
+ * END, the lines parsed before being left in the mapping list
+ */
 bool parse_config_file(const char *name, mapping_list_t *list,
     uint32_t *monitored_gpio_mask)
 {
     FILE *fp;
+    char file_name[MAX_LINE_LENGTH + 1];
     int line_number = 0;
+    mapping_list_t *outer_layer_list;
+    bool result = true;
 
     FK_NOTICE("LOAD file %s\n", name);
     if ((fp = fopen(name, "r")) == NULL) {
         FK_ERROR("Cannot open file \"%s\"\n", name);
         return false;
     }
+
+    /* The name may be in the line buffer, which is reused while parsing */
+    snprintf(file_name, sizeof (file_name), "%s", name);
+    name = file_name;
+
+    /* A file starts outside of any layer block */
+    outer_layer_list = layer_list;
+    layer_list = NULL;
     while (!feof(fp)) {
         if (fgets(line, MAX_LINE_LENGTH, fp) != line) {
             if (!feof(fp)) {
                 FK_ERROR("Error reading file \"%s\": %s\n", name,
                     strerror(errno));
                 fclose(fp);
+                layer_list = outer_layer_list;
                 return false;
             }
+
+            /* End of file, the previous line must not be parsed again */
+            break;
         }
         line_number++;
         if (line[0] == '#') {
@@ -509,9 +1242,15 @@ bool parse_config_file(const char *name, mapping_list_t *list,
         /* Parse a configuration line */
         if (parse_config_line(line, list, monitored_gpio_mask) == false) {
             FK_ERROR("line %d\n", line_number);
+            result = false;
             break;
         }
     }
     fclose(fp);
-    return true;
+    if (result && layer_list != NULL) {
+        FK_ERROR("Missing END in file \"%s\"\n", name);
+        result = false;
+    }
+    layer_list = outer_layer_list;
+    return result;
 }
@@ -71,8 +71,26 @@ typedef enum {GPIOS} button_t;
     X(STATE_FUNCTION, "FUNCTION") \
     X(STATE_KEY, "KEY") \
     X(STATE_COMMAND, "COMMAND")\
+    X(STATE_MOUSE, "MOUSE") \
+    X(STATE_ACTION, "ACTION") \
     X(STATE_DUMP, "DUMP") \
     X(STATE_SAVE, "SAVE") \
+    X(STATE_STATS, "STATS") \
+    X(STATE_SIM, "SIM") \
+    X(STATE_LAYER, "LAYER") \
+    X(STATE_END, "END") \
+    X(STATE_PRELOAD, "PRELOAD") \
+    X(STATE_USE, "USE") \
+    X(STATE_SERVER, "SERVER") \
+    X(STATE_SHUTDOWN, "SHUTDOWN") \
+    X(STATE_CHORD, "CHORD") \
+    X(STATE_REPEAT, "REPEAT") \
+    X(STATE_TURBO, "TURBO") \
+    X(STATE_POLICY, "POLICY") \
+    X(STATE_NICE, "NICE") \
+    X(STATE_CPUS, "CPUS") \
+    X(STATE_CGROUP, "CGROUP") \
+    X(STATE_TIMEOUT, "TIMEOUT") \
     X(STATE_INVALID, "INVALID")
 
 /* Enumeration of the different parse states */
@@ -82,7 +100,7 @@ typedef enum {PARSE_STATES} parse_state_t;
 
 const char *gpio_name(uint8_t gpio);
 const char *keycode_name(int keycode);
-bool parse_config_line(char *line, mapping_list_t *list,
+bool parse_config_line(char *config_line, mapping_list_t *list,
     uint32_t *monitored_gpio_mask);
 bool parse_config_file(const char *name, mapping_list_t *list,
     uint32_t *monitored_gpio_mask);
@@ -0,0 +1,219 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file shutdown.c
+ *  This file contains the shutdown functions
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "arena.h"
+#include "command_executor.h"
+#include "shutdown.h"
+
+//#define DEBUG_SHUTDOWN
+#define ERROR_SHUTDOWN
+
+#ifdef DEBUG_SHUTDOWN
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_SHUTDOWN
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Shutdown settings of an event, the command and its argument vector parsed
+ * beforehand being stored in its own arena
+ */
+typedef struct {
+    shutdown_method_t method;
+    bool sync_disks;
+    const char *command;
+    char *const *argv;
+    arena_t arena;
+} shutdown_t;
+
+#undef X
+#define X(a, b) b,
+static const char *event_names[] = {SHUTDOWN_EVENTS};
+
+#undef X
+#define X(a, b) b,
+static const char *method_names[] = {SHUTDOWN_METHODS};
+
+/* Shutdown settings of each event */
+static shutdown_t shutdowns[SHUTDOWN_NOE + 1];
+
+/* Initialize the shutdown settings of all events to the default command */
+bool init_shutdown(void)
+{
+    int event;
+
+    for (event = 0; event <= SHUTDOWN_NOE; event++) {
+        init_arena(&shutdowns[event].arena);
+        if (set_shutdown(event, METHOD_COMMAND, false,
+            DEFAULT_SHUTDOWN_COMMAND) == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Deinitialize the shutdown settings */
+void deinit_shutdown(void)
+{
+    int event;
+
+    for (event = 0; event <= SHUTDOWN_NOE; event++) {
+        free_arena(&shutdowns[event].arena);
+        shutdowns[event].command = NULL;
+        shutdowns[event].argv = NULL;
+    }
+}
+
+/* Set the shutdown settings of an event, the command is only used by the
+ * command method
+ */
+bool set_shutdown(shutdown_event_t event, shutdown_method_t method,
+    bool sync_disks, const char *command)
+{
+    shutdown_t *shutdown = &shutdowns[event];
+    const char *new_command = NULL;
+    char *const *new_argv = NULL;
+
+    reset_arena(&shutdown->arena);
+    if (method == METHOD_COMMAND) {
+        new_command = arena_intern(&shutdown->arena, command);
+        if (new_command == NULL) {
+            shutdown->command = NULL;
+            shutdown->argv = NULL;
+            return false;
+        }
+
+        /* Parse the command once, it is executed by the Shell otherwise */
+        new_argv = parse_command(&shutdown->arena, new_command);
+    }
+    FK_DEBUG("%s shutdown method %s sync %s command \"%s\"\n",
+        event_names[event], method_names[method],
+        sync_disks ? "true" : "false", new_command ? new_command : "");
+    shutdown->method = method;
+    shutdown->sync_disks = sync_disks;
+    shutdown->command = new_command;
+    shutdown->argv = new_argv;
+    return true;
+}
+
+/* Run the shutdown sequence of an event: the command is started or init is
+ * signaled first, and the file systems are synced while it proceeds
+ */
+void run_shutdown(shutdown_event_t event)
+{
+    shutdown_t *shutdown = &shutdowns[event];
+
+    switch (shutdown->method) {
+    case METHOD_COMMAND:
+        if (shutdown->command == NULL) {
+            FK_ERROR("Missing %s shutdown command\n", event_names[event]);
+            break;
+        }
+        FK_DEBUG("%s shutdown: execute command \"%s\"\n", event_names[event],
+            shutdown->command);
+        execute_shutdown_command(shutdown->command, shutdown->argv);
+        break;
+
+    case METHOD_INIT:
+        FK_DEBUG("%s shutdown: signal init\n", event_names[event]);
+#ifndef SIMULATION
+        if (kill(INIT_PID, INIT_SHUTDOWN_SIGNAL) < 0) {
+            FK_ERROR("Cannot signal init: %s\n", strerror(errno));
+        }
+#endif
+        break;
+
+    case METHOD_NONE:
+        FK_DEBUG("%s shutdown: none\n", event_names[event]);
+        break;
+
+    default:
+        FK_ERROR("Unknown shutdown method %d\n", shutdown->method);
+        break;
+    }
+    if (shutdown->sync_disks) {
+        FK_DEBUG("%s shutdown: sync\n", event_names[event]);
+        sync();
+    }
+}
+
+/* Get a shutdown event name */
+const char *shutdown_event_name(shutdown_event_t event)
+{
+    if (event <= SHUTDOWN_NOE) {
+        return event_names[event];
+    }
+    return "?";
+}
+
+/* Lookup a shutdown event from its name, returns -1 if unknown */
+int lookup_shutdown_event(const char *name)
+{
+    int event;
+
+    for (event = 0; event <= SHUTDOWN_NOE; event++) {
+        if (strcasecmp(name, event_names[event]) == 0) {
+            return event;
+        }
+    }
+    return -1;
+}
+
+/* Get a shutdown method name */
+const char *shutdown_method_name(shutdown_method_t method)
+{
+    if (method <= METHOD_NONE) {
+        return method_names[method];
+    }
+    return "?";
+}
+
+/* Lookup a shutdown method from its name, returns -1 if unknown */
+int lookup_shutdown_method(const char *name)
+{
+    int method;
+
+    for (method = 0; method <= METHOD_NONE; method++) {
+        if (strcasecmp(name, method_names[method]) == 0) {
+            return method;
+        }
+    }
+    return -1;
+}
@@ -0,0 +1,78 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+
+/**
+ *  @file shutdown.h
+ *  This file contains the shutdown functions
+ *
+ *  Upon a long Power Enable Key (PEK) press or a Reed switch (NOE) signal,
+ *  the AXP209 cuts the power 3 s later anyway, so the shutdown sequence is
+ *  started at once from settings prepared beforehand for each event: either
+ *  a command executed directly without any Shell, or a signal sent to init,
+ *  optionally followed by a sync of the file systems.
+ */
+
+#ifndef _SHUTDOWN_H_
+#define _SHUTDOWN_H_
+
+#include <signal.h>
+#include <stdbool.h>
+
+/* Definition of the different shutdown events */
+#define SHUTDOWN_EVENTS \
+    X(SHUTDOWN_PEK, "PEK") \
+    X(SHUTDOWN_NOE, "NOE")
+
+/* Enumeration of the different shutdown events */
+#undef X
+#define X(a, b) a,
+typedef enum {SHUTDOWN_EVENTS} shutdown_event_t;
+
+/* Definition of the different shutdown methods */
+#define SHUTDOWN_METHODS \
+    X(METHOD_COMMAND, "COMMAND") \
+    X(METHOD_INIT, "INIT") \
+    X(METHOD_NONE, "NONE")
+
+/* Enumeration of the different shutdown methods */
+#undef X
+#define X(a, b) a,
+typedef enum {SHUTDOWN_METHODS} shutdown_method_t;
+
+/* Default shutdown command */
+#define DEFAULT_SHUTDOWN_COMMAND    "powerdown schedule 0.1"
+
+/* Signal requesting a power off from the BusyBox init process */
+#define INIT_PID                    1
+#define INIT_SHUTDOWN_SIGNAL        SIGUSR2
+
+bool init_shutdown(void);
+void deinit_shutdown(void);
+bool set_shutdown(shutdown_event_t event, shutdown_method_t method,
+    bool sync_disks, const char *command);
+void run_shutdown(shutdown_event_t event);
+const char *shutdown_event_name(shutdown_event_t event);
+int lookup_shutdown_event(const char *name);
+const char *shutdown_method_name(shutdown_method_t method);
+int lookup_shutdown_method(const char *name);
+
+#endif // _SHUTDOWN_H_
@@ -24,7 +24,7 @@
 #include <errno.h>
 #include <stddef.h>
 #include "smbus.h"
-#include <sys/ioctl.h>
+#include "i2c_regmap.h"
 #include <linux/types.h>
 #include <linux/i2c.h>
 #include <linux/i2c-dev.h>
@@ -48,7 +48,7 @@ __s32 i2c_smbus_access(int file, char read_write, __u8 command,
 	args.size = size;
 	args.data = data;
 
-	err = ioctl(file, I2C_SMBUS, &args);
+	err = i2c_ioctl(file, I2C_SMBUS, (unsigned long) &args);
 	if (err == -1)
 		err = -errno;
 	return err;
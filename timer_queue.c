@@ -0,0 +1,181 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file timer_queue.c
+ *  This file contains the timer queue functions driven by the main loop
+ */
+
+#include <stdio.h>
+#include <syslog.h>
+#include <time.h>
+#include "timer_queue.h"
+
+//#define DEBUG_TIMER_QUEUE
+#define ERROR_TIMER_QUEUE
+
+#ifdef DEBUG_TIMER_QUEUE
+    #define FK_DEBUG(...) syslog(LOG_DEBUG, __VA_ARGS__);
+#else
+    #define FK_DEBUG(...)
+#endif
+
+#ifdef ERROR_TIMER_QUEUE
+    #define FK_ERROR(...) syslog(LOG_ERR, __VA_ARGS__);
+#else
+    #define FK_ERROR(...)
+#endif
+
+/* Timer identifiers hold the timer slot index in their low bits and a
+ * sequence number in their high bits, so that a stale identifier for an
+ * already expired timer can never cancel another timer reusing the same slot
+ */
+#define TIMER_SLOT_BITS     8
+#define TIMER_SLOT_MASK     ((1 << TIMER_SLOT_BITS) - 1)
+
+/* Timer slot */
+typedef struct {
+    uint64_t deadline_us;
+    uint64_t period_us;
+    timer_callback_t callback;
+    void *data;
+    int id;
+    bool armed;
+} queued_timer_t;
+
+/* Timer slots */
+static queued_timer_t timers[MAX_NUM_TIMERS];
+
+/* Sequence number for timer identifiers */
+static int timer_sequence;
+
+/* Initialize the timer queue */
+void init_timer_queue(void)
+{
+    int i;
+
+    for (i = 0; i < MAX_NUM_TIMERS; i++) {
+        timers[i].armed = false;
+        timers[i].id = NO_TIMER;
+    }
+    timer_sequence = 0;
+}
+
+/* Get the monotonic time in microseconds */
+uint64_t get_time_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* Arm a timer expiring after the given delay, and then every period if not
+ * null, returns the timer identifier or NO_TIMER if none is available
+ */
+int add_timer(uint64_t delay_us, uint64_t period_us, timer_callback_t callback,
+    void *data)
+{
+    int i;
+
+    for (i = 0; i < MAX_NUM_TIMERS; i++) {
+        if (!timers[i].armed) {
+            timer_sequence = (timer_sequence + 1) & (0x7FFFFF);
+            timers[i].deadline_us = get_time_us() + delay_us;
+            timers[i].period_us = period_us;
+            timers[i].callback = callback;
+            timers[i].data = data;
+            timers[i].id = (timer_sequence << TIMER_SLOT_BITS) | i;
+            timers[i].armed = true;
+            FK_DEBUG("Add timer %d in %llu us\n", timers[i].id,
+                (unsigned long long) delay_us);
+            return timers[i].id;
+        }
+    }
+    FK_ERROR("No more timers available\n");
+    return NO_TIMER;
+}
+
+/* Disarm a timer */
+void cancel_timer(int timer)
+{
+    int i;
+
+    if (timer == NO_TIMER) {
+        return;
+    }
+    i = timer & TIMER_SLOT_MASK;
+    if (i < MAX_NUM_TIMERS && timers[i].armed && timers[i].id == timer) {
+        FK_DEBUG("Cancel timer %d\n", timer);
+        timers[i].armed = false;
+    }
+}
+
+/* Get the delay until the next timer expiration, returns false if no timer is
+ * armed
+ */
+bool get_timer_timeout(struct timeval *timeout)
+{
+    int i;
+    bool found = false;
+    uint64_t now, deadline_us = 0;
+
+    for (i = 0; i < MAX_NUM_TIMERS; i++) {
+        if (timers[i].armed && (!found ||
+            timers[i].deadline_us < deadline_us)) {
+            deadline_us = timers[i].deadline_us;
+            found = true;
+        }
+    }
+    if (found) {
+        now = get_time_us();
+        deadline_us = deadline_us > now ? deadline_us - now : 0;
+        timeout->tv_sec = deadline_us / 1000000;
+        timeout->tv_usec = deadline_us % 1000000;
+    }
+    return found;
+}
+
+/* Run the callbacks of all expired timers */
+void process_timer_queue(void)
+{
+    int i;
+    uint64_t now = get_time_us();
+
+    for (i = 0; i < MAX_NUM_TIMERS; i++) {
+        if (timers[i].armed && timers[i].deadline_us <= now) {
+            if (timers[i].period_us) {
+
+                /* Periodic timers are rescheduled from their previous deadline
+                 * to avoid drifting, unless we are late by a whole period
+                 */
+                timers[i].deadline_us += timers[i].period_us;
+                if (timers[i].deadline_us <= now) {
+                    timers[i].deadline_us = now + timers[i].period_us;
+                }
+            } else {
+                timers[i].armed = false;
+            }
+            FK_DEBUG("Timer %d expired\n", timers[i].id);
+            timers[i].callback(timers[i].data);
+        }
+    }
+}
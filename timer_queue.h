@@ -0,0 +1,51 @@
+/*
+    Copyright (C) 2021 Michel Stempin <michel.stempin@funkey-project.com>
+
+    This file is part of the FunKey S GPIO keyboard daemon.
+
+    This is free software; you can redistribute it and/or
+    modify it under the terms of the GNU Lesser General Public
+    License as published by the Free Software Foundation; either
+    version 2.1 of the License, or (at your option) any later version.
+
+    The software is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+    Lesser General Public License for more details.
+
+    You should have received a copy of the GNU Lesser General Public
+    License along with the GNU C Library; if not, write to the Free
+    Software Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+    02111-1307 USA.
+*/
+
+/**
+ *  @file timer_queue.h
+ *  This file contains the timer queue functions driven by the main loop
+ */
+
+#ifndef _TIMER_QUEUE_H_
+#define _TIMER_QUEUE_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/time.h>
+
+/* Maximum number of simultaneously armed timers */
+#define MAX_NUM_TIMERS  64
+
+/* Invalid timer identifier */
+#define NO_TIMER        (-1)
+
+/* Timer expiration callback */
+typedef void (*timer_callback_t)(void *data);
+
+void init_timer_queue(void);
+uint64_t get_time_us(void);
+int add_timer(uint64_t delay_us, uint64_t period_us, timer_callback_t callback,
+    void *data);
+void cancel_timer(int timer);
+bool get_timer_timeout(struct timeval *timeout);
+void process_timer_queue(void);
+
+#endif // _TIMER_QUEUE_H_
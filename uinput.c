@@ -67,26 +67,95 @@ struct input_event_compat {
     unsigned int value;
 };
 
-#if TEST_UINPUT
-static int sendRel(int dx, int dy);
-#endif
 static int sendSync(void);
 
-#if TEST_UINPUT
-static struct input_event     uidev_ev;
-#endif
-static int uidev_fd;
+/* Maximum number of keys sent in a single frame */
+#define MAX_FRAME_KEYS 8
+
+static int uidev_fd = -1;
 /*static keyinfo_s lastkey;*/
 
+/* Gamepad device, and D-pad buttons currently pressed */
+static int gamepad_fd = -1;
+static int dpad_mask;
+
 #define die(str, args...) do { \
         perror(str); \
         return(EXIT_FAILURE); \
     } while(0)
 
+/* Same as die(), closing the uinput file descriptor being set up first */
+#define die_close(fd, str) do { \
+        perror(str); \
+        close(fd); \
+        return(EXIT_FAILURE); \
+    } while(0)
+
+/* Gamepad absolute axes: the D-pad hat, and a centered stick that lets the
+   user space libraries classify the device as a joystick */
+static const struct {
+  int code;
+  int minimum;
+  int maximum;
+} gamepad_axes[] = {
+  {ABS_X, -32767, 32767},
+  {ABS_Y, -32767, 32767},
+  {ABS_HAT0X, -1, 1},
+  {ABS_HAT0Y, -1, 1},
+};
+
+/* Create the gamepad device, with the BTN_GAMEPAD buttons and the D-pad hat */
+static int init_gamepad(void)
+{
+  int fd;
+  struct uinput_setup setup;
+  struct uinput_abs_setup abs_setup;
+  int i;
+
+  fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
+  if(fd < 0)
+    die("/dev/uinput");
+
+  if(ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0)
+    die_close(fd, "error: ioctl");
+  for(i = BTN_GAMEPAD; i <= BTN_THUMBR; i++){
+    if(ioctl(fd, UI_SET_KEYBIT, i) < 0)
+      die_close(fd, "error: ioctl");
+  }
+
+  if(ioctl(fd, UI_SET_EVBIT, EV_ABS) < 0)
+    die_close(fd, "error: ioctl");
+  for(i = 0; i < (int) (sizeof(gamepad_axes) / sizeof(gamepad_axes[0])); i++){
+    memset(&abs_setup, 0, sizeof(abs_setup));
+    abs_setup.code = gamepad_axes[i].code;
+    abs_setup.absinfo.minimum = gamepad_axes[i].minimum;
+    abs_setup.absinfo.maximum = gamepad_axes[i].maximum;
+    if(ioctl(fd, UI_SET_ABSBIT, gamepad_axes[i].code) < 0)
+      die_close(fd, "error: ioctl");
+    if(ioctl(fd, UI_ABS_SETUP, &abs_setup) < 0)
+      die_close(fd, "error: ioctl");
+  }
+
+  memset(&setup, 0, sizeof(setup));
+  snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "FunKey S gamepad");
+  setup.id.bustype = BUS_VIRTUAL;
+  setup.id.vendor  = 0x1;
+  setup.id.product = 0x2;
+  setup.id.version = 1;
+
+  if(ioctl(fd, UI_DEV_SETUP, &setup) < 0)
+    die_close(fd, "error: ioctl");
+  if(ioctl(fd, UI_DEV_CREATE) < 0)
+    die_close(fd, "error: ioctl");
+
+  gamepad_fd = fd;
+  return 0;
+}
+
 int init_uinput(void)
 {
   int fd;
-  struct uinput_user_dev uidev;
+  struct uinput_setup setup;
   int i;
 
   fd = open("/dev/uinput", O_WRONLY | O_NONBLOCK);
@@ -94,43 +163,44 @@ int init_uinput(void)
     die("/dev/uinput");
 
   if(ioctl(fd, UI_SET_EVBIT, EV_KEY) < 0)
-    die("error: ioctl");
+    die_close(fd, "error: ioctl");
   if(ioctl(fd, UI_SET_EVBIT, EV_REP) < 0)
-    die("error: ioctl");
+    die_close(fd, "error: ioctl");
   if(ioctl(fd, UI_SET_KEYBIT, BTN_LEFT) < 0)
-    die("error: ioctl");
+    die_close(fd, "error: ioctl");
 
   if(ioctl(fd, UI_SET_EVBIT, EV_REL) < 0)
-    die("error: ioctl");
+    die_close(fd, "error: ioctl");
   if(ioctl(fd, UI_SET_RELBIT, REL_X) < 0)
-    die("error: ioctl");
+    die_close(fd, "error: ioctl");
   if(ioctl(fd, UI_SET_RELBIT, REL_Y) < 0)
-    die("error: ioctl");
+    die_close(fd, "error: ioctl");
 
   /* don't forget to add all the keys! */
   for(i=0; i<256; i++){
     if(ioctl(fd, UI_SET_KEYBIT, i) < 0)
-      die("error: ioctl");
+      die_close(fd, "error: ioctl");
   }
 
-  memset(&uidev, 0, sizeof(uidev));
-  snprintf(uidev.name, UINPUT_MAX_NAME_SIZE, "uinput-sample");
-  uidev.id.bustype = BUS_USB;
-  uidev.id.vendor  = 0x1;
-  uidev.id.product = 0x1;
-  uidev.id.version = 1;
-
-  /*if(write(fd, &uidev, sizeof(uidev)) < 0)
-    die("error: write");*/
+  memset(&setup, 0, sizeof(setup));
+  snprintf(setup.name, UINPUT_MAX_NAME_SIZE, "uinput-sample");
+  setup.id.bustype = BUS_USB;
+  setup.id.vendor  = 0x1;
+  setup.id.product = 0x1;
+  setup.id.version = 1;
 
-  if(ioctl(fd, UI_DEV_SETUP, &uidev) < 0)
-	die("error: ioctl");
+  if(ioctl(fd, UI_DEV_SETUP, &setup) < 0)
+    die_close(fd, "error: ioctl");
 
   if(ioctl(fd, UI_DEV_CREATE) < 0)
-    die("error: ioctl");
+    die_close(fd, "error: ioctl");
 
   uidev_fd = fd;
 
+  /* The keyboard is still usable without the gamepad */
+  if(init_gamepad() != 0)
+    syslog(LOG_ERR, "Cannot create the gamepad device\n");
+
   sleep(1);
 
   return 0;
@@ -187,6 +257,13 @@ int close_uinput(void)
 {
   sleep(2);
 
+  if(gamepad_fd >= 0) {
+    if(ioctl(gamepad_fd, UI_DEV_DESTROY) < 0)
+      die("error: ioctl");
+    close(gamepad_fd);
+    gamepad_fd = -1;
+  }
+
   if(ioctl(uidev_fd, UI_DEV_DESTROY) < 0)
     die("error: ioctl");
 
@@ -195,9 +272,63 @@ int close_uinput(void)
   return 0;
 }
 
+/* Check if a key code is sent by the gamepad device */
+int isGamepadKey(int key)
+{
+  return (key >= BTN_GAMEPAD && key <= BTN_THUMBR) ||
+    (key >= BTN_DPAD_UP && key <= BTN_DPAD_RIGHT);
+}
+
+/* Send a gamepad button event, batched with its sync event in a single
+   write. The D-pad buttons drive the hat, opposite directions cancel out */
+static int sendGamepadKey(int key, int value)
+{
+  struct input_event_compat ie[2];
+  int bit;
+
+  memset(ie, 0, sizeof(ie));
+  if(key >= BTN_DPAD_UP && key <= BTN_DPAD_RIGHT) {
+    if(value == 2)
+      return 0;
+    /* D-pad mask bits in up, down, left and right order */
+    bit = 1 << (key - BTN_DPAD_UP);
+    dpad_mask = value ? dpad_mask | bit : dpad_mask & ~bit;
+    ie[0].type = EV_ABS;
+    if(key == BTN_DPAD_UP || key == BTN_DPAD_DOWN) {
+      ie[0].code = ABS_HAT0Y;
+      ie[0].value = !!(dpad_mask & 2) - !!(dpad_mask & 1);
+    } else {
+      ie[0].code = ABS_HAT0X;
+      ie[0].value = !!(dpad_mask & 8) - !!(dpad_mask & 4);
+    }
+  } else {
+    ie[0].type = EV_KEY;
+    ie[0].code = key;
+    ie[0].value = value;
+  }
+  ie[1].type = EV_SYN;
+  ie[1].code = SYN_REPORT;
+  FK_DEBUG("sendGamepadKey: %d %d = %d\n", ie[0].type, ie[0].code,
+    (int) ie[0].value);
+#ifdef SIMULATION
+  if(gamepad_fd < 0) {
+    /* No uinput device in simulation, just trace the gamepad events */
+    syslog(LOG_INFO, "sendGamepadKey: %d %d = %d\n", ie[0].type, ie[0].code,
+      (int) ie[0].value);
+    return 0;
+  }
+#endif
+  if(write(gamepad_fd, ie, sizeof(ie)) < 0)
+    die("error: write");
+  return 0;
+}
+
 int sendKey(int key, int value)
 {
   struct input_event_compat ie;
+
+  if(isGamepadKey(key))
+    return sendGamepadKey(key, value);
   //memset(&uidev_ev, 0, sizeof(struct input_event));
   //gettimeofday(&uidev_ev.time, NULL);
   ie.type = EV_KEY;
@@ -206,6 +337,13 @@ int sendKey(int key, int value)
   ie.time.tv_sec = 0;
   ie.time.tv_usec = 0;
   FK_DEBUG("sendKey: %d = %d\n", key, value);
+#ifdef SIMULATION
+  if(uidev_fd < 0) {
+    /* No uinput device in simulation, just trace the key events */
+    syslog(LOG_INFO, "sendKey: %d = %d\n", key, value);
+    return 0;
+  }
+#endif
   if(write(uidev_fd, &ie, sizeof(struct input_event_compat)) < 0)
     die("error: write");
 
@@ -214,28 +352,99 @@ int sendKey(int key, int value)
   return 0;
 }
 
-#if TEST_UINPUT
-static int sendRel(int dx, int dy)
+/* Send the events of several keys in a single frame: the key down events in
+   order and the key up events in reverse order, batched with their sync event
+   in a single write. The gamepad keys are sent by the gamepad device */
+int sendKeys(const int *keys, int count, int value)
 {
-  memset(&uidev_ev, 0, sizeof(struct input_event));
-  uidev_ev.type = EV_REL;
-  uidev_ev.code = REL_X;
-  uidev_ev.value = dx;
-  if(write(uidev_fd, &uidev_ev, sizeof(struct input_event)) < 0)
+  struct input_event_compat ie[MAX_FRAME_KEYS + 1];
+  int i, key, n = 0;
+
+  if(count == 1)
+    return sendKey(keys[0], value);
+  if(count > MAX_FRAME_KEYS)
+    count = MAX_FRAME_KEYS;
+  memset(ie, 0, sizeof(ie));
+  for(i = 0; i < count; i++) {
+    key = value ? keys[i] : keys[count - 1 - i];
+    if(isGamepadKey(key)) {
+      sendGamepadKey(key, value);
+      continue;
+    }
+    ie[n].type = EV_KEY;
+    ie[n].code = key;
+    ie[n++].value = value;
+    FK_DEBUG("sendKey: %d = %d\n", key, value);
+#ifdef SIMULATION
+    if(uidev_fd < 0)
+      syslog(LOG_INFO, "sendKey: %d = %d\n", key, value);
+#endif
+  }
+  if(n == 0)
+    return 0;
+#ifdef SIMULATION
+  if(uidev_fd < 0)
+    return 0;
+#endif
+  ie[n].type = EV_SYN;
+  ie[n++].code = SYN_REPORT;
+  if(write(uidev_fd, ie, n * sizeof(struct input_event_compat)) < 0)
     die("error: write");
+  return 0;
+}
 
-  memset(&uidev_ev, 0, sizeof(struct input_event));
-  uidev_ev.type = EV_REL;
-  uidev_ev.code = REL_Y;
-  uidev_ev.value = dy;
-  if(write(uidev_fd, &uidev_ev, sizeof(struct input_event)) < 0)
+/* Set an input core autorepeat parameter of the uinput device */
+int sendRep(int rep, int value)
+{
+  struct input_event_compat ie;
+  ie.type = EV_REP;
+  ie.code = rep;
+  ie.value = value;
+  ie.time.tv_sec = 0;
+  ie.time.tv_usec = 0;
+  FK_DEBUG("sendRep: %d = %d\n", rep, value);
+  if(uidev_fd < 0)
+    return -1;
+  if(write(uidev_fd, &ie, sizeof(struct input_event_compat)) < 0)
     die("error: write");
 
-  sendSync();
-
   return 0;
 }
+
+/* Send a relative pointer motion, batched with its sync event in a single
+   write */
+int sendRel(int dx, int dy)
+{
+  struct input_event_compat ie[3];
+  int count = 0;
+
+  memset(ie, 0, sizeof(ie));
+  if(dx) {
+    ie[count].type = EV_REL;
+    ie[count].code = REL_X;
+    ie[count++].value = dx;
+  }
+  if(dy) {
+    ie[count].type = EV_REL;
+    ie[count].code = REL_Y;
+    ie[count++].value = dy;
+  }
+  if(count == 0)
+    return 0;
+  ie[count].type = EV_SYN;
+  ie[count++].code = SYN_REPORT;
+  FK_DEBUG("sendRel: %d %d\n", dx, dy);
+#ifdef SIMULATION
+  if(uidev_fd < 0) {
+    /* No uinput device in simulation, just trace the motion events */
+    syslog(LOG_INFO, "sendRel: %d %d\n", dx, dy);
+    return 0;
+  }
 #endif
+  if(write(uidev_fd, ie, count * sizeof(struct input_event_compat)) < 0)
+    die("error: write");
+  return 0;
+}
 
 static int sendSync(void)
 {
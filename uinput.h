@@ -30,7 +30,11 @@ int init_uinput(void);
 int test_uinput(void);
 int close_uinput(void);
 int send_gpio_keys(int gpio, int value);
+int isGamepadKey(int key);
 int sendKey(int key, int value);
+int sendKeys(const int *keys, int count, int value);
+int sendRep(int rep, int value);
+int sendRel(int dx, int dy);
 //void get_last_key(keyinfo_s *kp);
 
 #endif   //_UINPUT_H_